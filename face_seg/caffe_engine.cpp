@@ -0,0 +1,147 @@
+#include "face_seg/caffe_engine.h"
+#include <chrono>
+
+using namespace caffe;
+typedef std::chrono::steady_clock Clock;
+
+namespace face_seg
+{
+	CaffeEngine::CaffeEngine(const std::string& deploy_file, const std::string& model_file,
+		bool with_gpu, int gpu_device_id) :
+		m_with_gpu(with_gpu), m_gpu_device_id(gpu_device_id)
+	{
+		initThread();
+
+		// Load the network, from a compiled model cache the weights are mapped
+		// instead of parsed and copied
+		if (ModelCache::isModelCache(model_file))
+		{
+			m_model_cache = std::make_shared<ModelCache>(model_file);
+			m_net_param = m_model_cache->netParameter();
+			m_net.reset(new Net<float>(m_net_param));
+			m_model_cache->apply(*m_net);
+		}
+		else
+		{
+			ReadNetParamsFromTextFileOrDie(deploy_file, &m_net_param);
+			m_net_param.mutable_state()->set_phase(caffe::TEST);
+			m_net.reset(new Net<float>(m_net_param));
+			m_net->CopyTrainedLayersFrom(model_file);
+		}
+		CHECK_EQ(m_net->num_inputs(), 1) << "Network should have exactly one input.";
+		CHECK_EQ(m_net->num_outputs(), 1) << "Network should have exactly one output.";
+	}
+
+	CaffeEngine::CaffeEngine(const CaffeEngine* other) :
+		m_net_param(other->m_net_param), m_model_cache(other->m_model_cache),
+		m_with_gpu(other->m_with_gpu), m_gpu_device_id(other->m_gpu_device_id)
+	{
+		initThread();
+
+		// Create the network and share the trained weights of the other engine
+		m_net.reset(new Net<float>(m_net_param));
+		m_net->ShareTrainedLayersWith(other->m_net.get());
+	}
+
+	std::shared_ptr<InferenceEngine> CaffeEngine::clone() const
+	{
+		return std::make_shared<CaffeEngine>(this);
+	}
+
+	void CaffeEngine::initThread() const
+	{
+		if (m_with_gpu)
+		{
+			Caffe::SetDevice(m_gpu_device_id);
+			Caffe::set_mode(Caffe::GPU);
+		}
+		else Caffe::set_mode(Caffe::CPU);
+	}
+
+	int CaffeEngine::inputChannels() const
+	{
+		return m_net->input_blobs()[0]->channels();
+	}
+
+	int CaffeEngine::inputNum() const
+	{
+		return m_net->input_blobs()[0]->num();
+	}
+
+	cv::Size CaffeEngine::inputSize() const
+	{
+		const Blob<float>* input_layer = m_net->input_blobs()[0];
+		return cv::Size(input_layer->width(), input_layer->height());
+	}
+
+	void CaffeEngine::reshapeInput(int num, const cv::Size& size)
+	{
+		Blob<float>* input_layer = m_net->input_blobs()[0];
+		if (input_layer->num() == num && input_layer->width() == size.width &&
+			input_layer->height() == size.height)
+			return;
+
+		// Reshape net
+		std::vector<int> shape = { num, input_layer->channels(), size.height, size.width };
+		input_layer->Reshape(shape);
+
+		// Forward dimension change to all layers
+		m_net->Reshape();
+	}
+
+	float* CaffeEngine::inputData(int n)
+	{
+		Blob<float>* input_layer = m_net->input_blobs()[0];
+		return input_layer->mutable_cpu_data() +
+			n * input_layer->channels() * input_layer->height() * input_layer->width();
+	}
+
+	void CaffeEngine::forward()
+	{
+		m_net->Forward();
+	}
+
+	void CaffeEngine::forward(std::vector<double>& layer_times)
+	{
+		// Forward one layer at a time and measure each of them
+		layer_times.resize(m_net->layer_names().size());
+		for (int i = 0; i < (int)layer_times.size(); ++i)
+		{
+			Clock::time_point t = Clock::now();
+			m_net->ForwardFromTo(i, i);
+#ifndef CPU_ONLY
+			if (m_with_gpu) cudaDeviceSynchronize();
+#endif
+			layer_times[i] = std::chrono::duration<double>(Clock::now() - t).count();
+		}
+	}
+
+	std::string CaffeEngine::netName() const
+	{
+		return m_net->name();
+	}
+
+	const std::vector<std::string>& CaffeEngine::layerNames() const
+	{
+		return m_net->layer_names();
+	}
+
+	int CaffeEngine::outputChannels() const
+	{
+		return m_net->output_blobs()[0]->channels();
+	}
+
+	cv::Size CaffeEngine::outputSize() const
+	{
+		const Blob<float>* output_layer = m_net->output_blobs()[0];
+		return cv::Size(output_layer->width(), output_layer->height());
+	}
+
+	const float* CaffeEngine::outputData(int n) const
+	{
+		const Blob<float>* output_layer = m_net->output_blobs()[0];
+		return output_layer->cpu_data() +
+			n * output_layer->channels() * output_layer->height() * output_layer->width();
+	}
+
+}   // namespace face_seg
@@ -0,0 +1,101 @@
+#include "face_seg/client.h"
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace face_seg
+{
+	// Offsets in the shared memory are aligned to cache lines
+	static size_t alignOffset(size_t offset)
+	{
+		return (offset + 63) & ~(size_t)63;
+	}
+
+	FaceSegClient::FaceSegClient(const std::string& socket_path)
+	{
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (socket_path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("Socket path is too long: \"" + socket_path + "\"!");
+		std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+		m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (m_socket < 0)
+			throw std::runtime_error(std::string("Failed to create socket: ") + strerror(errno));
+		if (connect(m_socket, (sockaddr*)&addr, sizeof(addr)) != 0)
+		{
+			std::string error = strerror(errno);
+			close(m_socket);
+			throw std::runtime_error("Failed to connect to \"" + socket_path + "\": " + error);
+		}
+	}
+
+	FaceSegClient::~FaceSegClient()
+	{
+		if (m_socket >= 0) close(m_socket);
+	}
+
+	void FaceSegClient::reserve(size_t size)
+	{
+		if (m_shm.data() != nullptr && m_shm.size() >= size) return;
+
+		// Grow geometrically, a new object is created because the server
+		// keeps the current one mapped
+		size = std::max(size, m_shm.size() * 2);
+		std::string name = "/face_seg_" + std::to_string(getpid()) + "_" +
+			std::to_string((size_t)this) + "_" + std::to_string(m_shm_count++);
+		m_shm.create(name, size);
+	}
+
+	cv::Mat FaceSegClient::inputBuffer(const cv::Size& size, int type)
+	{
+		size_t img_size = (size_t)size.area() * CV_ELEM_SIZE(type);
+		reserve(alignOffset(img_size) + size.area());
+		return cv::Mat(size, type, m_shm.data());
+	}
+
+	cv::Mat FaceSegClient::process(const cv::Mat& img, bool crop_face, cv::Rect* roi)
+	{
+		CV_Assert(img.depth() == CV_8U && (img.channels() == 1 || img.channels() == 3 || img.channels() == 4));
+
+		// Copy the image to the shared memory, unless it's already there
+		size_t img_size = img.total() * img.elemSize();
+		size_t mask_offset = alignOffset(img_size);
+		if (img.data != m_shm.data() || !img.isContinuous())
+		{
+			bool in_shm = img.data >= m_shm.data() && img.data < m_shm.data() + m_shm.size();
+			cv::Mat src = in_shm ? img.clone() : img;
+			reserve(mask_offset + img.total());
+			cv::Mat shm_img(img.size(), img.type(), m_shm.data());
+			src.copyTo(shm_img);
+		}
+
+		// Send the request and wait for the response
+		ServerRequest request;
+		std::strncpy(request.shm_name, m_shm.name().c_str(), sizeof(request.shm_name) - 1);
+		request.shm_size = m_shm.size();
+		request.rows = img.rows;
+		request.cols = img.cols;
+		request.type = img.type();
+		request.flags = crop_face ? SERVER_CROP_FACE : 0;
+		request.img_step = img.cols * img.elemSize();
+		request.mask_offset = mask_offset;
+		ServerResponse response;
+		if (!sendAll(m_socket, &request, sizeof(request)) ||
+			!recvAll(m_socket, &response, sizeof(response)))
+			throw std::runtime_error("Lost connection to the face segmentation server!");
+		if (response.status != 0)
+		{
+			response.message[sizeof(response.message) - 1] = '\0';
+			throw std::runtime_error(response.message);
+		}
+
+		if (roi != nullptr) *roi = cv::Rect(response.x, response.y, response.width, response.height);
+		return cv::Mat(response.height, response.width, CV_8U, m_shm.data() + mask_offset).clone();
+	}
+
+}   // namespace face_seg
@@ -0,0 +1,214 @@
+#include "face_seg/dnn_engine.h"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <opencv2/core/cuda.hpp>
+
+namespace face_seg
+{
+	static std::shared_ptr<const std::string> readFile(const std::string& file_path)
+	{
+		std::ifstream file(file_path, std::ios::binary);
+		if (!file.is_open()) throw std::runtime_error("Failed to read \"" + file_path + "\"!");
+		std::stringstream data;
+		data << file.rdbuf();
+		return std::make_shared<const std::string>(data.str());
+	}
+
+	/**	Read the input shape from the deploy network definition: the first
+		four dimensions of its input_dim fields, input_shape or Input layer.
+	*/
+	static std::vector<int> readInputShape(const std::string& deploy)
+	{
+		std::vector<int> shape;
+		std::istringstream lines(deploy);
+		std::string line, token;
+		while (shape.size() < 4 && std::getline(lines, line))
+		{
+			line = line.substr(0, line.find('#'));
+			std::replace_if(line.begin(), line.end(),
+				[](char c) { return c == ':' || c == '{' || c == '}'; }, ' ');
+			std::istringstream tokens(line);
+			while (shape.size() < 4 && tokens >> token)
+			{
+				int dim;
+				if ((token == "dim" || token == "input_dim") && tokens >> dim)
+					shape.push_back(dim);
+			}
+		}
+		return shape;
+	}
+
+	/**	Read the name of the network from the deploy network definition: its
+		top level name field.
+	*/
+	static std::string readNetName(const std::string& deploy)
+	{
+		std::istringstream lines(deploy);
+		std::string line, token;
+		int depth = 0;
+		while (std::getline(lines, line))
+		{
+			line = line.substr(0, line.find('#'));
+			size_t pos = line.find("name");
+			if (depth == 0 && pos != std::string::npos && line.find('{') > pos)
+			{
+				size_t begin = line.find('"', pos), end = line.find('"', begin + 1);
+				if (end != std::string::npos) return line.substr(begin + 1, end - begin - 1);
+			}
+			depth += (int)std::count(line.begin(), line.end(), '{');
+			depth -= (int)std::count(line.begin(), line.end(), '}');
+		}
+		return "";
+	}
+
+	DnnEngine::DnnEngine(const std::string& deploy_file, const std::string& model_file,
+		bool with_gpu, int gpu_device_id) :
+		m_with_gpu(with_gpu), m_gpu_device_id(gpu_device_id)
+	{
+		m_deploy = readFile(deploy_file);
+		m_model = readFile(model_file);
+		if (m_model->compare(0, 8, "FSEGNET1") == 0)
+			throw std::runtime_error("Compiled model caches can only be loaded by the Caffe engine!");
+		m_net_name = readNetName(*m_deploy);
+		loadNet();
+
+		// Start with the input shape of the network definition
+		std::vector<int> shape = readInputShape(*m_deploy);
+		if (shape.size() != 4)
+			throw std::runtime_error("Failed to read the input shape from \"" + deploy_file + "\"!");
+		m_input.create(4, shape.data(), CV_32F);
+		inferOutputShape();
+	}
+
+	DnnEngine::DnnEngine(const DnnEngine* other) :
+		m_deploy(other->m_deploy), m_model(other->m_model), m_net_name(other->m_net_name),
+		m_with_gpu(other->m_with_gpu), m_gpu_device_id(other->m_gpu_device_id)
+	{
+		loadNet();
+		int sizes[] = { other->inputNum(), other->inputChannels(),
+			other->inputSize().height, other->inputSize().width };
+		m_input.create(4, sizes, CV_32F);
+		m_output_shape = other->m_output_shape;
+	}
+
+	void DnnEngine::loadNet()
+	{
+		m_net = cv::dnn::readNetFromCaffe(m_deploy->data(), m_deploy->size(),
+			m_model->data(), m_model->size());
+		if (m_net.empty()) throw std::runtime_error("Failed to load the network!");
+		std::vector<int> output_layers = m_net.getUnconnectedOutLayers();
+		if (output_layers.size() != 1)
+			throw std::runtime_error("Network should have exactly one output!");
+		m_output_layer = output_layers[0];
+		m_layer_names = m_net.getLayerNames();
+
+		m_net.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+		m_net.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 2)
+		if (m_with_gpu && cv::cuda::getCudaEnabledDeviceCount() > 0)
+		{
+			initThread();
+			m_net.setPreferableBackend(cv::dnn::DNN_BACKEND_CUDA);
+			m_net.setPreferableTarget(cv::dnn::DNN_TARGET_CUDA);
+		}
+#endif
+	}
+
+	std::shared_ptr<InferenceEngine> DnnEngine::clone() const
+	{
+		return std::make_shared<DnnEngine>(this);
+	}
+
+	void DnnEngine::initThread() const
+	{
+		if (m_with_gpu && cv::cuda::getCudaEnabledDeviceCount() > 0)
+			cv::cuda::setDevice(m_gpu_device_id);
+	}
+
+	int DnnEngine::inputChannels() const
+	{
+		return m_input.size[1];
+	}
+
+	int DnnEngine::inputNum() const
+	{
+		return m_input.size[0];
+	}
+
+	cv::Size DnnEngine::inputSize() const
+	{
+		return cv::Size(m_input.size[3], m_input.size[2]);
+	}
+
+	void DnnEngine::reshapeInput(int num, const cv::Size& size)
+	{
+		if (inputNum() == num && inputSize() == size) return;
+		int sizes[] = { num, inputChannels(), size.height, size.width };
+		m_input.create(4, sizes, CV_32F);
+		inferOutputShape();
+	}
+
+	void DnnEngine::inferOutputShape()
+	{
+		// The layers are reshaped by the next forward pass, only the output
+		// shape is inferred now
+		cv::dnn::MatShape input_shape = { inputNum(), inputChannels(),
+			inputSize().height, inputSize().width };
+		std::vector<cv::dnn::MatShape> in_shapes, out_shapes;
+		m_net.getLayerShapes(input_shape, m_output_layer, in_shapes, out_shapes);
+		if (out_shapes.empty() || out_shapes[0].size() != 4)
+			throw std::runtime_error("Output layer should have 4 dimensions!");
+		m_output_shape = out_shapes[0];
+	}
+
+	float* DnnEngine::inputData(int n)
+	{
+		return m_input.ptr<float>(n);
+	}
+
+	void DnnEngine::forward()
+	{
+		m_net.setInput(m_input);
+		m_output = m_net.forward();
+	}
+
+	void DnnEngine::forward(std::vector<double>& layer_times)
+	{
+		forward();
+
+		// The profile has the time of each layer of the last forward pass, in ticks
+		std::vector<double> ticks;
+		m_net.getPerfProfile(ticks);
+		layer_times.assign(m_layer_names.size(), 0.0);
+		for (size_t i = 0; i < std::min(ticks.size(), layer_times.size()); ++i)
+			layer_times[i] = ticks[i] / cv::getTickFrequency();
+	}
+
+	std::string DnnEngine::netName() const
+	{
+		return m_net_name;
+	}
+
+	const std::vector<std::string>& DnnEngine::layerNames() const
+	{
+		return m_layer_names;
+	}
+
+	int DnnEngine::outputChannels() const
+	{
+		return m_output_shape[1];
+	}
+
+	cv::Size DnnEngine::outputSize() const
+	{
+		return cv::Size(m_output_shape[3], m_output_shape[2]);
+	}
+
+	const float* DnnEngine::outputData(int n) const
+	{
+		return m_output.ptr<float>(n);
+	}
+
+}   // namespace face_seg
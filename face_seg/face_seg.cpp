@@ -1,175 +1,644 @@
 #include "face_seg/face_seg.h"
 #include "face_seg/utilities.h"
+#include "face_seg/kernels.h"
 #include <exception>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>  // debug
 
-using namespace caffe;
+typedef std::chrono::steady_clock Clock;
 
 namespace face_seg
 {
-
-	FaceSeg::FaceSeg(const string& deploy_file, const string& model_file,
-		bool with_gpu, int gpu_device_id, bool scale, bool postprocess_seg) :
-		m_num_channels(0), m_with_gpu(with_gpu), m_scale(scale), m_postprocess_seg(postprocess_seg)
+	/**	Get the seconds elapsed since t and restart t.
+	*/
+	static double lap(Clock::time_point& t)
 	{
-		if (with_gpu)
-		{
-			Caffe::SetDevice(gpu_device_id);
-			Caffe::set_mode(Caffe::GPU);
-		}
-		else Caffe::set_mode(Caffe::CPU);
+		Clock::time_point now = Clock::now();
+		double s = std::chrono::duration<double>(now - t).count();
+		t = now;
+		return s;
+	}
 
-		// Load the network
-		m_net.reset(new Net<float>(deploy_file, caffe::TEST));
-		m_net->CopyTrainedLayersFrom(model_file);
+	FaceSeg::FaceSeg(const std::string& deploy_file, const std::string& model_file,
+		bool with_gpu, int gpu_device_id, bool scale, bool postprocess_seg,
+		const std::string& engine) :
+		m_num_channels(0), m_with_gpu(with_gpu),
+		m_gpu_device_id(gpu_device_id), m_scale(scale), m_postprocess_seg(postprocess_seg)
+	{
+		m_engine = createInferenceEngine(engine, deploy_file, model_file, with_gpu, gpu_device_id);
+		initLayers();
+	}
 
-		CHECK_EQ(m_net->num_inputs(), 1) << "Network should have exactly one input.";
-		CHECK_EQ(m_net->num_outputs(), 1) << "Network should have exactly one output.";
+	FaceSeg::FaceSeg(const FaceSeg* other) :
+		m_num_channels(0), m_with_gpu(other->m_with_gpu),
+		m_gpu_device_id(other->m_gpu_device_id), m_scale(other->m_scale),
+		m_postprocess_seg(other->m_postprocess_seg),
+		m_bucket_step(other->m_bucket_step), m_bucket_capacity(other->m_bucket_capacity),
+		m_tile_size(other->m_tile_size), m_tile_overlap(other->m_tile_overlap),
+		m_tile_batch_size(other->m_tile_batch_size),
+		m_instrumentation(other->m_instrumentation)
+	{
+		// Create the network and share the trained weights of the other instance
+		m_engine = other->m_engine->clone();
+		initLayers();
+	}
 
+	void FaceSeg::initLayers()
+	{
 		// Get suggested input size
-		Blob<float>* input_layer = m_net->input_blobs()[0];
-		m_num_channels = input_layer->channels();
-		CHECK(m_num_channels == 3 || m_num_channels == 1)
-			<< "Input layer should have 1 or 3 channels.";
-		m_input_size = cv::Size(input_layer->width(), input_layer->height());
+		m_num_channels = m_engine->inputChannels();
+		if (m_num_channels != 3 && m_num_channels != 1)
+			throw std::runtime_error("Input layer should have 1 or 3 channels!");
+		m_input_size = m_engine->inputSize();
 
 		// Check number of output channels
-		Blob<float>* output_layer = m_net->output_blobs()[0];
-		if (output_layer->channels() == 21)
+		if (m_engine->outputChannels() == 21)
 			m_foreground_channel = 15;
+
+		// Compacted networks subtract the mean color in their first layer
+		std::string name = m_engine->netName(), suffix = meanFoldedSuffix();
+		m_mean_folded = name.size() >= suffix.size() &&
+			name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+
+	cv::Scalar FaceSeg::meanColor()
+	{
+		return cv::Scalar(104.00699, 116.66877, 122.67892);
+	}
+
+	std::string FaceSeg::meanFoldedSuffix()
+	{
+		return "_mean_folded";
 	}
 
 	FaceSeg::~FaceSeg()
 	{
 	}
 
+	std::shared_ptr<FaceSeg> FaceSeg::clone() const
+	{
+		return std::shared_ptr<FaceSeg>(new FaceSeg(this));
+	}
+
+	void FaceSeg::initThread() const
+	{
+		m_engine->initThread();
+	}
+
 	cv::Mat FaceSeg::process(const cv::Mat& img)
 	{
-		cv::Mat img_scaled;
-		if (!m_scale)
-		{
-			// Enforce network maximum size
-			if (img.cols > m_input_size.width)
-			{
-				float scale = (float)m_input_size.width / (float)img.cols;
-				cv::resize(img, img_scaled, cv::Size(), scale, scale, cv::INTER_CUBIC);
-			}
-			else img_scaled = img;
+		cv::Mat seg;
+		process(img, seg);
+		return seg;
+	}
 
-			// Reshape net
-			Blob<float>* input_layer = m_net->input_blobs()[0];
-			std::vector<int> shape = { 1, img_scaled.channels(), img_scaled.rows, img_scaled.cols };
-			input_layer->Reshape(shape);
+	void FaceSeg::process(const cv::Mat& img, cv::Mat& out_mask)
+	{
+		beginCall();
+		Clock::time_point t = Clock::now();
 
-			// Forward dimension change to all layers
-			m_net->Reshape();
+		// Segment large images in tiles, directly to the output
+		if (isTiled(img.size()))
+		{
+			processTiled(img, out_mask);
+			t = Clock::now();
+			if (out_mask.size() != img.size())
+				cv::resize(out_mask, out_mask, img.size(), 0, 0, cv::INTER_NEAREST);
+			m_timings.upsample += lap(t);
+			endCall();
+			return;
 		}
-		else img_scaled = img;
 
 		// Prepare input data
-		std::vector<cv::Mat> input_channels;
-		wrapInputLayer(input_channels);
-		preprocess(img_scaled, input_channels);
+		cv::Size input_img_size = prepareInput(img);
+		m_timings.preprocess += lap(t);
 
 		// Forward pass
-		m_net->Forward();
-		
-		// Extract background and foreground from output layer
-		Blob<float>* output_layer = m_net->output_blobs()[0];
-		cv::Mat background(output_layer->height(), output_layer->width(), CV_32F, 
-			(void*)output_layer->cpu_data());
-		cv::Mat foreground(output_layer->height(), output_layer->width(), CV_32F,
-			(void*)(output_layer->cpu_data() + m_foreground_channel * (output_layer->height() * output_layer->width())));
-		
-		// Calculate argmax
-		cv::Mat seg(output_layer->height(), output_layer->width(), CV_8U);
-		unsigned char* seg_data = seg.data;
-		float* back_data = (float*)background.data;
-		float* fore_data = (float*)foreground.data;
-		for (int i = 0; i < seg.total(); ++i)
-			*seg_data++ = (*back_data++ < *fore_data++) ? 255 : 0;
+		forward();
+		m_timings.forward += lap(t);
 
-		// Refine segmentation
-		//cv::Mat kernel = cv::getStructuringElement(cv::MorphShapes::MORPH_ELLIPSE, cv::Size(3, 3));
-		//cv::erode(seg, seg, kernel, cv::Point(-1, -1), 5);
-		//cv::Mat kernel = cv::getStructuringElement(cv::MorphShapes::MORPH_ELLIPSE, cv::Size(5, 5));
-		//cv::erode(seg, seg, kernel, cv::Point(-1, -1), 1);
-		if(m_postprocess_seg) smoothFlaws(seg, 1, 2);
+		// Extract the segmentation directly to the output if it's already in the
+		// original image size, otherwise to the workspace
+		bool resize = segmentationSize(input_img_size) != img.size();
+		cv::Mat& seg = resize ? m_ws_seg : out_mask;
+		extractSegmentation(0, input_img_size, seg);
+		t = Clock::now();
 
 		// Resize to original image size
-		if (seg.size() != img.size())
-			cv::resize(seg, seg, img.size(), 0, 0, cv::INTER_NEAREST);
+		if (resize)
+			cv::resize(seg, out_mask, img.size(), 0, 0, cv::INTER_NEAREST);
+		m_timings.upsample += lap(t);
+		endCall();
+	}
 
-		// Output results
+	cv::Mat FaceSeg::process(const cv::Mat& frame, const cv::Rect& roi)
+	{
+		cv::Mat seg;
+		process(frame, roi, seg);
 		return seg;
 	}
 
-	void FaceSeg::wrapInputLayer(std::vector<cv::Mat>& input_channels)
+	void FaceSeg::process(const cv::Mat& frame, const cv::Rect& roi, cv::Mat& out_mask)
 	{
-		Blob<float>* input_layer = m_net->input_blobs()[0];
+		out_mask.create(frame.size(), CV_8U);
+		cv::Rect r = roi & cv::Rect(0, 0, frame.cols, frame.rows);
+		if (r.empty())
+		{
+			out_mask.setTo(0);
+			return;
+		}
 
-		int width = input_layer->width();
-		int height = input_layer->height();
+		// Clear only the pixels outside the region
+		out_mask.rowRange(0, r.y).setTo(0);
+		out_mask.rowRange(r.br().y, out_mask.rows).setTo(0);
+		cv::Mat rows = out_mask.rowRange(r.y, r.br().y);
+		rows.colRange(0, r.x).setTo(0);
+		rows.colRange(r.br().x, out_mask.cols).setTo(0);
 
-		float* input_data = input_layer->mutable_cpu_data();
+		// Segment the region directly into its part of the mask. The tiled
+		// path assigns a new mask instead, so copy it into the region then
+		cv::Mat roi_mask = out_mask(r);
+		cv::Mat seg = roi_mask;
+		process(frame(r), seg);
+		if (seg.data != roi_mask.data) seg.copyTo(roi_mask);
+	}
+
+	void FaceSeg::processRegions(const cv::Mat& frame, const std::vector<cv::Rect>& rois,
+		cv::Mat& out_mask, bool labeled)
+	{
+		CV_Assert(!labeled || rois.size() < 256);
+		out_mask.create(frame.size(), CV_8U);
+		out_mask.setTo(0);
+
+		// Batch the regions inside the frame, as views of the frame
+		std::vector<cv::Rect> regions;
+		std::vector<cv::Mat> crops;
+		std::vector<uchar> labels;
+		for (size_t i = 0; i < rois.size(); ++i)
+		{
+			cv::Rect r = rois[i] & cv::Rect(0, 0, frame.cols, frame.rows);
+			if (r.empty()) continue;
+			regions.push_back(r);
+			crops.push_back(frame(r));
+			labels.push_back(labeled ? (uchar)(i + 1) : 255);
+		}
+		if (crops.empty()) return;
+		std::vector<cv::Mat> segs = processBatch(crops);
 
-		for (int i = 0; i < input_layer->channels(); ++i) {
-			cv::Mat channel(height, width, CV_32FC1, input_data);
-			input_channels.push_back(channel);
-			input_data += width * height;
+		// Composite the masks in reverse order, so the first region wins where
+		// they overlap
+		for (size_t i = regions.size(); i-- > 0;)
+		{
+			cv::Mat dst = out_mask(regions[i]);
+			dst.setTo(labels[i], segs[i]);
 		}
 	}
 
-	void FaceSeg::preprocess(const cv::Mat& img, std::vector<cv::Mat>& input_channels)
+	cv::Mat FaceSeg::process(const cv::Mat& img, MaskTransform& transform)
 	{
-		// Convert the input image to the input image format of the network.
-		cv::Mat sample;
-		if (img.channels() == 3 && m_num_channels == 1)
-			cv::cvtColor(img, sample, cv::COLOR_BGR2GRAY);
-		else if (img.channels() == 4 && m_num_channels == 1)
-			cv::cvtColor(img, sample, cv::COLOR_BGRA2GRAY);
-		else if (img.channels() == 4 && m_num_channels == 3)
-			cv::cvtColor(img, sample, cv::COLOR_BGRA2BGR);
-		else if (img.channels() == 1 && m_num_channels == 3)
-			cv::cvtColor(img, sample, cv::COLOR_GRAY2BGR);
+		beginCall();
+		Clock::time_point t = Clock::now();
+		cv::Mat seg;
+		if (isTiled(img.size())) processTiled(img, seg);
 		else
-			sample = img;
+		{
+			// Prepare input data
+			cv::Size input_img_size = prepareInput(img);
+			m_timings.preprocess += lap(t);
 
-		cv::Mat sample_resized;
-		if (m_scale && sample.size() != m_input_size)
-		    cv::resize(sample, sample_resized, m_input_size, 0, 0, cv::INTER_CUBIC);
-		else
-		    sample_resized = sample;
+			// Forward pass
+			forward();
+			m_timings.forward += lap(t);
+			extractSegmentation(0, input_img_size, seg);
+		}
 
-		cv::Mat sample_float;
-		if (m_num_channels == 3)
-			sample_resized.convertTo(sample_float, CV_32FC3);
-		else
-			sample_resized.convertTo(sample_float, CV_32FC1);
+		// Map from the segmentation to the original image
+		transform.scale = cv::Point2f((float)img.cols / seg.cols, (float)img.rows / seg.rows);
+		transform.offset = cv::Point2f(0.0f, 0.0f);
+		endCall();
+
+		return seg;
+	}
+
+	cv::Size FaceSeg::prepareInput(const cv::Mat& img)
+	{
+		if (m_scale)
+		{
+			// The net might have been reshaped by a previous batch
+			reshapeInput(1, m_input_size);
+			preprocess(img, inputLayerData());
+			return m_input_size;
+		}
+
+		// Enforce network maximum size and reshape net to the image's bucket
+		cv::Mat img_scaled = limitSize(img, m_ws_limited);
+		cv::Size bucket_size = bucketSize(img_scaled.size());
+		selectNet(bucket_size);
+		reshapeInput(1, bucket_size);
+		preprocess(img_scaled, inputLayerData());
+
+		return img_scaled.size();
+	}
+
+	std::vector<cv::Mat> FaceSeg::processBatch(const std::vector<cv::Mat>& imgs)
+	{
+		std::vector<cv::Mat> segs;
+		if (imgs.empty()) return segs;
+		beginCall();
+		Clock::time_point t = Clock::now();
+
+		// Prepare input images
+		std::vector<cv::Mat> imgs_scaled(imgs.size());
+		bool tiled = false;
+		for (size_t i = 0; i < imgs.size(); ++i)
+		{
+			tiled = tiled || isTiled(imgs[i].size());
+			imgs_scaled[i] = m_scale || tiled ? imgs[i] : limitSize(imgs[i], imgs_scaled[i]);
+		}
+
+		// Images of different buckets are padded to a common bucket, unless the
+		// padding would more than double the input pixels. Images that are
+		// segmented in tiles are batched by tiles instead.
+		cv::Size batch_size = m_input_size;
+		if (!m_scale)
+		{
+			batch_size = cv::Size(0, 0);
+			double area = 0.0;
+			for (const cv::Mat& img_scaled : imgs_scaled)
+			{
+				cv::Size bucket_size = bucketSize(img_scaled.size());
+				batch_size.width = std::max(batch_size.width, bucket_size.width);
+				batch_size.height = std::max(batch_size.height, bucket_size.height);
+				area += bucket_size.area();
+			}
+			if (tiled || (double)batch_size.area() * imgs.size() > 2.0 * area)
+			{
+				StageTimings timings = m_timings;
+				for (const cv::Mat& img : imgs)
+				{
+					segs.push_back(process(img));
+					timings.preprocess += m_timings.preprocess;
+					timings.forward += m_timings.forward;
+					timings.argmax += m_timings.argmax;
+					timings.postprocess += m_timings.postprocess;
+					timings.upsample += m_timings.upsample;
+				}
+				m_timings = timings;
+				return segs;
+			}
+		}
+		if (!m_scale) selectNet(batch_size);
+		reshapeInput((int)imgs.size(), batch_size);
+
+		// Prepare input data, each image to its own slice of the input blob
+		for (size_t i = 0; i < imgs_scaled.size(); ++i)
+			preprocess(imgs_scaled[i], inputLayerData((int)i));
+		m_timings.preprocess += lap(t);
+
+		// Forward pass
+		forward();
+		m_timings.forward += lap(t);
+
+		// Output results
+		segs.reserve(imgs.size());
+		for (size_t i = 0; i < imgs.size(); ++i)
+		{
+			cv::Mat seg;
+			extractSegmentation((int)i, m_scale ? m_input_size : imgs_scaled[i].size(), seg);
+			t = Clock::now();
+
+			// Resize to original image size
+			if (seg.size() != imgs[i].size())
+				cv::resize(seg, seg, imgs[i].size(), 0, 0, cv::INTER_NEAREST);
+			m_timings.upsample += lap(t);
+			segs.push_back(seg);
+		}
+		endCall();
+
+		return segs;
+	}
+
+	void FaceSeg::setInstrumentation(std::shared_ptr<Instrumentation> instrumentation)
+	{
+		if (instrumentation != nullptr) Instrumentation::installMatAllocationCounter();
+		m_instrumentation = instrumentation;
+	}
+
+	void FaceSeg::forward()
+	{
+		if (m_instrumentation == nullptr)
+		{
+			m_engine->forward();
+			return;
+		}
+
+		// Measure each layer
+		m_engine->forward(m_layer_times);
+		m_instrumentation->addLayers(m_engine->layerNames(), m_layer_times);
+	}
+
+	void FaceSeg::beginCall()
+	{
+		m_timings = StageTimings();
+		if (m_instrumentation == nullptr) return;
+		m_call_start = Clock::now();
+		m_call_mat_allocated_bytes = Instrumentation::threadMatAllocatedBytes();
+	}
+
+	void FaceSeg::endCall()
+	{
+		if (m_instrumentation == nullptr) return;
+		m_instrumentation->addStage("preprocess", m_timings.preprocess);
+		m_instrumentation->addStage("forward", m_timings.forward);
+		m_instrumentation->addStage("argmax", m_timings.argmax);
+		m_instrumentation->addStage("postprocess", m_timings.postprocess);
+		m_instrumentation->addStage("upsample", m_timings.upsample);
+		m_instrumentation->addStage("total", lap(m_call_start));
+		m_instrumentation->addMatAllocation(
+			Instrumentation::threadMatAllocatedBytes() - m_call_mat_allocated_bytes);
+	}
+
+	void FaceSeg::setReshapeCache(int step, int capacity)
+	{
+		m_bucket_step = std::max(step, 1);
+		m_bucket_capacity = std::max(capacity, 1);
+		while ((int)m_bucket_nets.size() > m_bucket_capacity)
+			m_bucket_nets.pop_back();
+	}
+
+	cv::Size FaceSeg::bucketSize(const cv::Size& size) const
+	{
+		return cv::Size(
+			(size.width + m_bucket_step - 1) / m_bucket_step * m_bucket_step,
+			(size.height + m_bucket_step - 1) / m_bucket_step * m_bucket_step);
+	}
+
+	void FaceSeg::selectNet(const cv::Size& bucket_size)
+	{
+		// Look for a network that is already reshaped to the bucket
+		for (auto it = m_bucket_nets.begin(); it != m_bucket_nets.end(); ++it)
+		{
+			if (it->first != bucket_size) continue;
+			m_bucket_nets.splice(m_bucket_nets.begin(), m_bucket_nets, it);
+			m_engine = m_bucket_nets.front().second;
+			++m_reshape_hits;
+			return;
+		}
+		++m_reshape_misses;
+
+		// Use the current network for the first bucket, the least recently used
+		// network when the cache is full, or create a new network that shares
+		// the trained weights
+		std::shared_ptr<InferenceEngine> net;
+		if (m_bucket_nets.empty())
+			net = m_engine;
+		else if ((int)m_bucket_nets.size() >= m_bucket_capacity)
+		{
+			net = m_bucket_nets.back().second;
+			m_bucket_nets.pop_back();
+		}
+		else net = m_engine->clone();
+		m_bucket_nets.emplace_front(bucket_size, net);
+		m_engine = net;
+	}
 
-		// Normalize the image by substracting the mean
-		subtractMean_c3(sample_float);
+	void FaceSeg::setTiling(const cv::Size& tile_size, int overlap, int batch_size)
+	{
+		bool enabled = tile_size.width > 0 && tile_size.height > 0;
+		if (enabled && (overlap < 0 || overlap >= std::min(tile_size.width, tile_size.height)))
+			throw std::runtime_error("Tile overlap must be smaller than the tile size!");
+		m_tile_size = enabled ? tile_size : cv::Size();
+		m_tile_overlap = overlap;
+		m_tile_batch_size = std::max(batch_size, 1);
+	}
+
+	bool FaceSeg::isTiled(const cv::Size& img_size) const
+	{
+		return !m_scale && m_tile_size.area() > 0 &&
+			(img_size.width > m_tile_size.width || img_size.height > m_tile_size.height);
+	}
+
+	/**	Get the positions of overlapping tiles along a dimension of an image,
+		the last tile ends at the end of the dimension.
+	*/
+	static std::vector<int> tilePositions(int length, int tile, int overlap)
+	{
+		std::vector<int> positions(1, 0);
+		while (positions.back() + tile < length)
+			positions.push_back(std::min(positions.back() + tile - overlap, length - tile));
+		return positions;
+	}
 
-		// This operation will write the separate BGR planes directly to the
-		// input layer of the network because it is wrapped by the cv::Mat
-		// objects in input_channels. 
-		cv::split(sample_float, input_channels);
+	/**	Get the blending weights along a dimension of a tile, they ramp up
+		linearly over the overlap on the sides that have a neighboring tile.
+	*/
+	static void rampWeights(int length, bool ramp_begin, bool ramp_end, int overlap,
+		std::vector<float>& weights)
+	{
+		weights.assign(length, 1.0f);
+		for (int i = 0; i < length; ++i)
+		{
+			if (ramp_begin) weights[i] = std::min(weights[i], (i + 1.0f) / (overlap + 1.0f));
+			if (ramp_end) weights[i] = std::min(weights[i], (length - i) / (overlap + 1.0f));
+		}
 	}
 
-	void FaceSeg::subtractMean_c3(cv::Mat& img)
+	void FaceSeg::processTiled(const cv::Mat& img, cv::Mat& seg)
 	{
-		int r, c;
-		float* img_data = (float*)img.data;
-		for (r = 0; r < img.rows; ++r)
+		Clock::time_point t = Clock::now();
+		std::vector<int> xs = tilePositions(img.cols, m_tile_size.width, m_tile_overlap);
+		std::vector<int> ys = tilePositions(img.rows, m_tile_size.height, m_tile_overlap);
+		cv::Size tile_size(std::min(img.cols, m_tile_size.width), std::min(img.rows, m_tile_size.height));
+
+		// All the tiles are written to a network reshaped to the tile size
+		selectNet(m_tile_size);
+		reshapeInput(std::min((int)xs.size(), m_tile_batch_size), m_tile_size);
+		cv::Size input_size = m_engine->inputSize(), output_size = m_engine->outputSize();
+		double sy = (double)output_size.height / input_size.height;
+		seg.create(cvRound(img.rows * sy),
+			cvRound((double)img.cols * output_size.width / input_size.width), CV_8U);
+
+		// The scores of each row of tiles are blended in a band, which begins
+		// at the row of the segmentation where the tiles begin
+		int band_height = segmentationSize(tile_size).height + 1;
+		m_ws_band.create(band_height, seg.cols, CV_32F);
+		m_ws_band.setTo(0);
+		int band_y = 0;
+		for (size_t k = 0; k < ys.size(); ++k)
 		{
-			for (c = 0; c < img.cols; ++c)
+			// Segment the row of tiles in batches
+			for (size_t i = 0; i < xs.size(); i += m_tile_batch_size)
+			{
+				int n = (int)std::min(xs.size() - i, (size_t)m_tile_batch_size);
+				reshapeInput(n, m_tile_size);
+				for (int j = 0; j < n; ++j)
+					preprocess(img(cv::Rect(cv::Point(xs[i + j], ys[k]), tile_size)), inputLayerData(j));
+				m_timings.preprocess += lap(t);
+				forward();
+				m_timings.forward += lap(t);
+				for (int j = 0; j < n; ++j)
+					blendTile(j, cv::Rect(cv::Point(xs[i + j], ys[k]), tile_size), img.size(), band_y);
+				m_timings.argmax += lap(t);
+			}
+
+			// The rows above the next row of tiles are final: the face is where
+			// the blended foreground score is larger than the background score
+			int next_y = k + 1 < ys.size() ? cvRound(ys[k + 1] * sy) : seg.rows;
+			int final_rows = std::min(std::min(next_y, seg.rows) - band_y, band_height);
+			cv::Mat final_seg = seg.rowRange(band_y, band_y + final_rows);
+			cv::compare(m_ws_band.rowRange(0, final_rows), 0.0, final_seg, cv::CMP_GT);
+
+			// Carry the scores of the overlapping rows over to the next row of tiles
+			if (k + 1 < ys.size())
 			{
-				*img_data++ -= MB;
-				*img_data++ -= MG;
-				*img_data++ -= MR;
+				m_ws_band.rowRange(final_rows, band_height).copyTo(m_ws_carry);
+				m_ws_band.setTo(0);
+				cv::Mat carried = m_ws_band.rowRange(0, band_height - final_rows);
+				m_ws_carry.copyTo(carried);
 			}
+			band_y += final_rows;
+			m_timings.argmax += lap(t);
+		}
+
+		if (m_postprocess_seg) m_postprocessor.smooth(seg, 1, 2);
+		m_timings.postprocess += lap(t);
+	}
+
+	void FaceSeg::blendTile(int n, const cv::Rect& tile, const cv::Size& img_size, int band_y)
+	{
+		cv::Size input_size = m_engine->inputSize(), output_size = m_engine->outputSize();
+		double sx = (double)output_size.width / input_size.width;
+		double sy = (double)output_size.height / input_size.height;
+		cv::Size tile_seg_size = segmentationSize(tile.size());
+		int x0 = cvRound(tile.x * sx), y0 = cvRound(tile.y * sy) - band_y;
+
+		// Separable weights, that ramp up over the overlap with the neighboring tiles
+		rampWeights(tile_seg_size.width, tile.x > 0, tile.br().x < img_size.width,
+			cvRound(m_tile_overlap * sx), m_ws_weights_x);
+		rampWeights(tile_seg_size.height, tile.y > 0, tile.br().y < img_size.height,
+			cvRound(m_tile_overlap * sy), m_ws_weights_y);
+
+		// Add the weighted difference between the foreground and background scores
+		int out_width = output_size.width;
+		int channel_size = output_size.area();
+		const float* back_data = m_engine->outputData(n);
+		const float* fore_data = back_data + m_foreground_channel * channel_size;
+		int width = std::min(tile_seg_size.width, m_ws_band.cols - x0);
+		int height = std::min(tile_seg_size.height, m_ws_band.rows - y0);
+		for (int r = 0; r < height; ++r)
+		{
+			const float* back = back_data + r * out_width;
+			const float* fore = fore_data + r * out_width;
+			float* band = m_ws_band.ptr<float>(y0 + r) + x0;
+			float wy = m_ws_weights_y[r];
+			for (int c = 0; c < width; ++c)
+				band[c] += wy * m_ws_weights_x[c] * (fore[c] - back[c]);
+		}
+	}
+
+	cv::Mat FaceSeg::limitSize(const cv::Mat& img, cv::Mat& buf)
+	{
+		if (img.cols <= m_input_size.width && img.rows <= m_input_size.height) return img;
+		float scale = std::min((float)m_input_size.width / (float)img.cols,
+			(float)m_input_size.height / (float)img.rows);
+		cv::resize(img, buf, cv::Size(), scale, scale, cv::INTER_CUBIC);
+		return buf;
+	}
+
+	void FaceSeg::reshapeInput(int num, const cv::Size& size)
+	{
+		m_engine->reshapeInput(num, size);
+	}
+
+	cv::Size FaceSeg::segmentationSize(const cv::Size& img_size) const
+	{
+		// Skip the output region that corresponds to the input padding
+		cv::Size input_size = m_engine->inputSize(), output_size = m_engine->outputSize();
+		return cv::Size(
+			std::min(output_size.width, cvRound((double)img_size.width * output_size.width / input_size.width)),
+			std::min(output_size.height, cvRound((double)img_size.height * output_size.height / input_size.height)));
+	}
+
+	void FaceSeg::extractSegmentation(int n, const cv::Size& img_size, cv::Mat& seg)
+	{
+		// Extract background and foreground from output layer
+		Clock::time_point t = Clock::now();
+		int out_width = m_engine->outputSize().width;
+		int channel_size = m_engine->outputSize().area();
+		const float* back_data = m_engine->outputData(n);
+		const float* fore_data = back_data + m_foreground_channel * channel_size;
+		cv::Size seg_size = segmentationSize(img_size);
+
+		// Calculate argmax
+		seg.create(seg_size, CV_8U);
+		for (int r = 0; r < seg_size.height; ++r)
+		{
+			scoresToMask(back_data + r * out_width, fore_data + r * out_width,
+				seg.ptr<uchar>(r), seg_size.width);
+		}
+		m_timings.argmax += lap(t);
+
+		// Refine segmentation
+		//cv::Mat kernel = cv::getStructuringElement(cv::MorphShapes::MORPH_ELLIPSE, cv::Size(3, 3));
+		//cv::erode(seg, seg, kernel, cv::Point(-1, -1), 5);
+		//cv::Mat kernel = cv::getStructuringElement(cv::MorphShapes::MORPH_ELLIPSE, cv::Size(5, 5));
+		//cv::erode(seg, seg, kernel, cv::Point(-1, -1), 1);
+		if(m_postprocess_seg) m_postprocessor.smooth(seg, 1, 2);
+		m_timings.postprocess += lap(t);
+	}
+
+	float* FaceSeg::inputLayerData(int n)
+	{
+		return m_engine->inputData(n);
+	}
+
+	/**	Get the scale and offset that map the range of an image depth to the
+		8-bit range. Floating point images are expected in the 8-bit range.
+	*/
+	static void depthTo8U(int depth, double& alpha, double& beta)
+	{
+		switch (depth)
+		{
+		case CV_8S: alpha = 1.0; beta = 128.0; break;
+		case CV_16U: alpha = 1.0 / 257.0; beta = 0.0; break;
+		case CV_16S: alpha = 1.0 / 257.0; beta = 32768.0 / 257.0; break;
+		case CV_32S: alpha = 1.0 / 16843009.0; beta = 2147483648.0 / 16843009.0; break;
+		default: alpha = 1.0; beta = 0.0;
+		}
+	}
+
+	void FaceSeg::preprocess(const cv::Mat& img, float* input_data)
+	{
+		cv::Mat sample;
+		if (img.depth() != CV_8U)
+		{
+			double alpha, beta;
+			depthTo8U(img.depth(), alpha, beta);
+			img.convertTo(m_ws_converted, CV_8U, alpha, beta);
+			sample = m_ws_converted;
+		}
+		else
+			sample = img;
+
+		// Resizing is the only separate pass, it runs on the 8-bit image
+		cv::Mat sample_resized;
+		if (m_scale && sample.size() != m_input_size)
+		{
+		    cv::resize(sample, m_ws_resized, m_input_size, 0, 0, cv::INTER_CUBIC);
+			sample_resized = m_ws_resized;
 		}
+		else
+		    sample_resized = sample;
+
+		// Convert the image to the input format of the network, convert to
+		// float and subtract the mean in a single pass. The separate planes
+		// are written directly to the input layer of the network.
+		// Any padding of the input layer is set to the mean color
+		toPlanarFloat(sample_resized, input_data, m_num_channels, meanColor(),
+			m_engine->inputSize(), !m_mean_folded);
 	}
 
 }   // namespace face_seg
@@ -0,0 +1,127 @@
+/** @file
+@brief Thread safe bounded queue for linking processing stages.
+*/
+
+#ifndef FACE_SEG_BOUNDED_QUEUE_H
+#define FACE_SEG_BOUNDED_QUEUE_H
+
+// std
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+namespace face_seg
+{
+	/**	Thread safe FIFO queue with a maximum capacity.
+		Producers block while the queue is full (backpressure) and consumers
+		block while the queue is empty, until the queue is closed.
+	*/
+	template<typename T>
+	class BoundedQueue
+	{
+	public:
+		/**	Construct BoundedQueue instance.
+			@param capacity The maximum number of items in the queue.
+		*/
+		explicit BoundedQueue(size_t capacity) : m_capacity(capacity > 0 ? capacity : 1)
+		{
+		}
+
+		/**	Add an item to the back of the queue, wait while the queue is full.
+			@param item The item to add.
+			@return false if the queue was closed and the item was dropped.
+		*/
+		bool push(T item)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_not_full.wait(lock, [this] { return m_closed || m_items.size() < m_capacity; });
+			if (m_closed) return false;
+			m_items.push_back(std::move(item));
+
+			// Update depth statistics
+			m_depth_sum += m_items.size();
+			++m_pushes;
+			if (m_items.size() > m_max_depth) m_max_depth = m_items.size();
+
+			lock.unlock();
+			m_not_empty.notify_one();
+			return true;
+		}
+
+		/**	Remove an item from the front of the queue, wait while the queue is empty.
+			@param item The removed item.
+			@return false if the queue was closed and there are no more items.
+		*/
+		bool pop(T& item)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_not_empty.wait(lock, [this] { return m_closed || !m_items.empty(); });
+			if (m_items.empty()) return false;
+			item = std::move(m_items.front());
+			m_items.pop_front();
+			lock.unlock();
+			m_not_full.notify_one();
+			return true;
+		}
+
+		/**	Close the queue. Waiting producers return immediately, consumers
+			return after the remaining items were removed.
+		*/
+		void close()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_closed = true;
+			}
+			m_not_full.notify_all();
+			m_not_empty.notify_all();
+		}
+
+		/**	Get the current number of items in the queue.
+		*/
+		size_t size() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_items.size();
+		}
+
+		/**	Get the maximum number of items in the queue.
+		*/
+		size_t capacity() const
+		{
+			return m_capacity;
+		}
+
+		/**	Get the largest number of items that were in the queue at once.
+		*/
+		size_t maxDepth() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_max_depth;
+		}
+
+		/**	Get the average number of items in the queue, sampled on each push.
+		*/
+		double averageDepth() const
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_pushes > 0 ? double(m_depth_sum) / m_pushes : 0.0;
+		}
+
+	private:
+		mutable std::mutex m_mutex;
+		std::condition_variable m_not_full;
+		std::condition_variable m_not_empty;
+		std::deque<T> m_items;
+		size_t m_capacity;
+		bool m_closed = false;
+
+		// Statistics
+		size_t m_max_depth = 0;
+		size_t m_depth_sum = 0;
+		size_t m_pushes = 0;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_BOUNDED_QUEUE_H
@@ -0,0 +1,61 @@
+/** @file
+@brief Caffe inference engine.
+*/
+
+#ifndef FACE_SEG_CAFFE_ENGINE_H
+#define FACE_SEG_CAFFE_ENGINE_H
+
+// Caffe
+#include <caffe/caffe.hpp>
+
+// face_seg
+#include "face_seg/inference_engine.h"
+#include "face_seg/model_cache.h"
+
+namespace face_seg
+{
+	/**	Runs the network with Caffe, on the GPU or the CPU.
+	*/
+	class CaffeEngine : public InferenceEngine
+	{
+	public:
+		/**	Load the network.
+			@param deploy_file Network definition file for deployment (.prototxt).
+			@param model_file Network weights model file (.caffemodel), or a
+			compiled model cache (see ModelCache), in which case deploy_file is ignored.
+			@param with_gpu Toggle GPU\CPU.
+			@param gpu_device_id Set the GPU's device id.
+		*/
+		CaffeEngine(const std::string& deploy_file, const std::string& model_file,
+			bool with_gpu = true, int gpu_device_id = 0);
+
+		/**	Create a network that shares the trained weights of another engine.
+		*/
+		explicit CaffeEngine(const CaffeEngine* other);
+
+		std::shared_ptr<InferenceEngine> clone() const override;
+		void initThread() const override;
+		int inputChannels() const override;
+		int inputNum() const override;
+		cv::Size inputSize() const override;
+		void reshapeInput(int num, const cv::Size& size) override;
+		float* inputData(int n) override;
+		void forward() override;
+		void forward(std::vector<double>& layer_times) override;
+		std::string netName() const override;
+		const std::vector<std::string>& layerNames() const override;
+		int outputChannels() const override;
+		cv::Size outputSize() const override;
+		const float* outputData(int n) const override;
+
+	private:
+		std::shared_ptr<caffe::Net<float>> m_net;
+		caffe::NetParameter m_net_param;
+		std::shared_ptr<ModelCache> m_model_cache;	// Keeps the mapped weights alive
+		bool m_with_gpu;
+		int m_gpu_device_id;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_CAFFE_ENGINE_H
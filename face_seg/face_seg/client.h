@@ -0,0 +1,65 @@
+/** @file
+@brief Client of face_seg_server.
+*/
+
+#ifndef FACE_SEG_CLIENT_H
+#define FACE_SEG_CLIENT_H
+
+// std
+#include <string>
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+// face_seg
+#include "face_seg/server_protocol.h"
+
+namespace face_seg
+{
+	/**	Client of a face_seg_server process.
+		The model stays loaded in the server, so a request costs only the
+		inference. Images and masks are passed through a shared memory object
+		owned by the client, which grows as needed and is reused between requests.
+		An instance is not thread safe, use one client per thread.
+	*/
+	class FaceSegClient
+	{
+	public:
+		/**	Connect to the server.
+			@param socket_path Path to the server's Unix domain socket.
+		*/
+		explicit FaceSegClient(const std::string& socket_path = DEFAULT_SERVER_SOCKET);
+
+		~FaceSegClient();
+
+		FaceSegClient(const FaceSegClient&) = delete;
+		FaceSegClient& operator=(const FaceSegClient&) = delete;
+
+		/**	Do face segmentation.
+			@param img BGR color image.
+			@param crop_face Crop the image to the face found by the server's
+			landmarks model.
+			@param roi Optional output region of the image covered by the mask.
+			@return 8-bit segmentation mask of the region, 255 for face pixels
+			and 0 for background pixels.
+		*/
+		cv::Mat process(const cv::Mat& img, bool crop_face = false, cv::Rect* roi = nullptr);
+
+		/**	Get an image in the shared memory.
+			Filling the returned image and passing it to process() avoids copying
+			the image to the shared memory. It stays valid until the next call.
+		*/
+		cv::Mat inputBuffer(const cv::Size& size, int type = CV_8UC3);
+
+	private:
+		void reserve(size_t size);
+
+	private:
+		int m_socket = -1;
+		SharedMemory m_shm;
+		int m_shm_count = 0;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_CLIENT_H
@@ -0,0 +1,76 @@
+/** @file
+@brief OpenCV DNN inference engine.
+*/
+
+#ifndef FACE_SEG_DNN_ENGINE_H
+#define FACE_SEG_DNN_ENGINE_H
+
+// OpenCV
+#include <opencv2/dnn.hpp>
+
+// face_seg
+#include "face_seg/inference_engine.h"
+
+namespace face_seg
+{
+	/**	Runs the network with OpenCV's DNN module, which loads the same Caffe
+		deploy and model files and has optimized CPU kernels, so Caffe is not
+		needed. OpenCV's networks can't share their weights, each clone loads
+		its own copy of them from the model data kept in memory.
+	*/
+	class DnnEngine : public InferenceEngine
+	{
+	public:
+		/**	Load the network.
+			@param deploy_file Network definition file for deployment (.prototxt).
+			@param model_file Network weights model file (.caffemodel).
+			@param with_gpu Use OpenCV's CUDA backend, if OpenCV was built with it.
+			@param gpu_device_id Set the GPU's device id.
+		*/
+		DnnEngine(const std::string& deploy_file, const std::string& model_file,
+			bool with_gpu = false, int gpu_device_id = 0);
+
+		/**	Create a network from the model data of another engine.
+		*/
+		explicit DnnEngine(const DnnEngine* other);
+
+		std::shared_ptr<InferenceEngine> clone() const override;
+		void initThread() const override;
+		int inputChannels() const override;
+		int inputNum() const override;
+		cv::Size inputSize() const override;
+		void reshapeInput(int num, const cv::Size& size) override;
+		float* inputData(int n) override;
+		void forward() override;
+		void forward(std::vector<double>& layer_times) override;
+		std::string netName() const override;
+		const std::vector<std::string>& layerNames() const override;
+		int outputChannels() const override;
+		cv::Size outputSize() const override;
+		const float* outputData(int n) const override;
+
+	private:
+		void loadNet();
+
+		/**	Infer the shape of the output layer from the shape of the input layer.
+		*/
+		void inferOutputShape();
+
+	private:
+		cv::dnn::Net m_net;
+		std::shared_ptr<const std::string> m_deploy;
+		std::shared_ptr<const std::string> m_model;
+		std::string m_net_name;
+		bool m_with_gpu;
+		int m_gpu_device_id;
+		std::vector<std::string> m_layer_names;
+		int m_output_layer = 0;
+
+		cv::Mat m_input;					// Input blob (NCHW)
+		cv::Mat m_output;					// Output blob of the last forward pass
+		cv::dnn::MatShape m_output_shape;	// Output shape of the current input shape
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_DNN_ENGINE_H
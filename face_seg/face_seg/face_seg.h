@@ -3,32 +3,79 @@
 
 // std
 #include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <chrono>
 
 // OpenCV
 #include <opencv2/core.hpp>
 
-// Caffe
-#include <caffe/caffe.hpp>
+// face_seg
+#include "face_seg/postprocess.h"
+#include "face_seg/instrumentation.h"
+#include "face_seg/inference_engine.h"
 
 namespace face_seg
 {
-	/**	This class provided deep face segmentation using Caffe with a fully connected
-		convolutional neural network.
+	/**	Mapping from segmentation mask coordinates to image coordinates:
+		image = mask * scale + offset.
+	*/
+	struct MaskTransform
+	{
+		cv::Point2f scale = cv::Point2f(1.0f, 1.0f);
+		cv::Point2f offset = cv::Point2f(0.0f, 0.0f);
+
+		/**	Map a point from mask coordinates to image coordinates.
+		*/
+		cv::Point2f toImage(const cv::Point2f& p) const
+		{
+			return cv::Point2f(p.x * scale.x + offset.x, p.y * scale.y + offset.y);
+		}
+
+		/**	Map a rectangle from mask coordinates to image coordinates.
+			The result covers all the image pixels of the mask pixels in the rectangle.
+		*/
+		cv::Rect toImage(const cv::Rect& r) const
+		{
+			cv::Point2f tl = toImage(cv::Point2f((float)r.x, (float)r.y));
+			cv::Point2f br = toImage(cv::Point2f((float)(r.x + r.width), (float)(r.y + r.height)));
+			return cv::Rect(cv::Point(cvFloor(tl.x), cvFloor(tl.y)), cv::Point(cvCeil(br.x), cvCeil(br.y)));
+		}
+	};
+
+	/**	Time spent in each stage of face segmentation, in seconds.
+	*/
+	struct StageTimings
+	{
+		double preprocess = 0.0;	///< Resizing and conversion to the input layer
+		double forward = 0.0;		///< The network's forward pass
+		double argmax = 0.0;		///< Extracting the mask from the output layer
+		double postprocess = 0.0;	///< Postprocessing of the mask
+		double upsample = 0.0;		///< Resizing the mask to the image size
+	};
+
+	/**	This class provided deep face segmentation with a fully connected
+		convolutional neural network, run by an inference engine (see InferenceEngine).
 	*/
     class FaceSeg
     {
     public:
 		/**	Construct FaceSeg instance.
 			@param deploy_file Network definition file for deployment (.prototxt).
-			@param model_file Network weights model file (.caffemodel).
+			@param model_file Network weights model file (.caffemodel), or a
+			compiled model cache (see ModelCache), in which case deploy_file is ignored.
 			@param with_gpu Toggle GPU\CPU.
 			@param gpu_device_id Set the GPU's device id.
 			@param scale Scale image to the network's maximum size (depicted by the prototxt file).
 			@param postprocess_seg Toggle postprocessing of the segmentation.
+			@param engine The inference engine, "caffe" or "opencv", see
+			createInferenceEngine. Empty for the default engine.
 		*/
 		FaceSeg(const std::string& deploy_file, const std::string& model_file,
             bool with_gpu = true, int gpu_device_id = 0,
-			bool scale = true, bool postprocess_seg = false);
+			bool scale = true, bool postprocess_seg = false,
+			const std::string& engine = "");
 
         ~FaceSeg();
 
@@ -39,38 +86,310 @@ namespace face_seg
 		*/
         cv::Mat process(const cv::Mat& img);
 
+		/**	Do face segmentation without resizing the segmentation to the original
+			image size. Useful when only the bounding box, area or contour of the
+			segmentation is needed.
+			@param img BGR color image.
+			@param transform Output mapping from the segmentation coordinates to
+			the image coordinates.
+			@return 8-bit segmentation mask in the network's resolution, 255 for
+			face pixels and 0 for background pixels.
+		*/
+		cv::Mat process(const cv::Mat& img, MaskTransform& transform);
+
+		/**	Do face segmentation into a preallocated mask.
+			The intermediate images are kept in a workspace inside the instance,
+			so once the image size is steady and the same output mask is passed
+			in every call, no Mat data is allocated (see Instrumentation).
+			@param img BGR color image.
+			@param out_mask Output 8-bit segmentation mask, 255 for face pixels and
+			0 for background pixels. Its data is reused if it already has the
+			image's size and type, and is overwritten by every call.
+		*/
+		void process(const cv::Mat& img, cv::Mat& out_mask);
+
+		/**	Do face segmentation of a region of a frame, such as a face crop.
+			The region is read directly from the frame, without copying it.
+			@param frame BGR color image.
+			@param roi Region of the frame to segment, clipped to the frame.
+			@return 8-bit segmentation mask of the whole frame, 255 for face
+			pixels and 0 for background pixels, including all the pixels outside
+			the region.
+		*/
+		cv::Mat process(const cv::Mat& frame, const cv::Rect& roi);
+
+		/**	Do face segmentation of a region of a frame into a preallocated
+			full frame mask.
+			@param frame BGR color image.
+			@param roi Region of the frame to segment, clipped to the frame.
+			@param out_mask Output 8-bit segmentation mask of the whole frame.
+			The region is segmented in place and the pixels outside of it are
+			set to 0. Its data is reused if it already has the frame's size and type.
+		*/
+		void process(const cv::Mat& frame, const cv::Rect& roi, cv::Mat& out_mask);
+
+		/**	Do face segmentation on a batch of images using a single forward pass.
+			The input blob is reshaped to the number of images, so the convolutions
+			run as batched GEMMs. When scale is disabled the images are padded to
+			the smallest reshape bucket (see setReshapeCache) that fits all of
+			them, unless that would more than double the input pixels, then they
+			are processed one by one.
+			@param imgs BGR color images.
+			@return 8-bit segmentation masks, one for each input image, 255 for
+			face pixels and 0 for background pixels.
+		*/
+		std::vector<cv::Mat> processBatch(const std::vector<cv::Mat>& imgs);
+
+		/**	Do face segmentation of several regions of a frame, such as all the
+			faces in a group photo, using a single forward pass (see processBatch).
+			The regions are read directly from the frame, without copying them.
+			@param frame BGR color image.
+			@param rois Regions of the frame to segment, clipped to the frame.
+			@param out_mask Output 8-bit mask of the whole frame. Its data is
+			reused if it already has the frame's size and type.
+			@param labeled If true, the face pixels of the i'th region are set
+			to i + 1 (up to 255 regions), otherwise to 255. The background is 0.
+			Where regions overlap, the face pixels of the first region are kept.
+		*/
+		void processRegions(const cv::Mat& frame, const std::vector<cv::Rect>& rois,
+			cv::Mat& out_mask, bool labeled = false);
+
+		/**	Create a new instance that shares the trained weights of this instance.
+			Each instance has its own intermediate blobs, so different instances
+			can be used concurrently from different threads.
+			@return The new instance.
+		*/
+		std::shared_ptr<FaceSeg> clone() const;
+
+		/**	Setup the inference engine for the calling thread.
+			Caffe keeps its mode and device per thread, this must be called by
+			every thread that uses this instance, other than the thread that
+			constructed it.
+		*/
+		void initThread() const;
+
+		/**	Set the reshape strategy used when scale is disabled.
+			Input sizes are rounded up to the nearest bucket and padded, and the
+			networks reshaped to the most recently used buckets are kept, so images
+			of similar sizes don't reshape (and reallocate) the whole network.
+			Each kept network has its own intermediate blobs but all of them share
+			the same trained weights.
+			@param step Input sizes are rounded up to multiples of step.
+			1 disables the padding.
+			@param capacity The number of reshaped networks to keep.
+		*/
+		void setReshapeCache(int step, int capacity);
+
+		/**	Enable tiled inference of large images when scale is disabled.
+			Images larger than a tile in either dimension are segmented in their
+			native resolution, instead of being downscaled to the network's
+			maximum size. They are split into overlapping tiles of a fixed size,
+			the tiles of each row are segmented in batches, and the scores of
+			overlapping tiles are blended with linear weights into a seamless
+			mask. The network is only reshaped to the tile size and the blended
+			scores of a single row of tiles are kept, so the memory doesn't grow
+			with the size of the image, other than the output mask.
+			@param tile_size The input size of the tiles, empty to disable tiling.
+			@param overlap The overlap between neighboring tiles in pixels.
+			@param batch_size The maximum number of tiles in a forward pass.
+		*/
+		void setTiling(const cv::Size& tile_size, int overlap = 64, int batch_size = 4);
+
+		/**	Get the input size of the tiles, empty if tiling is disabled.
+		*/
+		const cv::Size& tileSize() const { return m_tile_size; }
+
+		/**	Get the number of images that used an already reshaped network.
+		*/
+		size_t reshapeCacheHits() const { return m_reshape_hits; }
+
+		/**	Get the number of images that required reshaping the network.
+		*/
+		size_t reshapeCacheMisses() const { return m_reshape_misses; }
+
+		/**	Get the time spent in each stage by the last call to process or
+			processBatch. On the GPU the forward pass runs asynchronously, so part
+			of its time is included in argmax, which waits for the output.
+		*/
+		const StageTimings& lastTimings() const { return m_timings; }
+
+		/**	Enable collecting statistics of every call: the time of each stage,
+			the forward time of each layer and the bytes of Mat data allocated
+			per call.
+			Measuring each layer forwards the network one layer at a time (and
+			synchronizes the GPU after each layer), so it should only be enabled
+			when needed. Instances created by clone share the same instrumentation.
+			@param instrumentation The statistics to add to, or nullptr to disable.
+		*/
+		void setInstrumentation(std::shared_ptr<Instrumentation> instrumentation);
+
+		/**	Get the statistics collected by this instance, nullptr if disabled.
+		*/
+		std::shared_ptr<Instrumentation> instrumentation() const { return m_instrumentation; }
+
+		/**	Get the network's input size.
+		*/
+		const cv::Size& inputSize() const { return m_input_size; }
+
+		/**	Get whether the network is running on the GPU.
+		*/
+		bool withGpu() const { return m_with_gpu; }
+
+		/**	Get the inference engine running the network.
+		*/
+		const InferenceEngine& engine() const { return *m_engine; }
+
+		/**	Get the mean pixel color (BGR) that is subtracted from the images.
+		*/
+		static cv::Scalar meanColor();
+
+		/**	Get the suffix of the names of networks that subtract the mean color
+			themselves, as written by face_seg_compact. For these networks the
+			mean color is not subtracted in preprocessing.
+		*/
+		static std::string meanFoldedSuffix();
+
     private:
 
-		/** Wrap the input layer of the network in separate cv::Mat objects
-			(one per channel). This way we save one memcpy operation and we
-			don't need to rely on cudaMemcpy2D. The last preprocessing operation 
-			will write the separate channels directly to the input layer.
-			@param input_channels Input image channels.
+		/**	Construct FaceSeg instance that shares the trained weights of another instance.
+			@param other The instance to share the trained weights with.
 		*/
-        void wrapInputLayer(std::vector<cv::Mat>& input_channels);
+		explicit FaceSeg(const FaceSeg* other);
 
-		/**	Preprocess image for network.
+		/**	Forward pass, timing each layer if instrumentation is enabled.
+		*/
+		void forward();
+
+		/**	Reset the stage timings at the beginning of a call.
+		*/
+		void beginCall();
+
+		/**	Add the statistics of a call to the instrumentation, if enabled.
+		*/
+		void endCall();
+
+		/**	Read the network's input and output layer properties.
+		*/
+		void initLayers();
+
+		/** Get a pointer to the input layer data of an image in the batch.
+			The input layer is stored as separate planes (one per channel), the
+			preprocessing writes the image directly to it.
+			@param n The index of the image in the input batch.
+		*/
+		float* inputLayerData(int n = 0);
+
+		/**	Reshape the input layer and forward the dimension change to all layers.
+			Does nothing if the input layer already has the requested shape.
+			@param num Number of images in the batch.
+			@param size Input image size.
+		*/
+		void reshapeInput(int num, const cv::Size& size);
+
+		/**	Get the reshape bucket of an input size.
+			@param size Input image size.
+			@return The input size rounded up to the reshape cache step.
+		*/
+		cv::Size bucketSize(const cv::Size& size) const;
+
+		/**	Make the network reshaped to a bucket the current network,
+			creating it if it's not in the reshape cache.
+			@param bucket_size The input size of the network.
+		*/
+		void selectNet(const cv::Size& bucket_size);
+
+		/**	Get the size of the segmentation extracted from the output layer.
+			@param img_size The size of the image in the input layer.
+		*/
+		cv::Size segmentationSize(const cv::Size& img_size) const;
+
+		/**	Extract segmentation from the output layer of the network.
+			@param n The index of the image in the output batch.
+			@param img_size The size of the image in the input layer, only the
+			corresponding region of the output layer is extracted.
+			@param seg Output 8-bit segmentation mask in the network's resolution.
+		*/
+		void extractSegmentation(int n, const cv::Size& img_size, cv::Mat& seg);
+
+		/**	Prepare the network's input for a single image.
 			@param img BGR color image.
-			@param input_channels Input image channels.
+			@return The size of the image as it was written to the input layer.
 		*/
-        void preprocess(const cv::Mat& img, std::vector<cv::Mat>& input_channels);
+		cv::Size prepareInput(const cv::Mat& img);
 
-		/**	Substract mean color from image.
-			@param img BGR float image.
+		/**	Check whether an image is segmented in tiles, see setTiling.
 		*/
-        void subtractMean_c3(cv::Mat& img);
+		bool isTiled(const cv::Size& img_size) const;
+
+		/**	Segment an image in overlapping tiles, see setTiling.
+			@param img BGR color image.
+			@param seg Output 8-bit segmentation mask in the network's resolution.
+		*/
+		void processTiled(const cv::Mat& img, cv::Mat& seg);
+
+		/**	Add the blending weighted scores of a tile to the scores of its row.
+			@param n The index of the tile in the output batch.
+			@param tile The tile's region in the image.
+			@param img_size The size of the image.
+			@param band_y The row of the image's segmentation where the
+			scores of the row of tiles begin.
+		*/
+		void blendTile(int n, const cv::Rect& tile, const cv::Size& img_size, int band_y);
+
+		/**	Enforce the network's maximum size when scale is disabled.
+			@param img BGR color image.
+			@param buf Buffer for the downscaled image.
+			@return The image, or buf if it was downscaled because it's wider
+			or taller than the network input.
+		*/
+		cv::Mat limitSize(const cv::Mat& img, cv::Mat& buf);
+
+		/**	Preprocess image for network.
+			@param img BGR, BGRA or grayscale image.
+			@param input_data Pointer to the input layer data of the image.
+		*/
+        void preprocess(const cv::Mat& img, float* input_data);
 
     protected:
-        std::shared_ptr<caffe::Net<float>> m_net;
+        std::shared_ptr<InferenceEngine> m_engine;
         int m_num_channels;
         cv::Size m_input_size;
         bool m_with_gpu;
+        int m_gpu_device_id;
 		bool m_scale;
 		bool m_postprocess_seg;
 		int m_foreground_channel = 1;
+		bool m_mean_folded = false;
+		PostProcessor m_postprocessor;
+
+		// Reshape cache
+		typedef std::pair<cv::Size, std::shared_ptr<InferenceEngine>> BucketNet;
+		std::list<BucketNet> m_bucket_nets;
+		int m_bucket_step = 32;
+		int m_bucket_capacity = 2;
+		size_t m_reshape_hits = 0;
+		size_t m_reshape_misses = 0;
+
+		// Tiling
+		cv::Size m_tile_size;
+		int m_tile_overlap = 64;
+		int m_tile_batch_size = 4;
+
+		// Workspace, reused between calls
+		cv::Mat m_ws_converted;	// 8-bit image
+		cv::Mat m_ws_resized;	// Image resized to the network's input size
+		cv::Mat m_ws_limited;	// Image limited to the network's maximum size
+		cv::Mat m_ws_seg;		// Segmentation in the network's resolution
+		cv::Mat m_ws_band;		// Blended scores of a row of tiles
+		cv::Mat m_ws_carry;		// Blended scores carried over to the next row of tiles
+		std::vector<float> m_ws_weights_x, m_ws_weights_y;	// Blending weights of a tile
 
-		// Mean pixel color
-		const float MB = 104.00699f, MG = 116.66877f, MR = 122.67892f;
+		// Profiling
+		StageTimings m_timings;
+		std::shared_ptr<Instrumentation> m_instrumentation;
+		std::vector<double> m_layer_times;
+		std::chrono::steady_clock::time_point m_call_start;
+		size_t m_call_mat_allocated_bytes = 0;
     };
 
 }   // namespace face_seg
@@ -0,0 +1,124 @@
+/** @file
+@brief Asynchronous face segmentation of concurrent requests in micro-batches.
+*/
+
+#ifndef FACE_SEG_FACE_SEG_BATCHER_H
+#define FACE_SEG_FACE_SEG_BATCHER_H
+
+// std
+#include <vector>
+#include <deque>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// face_seg
+#include "face_seg/face_seg.h"
+#include "face_seg/face_seg_pool.h"
+#include "face_seg/instrumentation.h"
+
+namespace face_seg
+{
+	/**	Collects the images submitted concurrently by several threads into
+		micro-batches, each segmented by a single forward pass (see
+		FaceSeg::processBatch). Every instance runs on its own worker thread,
+		and all of them share the trained weights of the first.
+
+		A worker starts a batch as soon as it has max_batch_size requests, or
+		when the oldest request has waited max_wait. With max_wait of zero the
+		batching is greedy: an idle worker takes whatever is queued, so a single
+		request is not delayed, and batches only grow while the workers are
+		busy, that is, under load.
+	*/
+	class FaceSegBatcher
+	{
+	public:
+		/**	Construct FaceSegBatcher instance.
+			@param fs The instance to share the trained weights with, it will be
+			used by the first worker.
+			@param instances The number of instances, each running batches on
+			its own worker thread.
+			@param max_batch_size The maximum number of images in a batch.
+			@param max_wait The maximum time in seconds a request waits for more
+			requests to join its batch.
+		*/
+		FaceSegBatcher(std::shared_ptr<FaceSeg> fs, int instances = 1,
+			int max_batch_size = 8, double max_wait = 0.0);
+
+		/**	Finishes all the submitted requests.
+		*/
+		~FaceSegBatcher();
+
+		FaceSegBatcher(const FaceSegBatcher&) = delete;
+		FaceSegBatcher& operator=(const FaceSegBatcher&) = delete;
+
+		/**	Submit face segmentation of a single image.
+			The image data must remain valid until the future is ready.
+			@param img BGR color image.
+			@return Future of the 8-bit segmentation mask.
+		*/
+		std::future<cv::Mat> submit(const cv::Mat& img);
+
+		/**	Get the number of requests waiting for a batch.
+		*/
+		size_t queueDepth() const;
+
+		/**	Get a copy of the histogram of the number of requests waiting,
+			sampled at every submission (including the submitted request).
+		*/
+		Histogram queueDepths() const;
+
+		/**	Get a copy of the histogram of the number of images in each batch.
+		*/
+		Histogram batchSizes() const;
+
+		/**	Get a copy of the histogram of the time in seconds each request
+			waited until its batch started.
+		*/
+		Histogram queueTimes() const;
+
+		/**	Get the number of instances.
+		*/
+		int size() const { return (int)m_threads.size(); }
+
+	private:
+		typedef std::chrono::steady_clock Clock;
+
+		struct Request
+		{
+			cv::Mat img;
+			std::promise<cv::Mat> promise;
+			Clock::time_point time;
+		};
+
+		void run(FaceSeg& fs);
+		void stop();
+
+		/**	Wait for the next batch and take its requests.
+			@return false if stopped and there are no more requests.
+		*/
+		bool takeBatch(std::vector<Request>& batch);
+
+	private:
+		std::vector<std::shared_ptr<FaceSeg>> m_instances;
+		std::vector<std::thread> m_threads;
+		size_t m_max_batch_size;
+		Clock::duration m_max_wait;
+
+		mutable std::mutex m_mutex;
+		std::condition_variable m_cond;
+		std::deque<Request> m_requests;
+		bool m_stop = false;
+
+		// Statistics
+		Histogram m_queue_depths;
+		Histogram m_batch_sizes;
+		Histogram m_queue_times;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_FACE_SEG_BATCHER_H
@@ -0,0 +1,133 @@
+/** @file
+@brief Pool of face segmentation instances sharing the same trained weights.
+*/
+
+#ifndef FACE_SEG_FACE_SEG_POOL_H
+#define FACE_SEG_FACE_SEG_POOL_H
+
+// std
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <future>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// face_seg
+#include "face_seg/face_seg.h"
+
+namespace face_seg
+{
+	/**	Start a worker thread for a FaceSeg instance.
+		The thread sets up the instance's engine and, on the GPU, runs a warm up
+		pass, so the weights it shares are synced to the device before another
+		worker accesses them concurrently. Returns once the warm up is done, and
+		then the thread calls run.
+		@param fs The instance used by the thread, it must outlive the thread.
+		@param run The worker's loop.
+		@return The worker thread. An exception from the warm up is rethrown
+		after the thread is joined.
+	*/
+	std::thread startWorkerThread(FaceSeg& fs, std::function<void()> run);
+
+	/**	Pool of FaceSeg instances, each running on its own worker thread.
+		With the Caffe engine all the instances share a single copy of the
+		trained weights. Every worker has its own task queue, tasks are
+		distributed between the queues in round robin order and idle workers
+		steal tasks from the other queues.
+		When running on the CPU, consider limiting the number of BLAS threads
+		per instance (e.g. OPENBLAS_NUM_THREADS=1).
+	*/
+	class FaceSegPool
+	{
+	public:
+		/**	Construct FaceSegPool instance.
+			@param fs The instance to share the trained weights with, it will be
+			used by the first worker.
+			@param instances The number of instances in the pool.
+		*/
+		FaceSegPool(std::shared_ptr<FaceSeg> fs, int instances);
+
+		/**	Construct FaceSegPool instance.
+			@param deploy_file Network definition file for deployment (.prototxt).
+			@param model_file Network weights model file (.caffemodel).
+			@param instances The number of instances in the pool.
+			@param with_gpu Toggle GPU\CPU.
+			@param gpu_device_id Set the GPU's device id.
+			@param scale Scale image to the network's maximum size (depicted by the prototxt file).
+			@param postprocess_seg Toggle postprocessing of the segmentation.
+			@param engine The inference engine, empty for the default engine.
+		*/
+		FaceSegPool(const std::string& deploy_file, const std::string& model_file,
+			int instances, bool with_gpu = true, int gpu_device_id = 0,
+			bool scale = true, bool postprocess_seg = false,
+			const std::string& engine = "");
+
+		~FaceSegPool();
+
+		/**	Submit face segmentation of a single image.
+			@param img BGR color image.
+			@return Future of the 8-bit segmentation mask.
+		*/
+		std::future<cv::Mat> submit(const cv::Mat& img);
+
+		/**	Submit face segmentation of a batch of images, the batch is processed
+			by a single instance using a single forward pass.
+			@param imgs BGR color images.
+			@return Future of the 8-bit segmentation masks.
+		*/
+		std::future<std::vector<cv::Mat>> submitBatch(const std::vector<cv::Mat>& imgs);
+
+		/**	Submit face segmentation of several regions of a frame, see
+			FaceSeg::processRegions.
+			@param frame BGR color image.
+			@param rois Regions of the frame to segment.
+			@param labeled Label the face pixels by region instead of 255.
+			@return Future of the 8-bit mask of the whole frame.
+		*/
+		std::future<cv::Mat> submitRegions(const cv::Mat& frame, const std::vector<cv::Rect>& rois,
+			bool labeled = false);
+
+		/**	Do face segmentation on multiple images in parallel and wait for the results.
+			@param imgs BGR color images.
+			@return 8-bit segmentation masks, one for each input image.
+		*/
+		std::vector<cv::Mat> process(const std::vector<cv::Mat>& imgs);
+
+		/**	Get the number of instances in the pool.
+		*/
+		int size() const { return (int)m_workers.size(); }
+
+	private:
+		typedef std::function<void(FaceSeg&)> Task;
+
+		struct Worker
+		{
+			std::shared_ptr<FaceSeg> fs;
+			std::deque<Task> tasks;
+			std::mutex mutex;
+			std::thread thread;
+		};
+
+		void init(std::shared_ptr<FaceSeg> fs, int instances);
+		void stop();
+		void pushTask(Task task);
+		bool popTask(size_t worker_index, Task& task);
+		void run(size_t worker_index);
+
+	private:
+		std::vector<std::unique_ptr<Worker>> m_workers;
+		std::mutex m_mutex;
+		std::condition_variable m_cond;
+		size_t m_pending = 0;
+		bool m_stop = false;
+		std::atomic<size_t> m_next_worker;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_FACE_SEG_POOL_H
@@ -0,0 +1,156 @@
+/** @file
+@brief Image inputs: directory enumeration and memory mapped image shards.
+*/
+
+#ifndef FACE_SEG_IMAGE_SOURCE_H
+#define FACE_SEG_IMAGE_SOURCE_H
+
+// std
+#include <string>
+#include <vector>
+
+// OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+// face_seg
+#include "face_seg/mapped_file.h"
+
+namespace face_seg
+{
+	/**	Check whether a file name has the extension of an image format OpenCV
+		can read, case insensitive.
+	*/
+	bool hasImageExtension(const std::string& file_name);
+
+	/**	List the image files in a directory, by extension.
+		The file types come from the directory entries themselves, so on file
+		systems that report them no file is opened or stat'ed.
+		@param dir_path Path to the directory.
+		@param img_paths Output image paths, appended in directory order.
+		@throw std::runtime_error if the directory can't be read.
+	*/
+	void listImageFiles(const std::string& dir_path, std::vector<std::string>& img_paths);
+
+	/**	Read a list of image paths from a text file, one path per line.
+		Reading stops at the first empty line.
+		@param list_path Path to the list file.
+		@param img_paths Output image paths, appended in file order.
+	*/
+	void readImageList(const std::string& list_path, std::vector<std::string>& img_paths);
+
+	/**	Get the size of a JPEG image from its frame header, without decoding it.
+		@param data Encoded image.
+		@param size Size of the encoded image in bytes.
+		@param img_size Output image size, before any EXIF orientation.
+		@return false if the data is not a JPEG image or its header is corrupted.
+	*/
+	bool readJpegSize(const uchar* data, size_t size, cv::Size& img_size);
+
+	/**	Get the largest JPEG decoding scale denominator (1, 2, 4 or 8) that keeps
+		the decoded image at least min_size in both dimensions.
+	*/
+	int reducedDecodeScale(const cv::Size& img_size, const cv::Size& min_size);
+
+	/**	Decode a color image at reduced resolution.
+		JPEG images are downscaled by 2, 4 or 8 in the DCT domain while decoding,
+		to the smallest size that is still at least min_size in both dimensions,
+		which skips most of the decoding work of large images. Other formats are
+		decoded at full resolution.
+		@param data Encoded image.
+		@param size Size of the encoded image in bytes.
+		@param min_size Minimum size of the decoded image, for example the
+		network's input size. An empty size decodes at full resolution.
+		@param original_size Optional output size of the image at full
+		resolution, in the orientation of the decoded image.
+		@return The decoded image, empty if decoding failed.
+	*/
+	cv::Mat decodeImageReduced(const uchar* data, size_t size, const cv::Size& min_size,
+		cv::Size* original_size = nullptr);
+
+	/**	Read a color image file at reduced resolution, see decodeImageReduced().
+		@param data Optional output encoded image, to decode it again at another size.
+	*/
+	cv::Mat readImageReduced(const std::string& img_path, const cv::Size& min_size,
+		cv::Size* original_size = nullptr, std::vector<uchar>* data = nullptr);
+
+	/**	Decode an image again at a higher resolution, if it was decoded at
+		reduced resolution and its regions turned out too small. For example,
+		faces found in a reduced image are cropped from an image decoded at the
+		resolution the network needs.
+		@param data Encoded image.
+		@param size Size of the encoded image in bytes.
+		@param min_region_size Minimum size of the largest region.
+		@param img The decoded image, replaced if decoded again.
+		@param regions Regions in the decoded image, scaled to the new image.
+		@return true if the image was decoded again.
+	*/
+	bool decodeImageForRegions(const uchar* data, size_t size, const cv::Size& min_region_size,
+		cv::Mat& img, std::vector<cv::Rect>& regions);
+
+	/**	Memory mapped shard of encoded images.
+		A shard is a tar archive of image files. The whole archive is mapped
+		once and the images are decoded straight from the mapping, so reading
+		a shard of thousands of images opens a single file. Members that are
+		not images by extension are ignored. Both ustar and the GNU and pax
+		long name extensions are supported.
+	*/
+	class ImageShard
+	{
+	public:
+		/**	Map a shard and index its images.
+			@param shard_path Path to the shard (.tar).
+			@throw std::runtime_error if the shard can't be mapped or is corrupted.
+		*/
+		explicit ImageShard(const std::string& shard_path);
+
+		ImageShard(const ImageShard&) = delete;
+		ImageShard& operator=(const ImageShard&) = delete;
+
+		/**	Check whether a path names an image shard, by extension.
+		*/
+		static bool isImageShard(const std::string& file_path);
+
+		/**	Get the number of images in the shard.
+		*/
+		size_t size() const { return m_entries.size(); }
+
+		/**	Get the path of the i'th image inside the shard.
+		*/
+		const std::string& name(size_t i) const { return m_entries[i].name; }
+
+		/**	Get the encoded data of the i'th image, pointing into the mapping.
+		*/
+		const uchar* data(size_t i) const { return (const uchar*)m_file.data() + m_entries[i].offset; }
+
+		/**	Get the size in bytes of the encoded data of the i'th image.
+		*/
+		size_t dataSize(size_t i) const { return m_entries[i].size; }
+
+		/**	Decode the i'th image from the mapping.
+			@param i Image index.
+			@param flags cv::imdecode flags.
+			@return The decoded image, empty if decoding failed.
+		*/
+		cv::Mat decode(size_t i, int flags = cv::IMREAD_COLOR) const;
+
+	private:
+		/**	Image in the mapped shard.
+		*/
+		struct Entry
+		{
+			std::string name;
+			size_t offset;
+			size_t size;
+		};
+
+		void parse(const std::string& shard_path);
+
+	private:
+		MappedFile m_file;
+		std::vector<Entry> m_entries;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_IMAGE_SOURCE_H
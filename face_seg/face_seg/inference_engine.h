@@ -0,0 +1,114 @@
+/** @file
+@brief Inference engines that run the segmentation network.
+*/
+
+#ifndef FACE_SEG_INFERENCE_ENGINE_H
+#define FACE_SEG_INFERENCE_ENGINE_H
+
+// std
+#include <string>
+#include <vector>
+#include <memory>
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+namespace face_seg
+{
+	/**	Runs the forward pass of a network with a single input and a single
+		output, both stored as batches of separate float planes (NCHW).
+		An instance is used by a single thread at a time, use clone to create
+		instances for other threads.
+	*/
+	class InferenceEngine
+	{
+	public:
+		virtual ~InferenceEngine() {}
+
+		/**	Create a new instance of the same network, sharing the trained
+			weights if the engine supports it.
+		*/
+		virtual std::shared_ptr<InferenceEngine> clone() const = 0;
+
+		/**	Setup the engine for the calling thread, see FaceSeg::initThread.
+		*/
+		virtual void initThread() const {}
+
+		/**	Get the number of channels of the input layer.
+		*/
+		virtual int inputChannels() const = 0;
+
+		/**	Get the number of images in the input layer.
+		*/
+		virtual int inputNum() const = 0;
+
+		/**	Get the image size of the input layer.
+		*/
+		virtual cv::Size inputSize() const = 0;
+
+		/**	Reshape the input layer and forward the dimension change to all layers.
+			@param num Number of images in the batch.
+			@param size Input image size.
+		*/
+		virtual void reshapeInput(int num, const cv::Size& size) = 0;
+
+		/**	Get a pointer to the input layer data of an image in the batch.
+			@param n The index of the image in the input batch.
+		*/
+		virtual float* inputData(int n) = 0;
+
+		/**	Forward pass.
+		*/
+		virtual void forward() = 0;
+
+		/**	Forward pass, measuring the time of each layer.
+			@param layer_times Output forward time of each layer in seconds,
+			in the order of layerNames.
+		*/
+		virtual void forward(std::vector<double>& layer_times) = 0;
+
+		/**	Get the name of the network, as set in its definition.
+		*/
+		virtual std::string netName() const = 0;
+
+		/**	Get the names of the network's layers.
+		*/
+		virtual const std::vector<std::string>& layerNames() const = 0;
+
+		/**	Get the number of channels of the output layer.
+		*/
+		virtual int outputChannels() const = 0;
+
+		/**	Get the image size of the output layer.
+		*/
+		virtual cv::Size outputSize() const = 0;
+
+		/**	Get a pointer to the output layer data of an image in the batch,
+			valid until the next forward pass.
+			@param n The index of the image in the output batch.
+		*/
+		virtual const float* outputData(int n) const = 0;
+	};
+
+	/**	Create an inference engine.
+		@param engine The engine's name: "caffe" or "opencv" (OpenCV's DNN
+		module), see inferenceEngines. Empty for the default engine.
+		@param deploy_file Network definition file for deployment (.prototxt).
+		@param model_file Network weights model file (.caffemodel), or a
+		compiled model cache for the Caffe engine.
+		@param with_gpu Toggle GPU\CPU.
+		@param gpu_device_id Set the GPU's device id.
+		@throw std::runtime_error if the engine is not available.
+	*/
+	std::shared_ptr<InferenceEngine> createInferenceEngine(const std::string& engine,
+		const std::string& deploy_file, const std::string& model_file,
+		bool with_gpu = true, int gpu_device_id = 0);
+
+	/**	Get the names of the inference engines the library was built with,
+		the first is the default.
+	*/
+	std::vector<std::string> inferenceEngines();
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_INFERENCE_ENGINE_H
@@ -0,0 +1,164 @@
+/** @file
+@brief Runtime instrumentation of the face segmentation.
+*/
+
+#ifndef FACE_SEG_INSTRUMENTATION_H
+#define FACE_SEG_INSTRUMENTATION_H
+
+// std
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <ostream>
+
+namespace face_seg
+{
+	/**	Histogram with exponentially growing buckets.
+		Bucket i counts the values in (bound(i - 1), bound(i)], where
+		bound(i) = first_bound * factor^i, and the last bucket counts everything
+		above the last bound.
+	*/
+	class Histogram
+	{
+	public:
+		/**	Construct an empty histogram.
+			@param first_bound The upper bound of the first bucket.
+			@param factor The ratio between the upper bounds of consecutive buckets.
+			@param bucket_count The number of bounded buckets.
+		*/
+		Histogram(double first_bound = 1.0e-6, double factor = 2.0, int bucket_count = 28);
+
+		/**	Add a value.
+		*/
+		void add(double value);
+
+		/**	Add all the values of another histogram with the same buckets.
+		*/
+		void merge(const Histogram& other);
+
+		size_t count() const { return m_count; }
+		double sum() const { return m_sum; }
+		double mean() const { return m_count > 0 ? m_sum / m_count : 0.0; }
+		double min() const { return m_count > 0 ? m_min : 0.0; }
+		double max() const { return m_count > 0 ? m_max : 0.0; }
+
+		/**	Estimate the p'th percentile, interpolating inside the bucket.
+		*/
+		double percentile(double p) const;
+
+		/**	Get the upper bounds of the bounded buckets.
+		*/
+		const std::vector<double>& bounds() const { return m_bounds; }
+
+		/**	Get the number of values in each bucket, including the unbounded last one.
+		*/
+		const std::vector<size_t>& bucketCounts() const { return m_counts; }
+
+	private:
+		std::vector<double> m_bounds;
+		std::vector<size_t> m_counts;
+		size_t m_count = 0;
+		double m_sum = 0.0;
+		double m_min = 0.0, m_max = 0.0;
+	};
+
+	/**	Aggregated statistics of face segmentation calls.
+		Holds histograms of the time spent in each processing stage, in each
+		layer of the network's forward pass, and of the bytes of Mat data
+		allocated per call. Only cv::Mat allocations are counted, the network's
+		blobs and other containers are not.
+		An instance can be shared between several FaceSeg instances, it is thread safe.
+	*/
+	class Instrumentation
+	{
+	public:
+		Instrumentation();
+
+		/**	Add the time of a processing stage in a single call, in seconds.
+		*/
+		void addStage(const std::string& name, double seconds);
+
+		/**	Add the forward time of each layer in a single call, in seconds.
+			@param names Layer names.
+			@param seconds Forward time of each layer.
+		*/
+		void addLayers(const std::vector<std::string>& names, const std::vector<double>& seconds);
+
+		/**	Add the bytes of Mat data allocated by a single call.
+		*/
+		void addMatAllocation(size_t bytes);
+
+		/**	Get the names of the recorded stages, in recording order.
+		*/
+		std::vector<std::string> stageNames() const;
+
+		/**	Get the names of the recorded layers, in the network's order.
+		*/
+		std::vector<std::string> layerNames() const;
+
+		/**	Get a copy of the histogram of a stage, empty if it was never recorded.
+		*/
+		Histogram stage(const std::string& name) const;
+
+		/**	Get a copy of the histogram of a layer, empty if it was never recorded.
+		*/
+		Histogram layer(const std::string& name) const;
+
+		/**	Get a copy of the histogram of the bytes of Mat data allocated per call.
+		*/
+		Histogram matAllocations() const;
+
+		/**	Clear all the statistics.
+		*/
+		void reset();
+
+		/**	Write all the statistics as JSON.
+		*/
+		void writeJson(std::ostream& out) const;
+
+		/**	Write all the statistics as JSON to a file.
+		*/
+		void writeJson(const std::string& file_path) const;
+
+		/**	Write all the histograms in Prometheus' text exposition format.
+		*/
+		void writePrometheus(std::ostream& out) const;
+
+		/**	Write all the histograms in Prometheus' text exposition format to a file.
+		*/
+		void writePrometheus(const std::string& file_path) const;
+
+		/**	Install an OpenCV allocator that counts the bytes of Mat data
+			allocated by each thread.
+			Called when instrumentation is first enabled, Mat allocation is not
+			affected otherwise.
+		*/
+		static void installMatAllocationCounter();
+
+		/**	Get the total bytes of Mat data allocated by the calling thread,
+			since the allocation counter was installed.
+		*/
+		static size_t threadMatAllocatedBytes();
+
+	private:
+		/**	Histograms in insertion order, with lookup by name.
+		*/
+		struct HistogramSet
+		{
+			std::vector<std::pair<std::string, Histogram>> histograms;
+			std::map<std::string, size_t> index;
+
+			Histogram& get(const std::string& name, const Histogram& empty);
+		};
+
+	private:
+		mutable std::mutex m_mutex;
+		HistogramSet m_stages;
+		HistogramSet m_layers;
+		Histogram m_mat_allocations;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_INSTRUMENTATION_H
@@ -0,0 +1,70 @@
+/** @file
+@brief Vectorized image processing kernels used by the face segmentation.
+*/
+
+#ifndef FACE_SEG_KERNELS_H
+#define FACE_SEG_KERNELS_H
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+namespace face_seg
+{
+	/**	Convert an 8-bit image to mean subtracted planar float channels in a
+		single pass. Color conversion, conversion to float, mean subtraction and
+		channel splitting are all done while reading each source pixel once.
+		@param src 8-bit BGR, BGRA or grayscale image.
+		@param dst Output planes, stored consecutively, each of
+		dst_size.height x dst_size.width floats.
+		@param dst_channels Number of output channels, 3 for BGR or 1 for grayscale.
+		@param mean Mean BGR color to subtract. For grayscale output the mean is
+		converted to gray as well.
+		@param dst_size The size of the output planes, must not be smaller than
+		the source image. The image is written to the top left corner of each
+		plane and the rest is set to zero. If empty, the source image size is used.
+		@param subtract_mean If false the mean is not subtracted from the pixels,
+		and the rest of the planes is set to the mean color instead of zero, for
+		networks that subtract the mean themselves.
+	*/
+	void toPlanarFloat(const cv::Mat& src, float* dst, int dst_channels,
+		const cv::Scalar& mean, const cv::Size& dst_size = cv::Size(),
+		bool subtract_mean = true);
+
+	/**	Compute the segmentation mask from the network's scores (argmax of two classes).
+		@param back Background scores.
+		@param fore Foreground scores.
+		@param dst 8-bit output mask, 255 where the foreground score is larger
+		than the background score and 0 otherwise.
+		@param count The number of pixels.
+	*/
+	void scoresToMask(const float* back, const float* fore, uchar* dst, size_t count);
+
+	/**	Blend BGR pixels with a color, using a soft mask as per pixel opacity.
+		Computed in fixed point, each pixel is set to
+		(color * a + pixel * (255 - a)) / 255 where a = mask * alpha / 255.
+		@param img 8-bit BGR pixels, modified in place.
+		@param mask 8-bit mask, one value per pixel.
+		@param count The number of pixels.
+		@param color BGR color to blend with.
+		@param alpha Opacity of the color where the mask is 255 [0, 255].
+	*/
+	void blendMask(uchar* img, const uchar* mask, size_t count, const uchar* color, int alpha);
+
+	/**	Pack a binary mask to 1 bit per pixel.
+		Each row is padded to whole bytes, pixel x of a row is stored in bit
+		(x % 8) of byte (x / 8), the least significant bit first.
+		@param mask 8-bit mask, non-zero pixels are set.
+		@param packed Output packed mask of mask.rows x ((mask.cols + 7) / 8) bytes.
+	*/
+	void packMask(const cv::Mat& mask, cv::Mat& packed);
+
+	/**	Unpack a mask packed by packMask.
+		@param packed Packed mask.
+		@param mask Output 8-bit mask, 255 for set pixels and 0 otherwise.
+		@param cols The number of columns of the original mask.
+	*/
+	void unpackMask(const cv::Mat& packed, cv::Mat& mask, int cols);
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_KERNELS_H
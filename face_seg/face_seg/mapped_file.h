@@ -0,0 +1,57 @@
+/** @file
+@brief Memory mapped file.
+*/
+
+#ifndef FACE_SEG_MAPPED_FILE_H
+#define FACE_SEG_MAPPED_FILE_H
+
+// std
+#include <string>
+#include <cstddef>
+
+namespace face_seg
+{
+	/**	Read only memory mapping of a whole file.
+	*/
+	class MappedFile
+	{
+	public:
+		MappedFile() = default;
+
+		/**	Map a file, see open().
+		*/
+		explicit MappedFile(const std::string& file_path, bool copy_on_write = false);
+
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		/**	Map a file.
+			@param file_path Path to the file.
+			@param copy_on_write Map the pages as private and writable, writes are
+			never visible to the file or to other processes. Required when the
+			mapped memory is handed to code that takes non-const pointers.
+			The pages are still shared until they are written to.
+			@throw std::runtime_error if the file can't be mapped.
+		*/
+		void open(const std::string& file_path, bool copy_on_write = false);
+
+		/**	Unmap the file.
+		*/
+		void close();
+
+		const char* data() const { return m_data; }
+		size_t size() const { return m_size; }
+		bool isOpen() const { return m_data != nullptr; }
+
+	private:
+		const char* m_data = nullptr;
+		size_t m_size = 0;
+		void* m_file_handle = nullptr;
+		void* m_map_handle = nullptr;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_MAPPED_FILE_H
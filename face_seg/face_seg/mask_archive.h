@@ -0,0 +1,173 @@
+/** @file
+@brief Append-only archive of run-length encoded segmentation masks.
+*/
+
+#ifndef FACE_SEG_MASK_ARCHIVE_H
+#define FACE_SEG_MASK_ARCHIVE_H
+
+// std
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <fstream>
+#include <mutex>
+#include <cstdint>
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+// face_seg
+#include "face_seg/mapped_file.h"
+
+namespace face_seg
+{
+	/**	Encodings of the masks in an archive.
+	*/
+	enum MaskEncoding
+	{
+		MASK_RLE_BINARY = 0,	///< Alternating runs of 0 and 255, starting with 0
+		MASK_RLE_VALUES = 1		///< Runs of any value, such as face labels
+	};
+
+	/**	Run-length encode an 8-bit mask.
+		Binary masks (only 0 and 255) are encoded as the lengths of alternating
+		runs, other masks as pairs of value and run length. The lengths are
+		variable length integers and the runs continue across rows.
+		@param mask 8-bit mask.
+		@param data Output encoded mask.
+		@return The encoding, a MaskEncoding.
+	*/
+	int encodeMask(const cv::Mat& mask, std::vector<uchar>& data);
+
+	/**	Decode a run-length encoded mask.
+		@param data Encoded mask.
+		@param size Size of the encoded mask in bytes.
+		@param encoding The encoding, a MaskEncoding.
+		@param mask Output 8-bit mask, it must already have the mask's size.
+		@return false if the data is corrupted.
+	*/
+	bool decodeMask(const uchar* data, size_t size, int encoding, cv::Mat& mask);
+
+	/**	Writer of mask archives.
+		An archive is a data file of records, each holding a key (such as the
+		image path) and a run-length encoded mask (see encodeMask), and an index
+		file (the archive path with ".idx" appended) of the records sorted by
+		the hash of their key. Records are only appended: opening an existing
+		archive continues it, and the index is rewritten when the writer is closed.
+		append() is thread safe.
+	*/
+	class MaskArchiveWriter
+	{
+	public:
+		/**	Open an archive for appending, creating it if it doesn't exist.
+			A partially written last record, left by a writer that didn't
+			close, is discarded.
+			@param archive_path Path to the archive's data file.
+			@throw std::runtime_error if the archive can't be opened.
+		*/
+		explicit MaskArchiveWriter(const std::string& archive_path);
+
+		/**	Close the archive.
+		*/
+		~MaskArchiveWriter();
+
+		MaskArchiveWriter(const MaskArchiveWriter&) = delete;
+		MaskArchiveWriter& operator=(const MaskArchiveWriter&) = delete;
+
+		/**	Append a mask. A key that was already appended is replaced for
+			readers, but the previous record is kept in the data file.
+			@param key Key of the mask.
+			@param mask 8-bit mask.
+		*/
+		void append(const std::string& key, const cv::Mat& mask);
+
+		/**	Check whether a key was appended to the archive.
+		*/
+		bool contains(const std::string& key) const;
+
+		/**	Get the number of records.
+		*/
+		size_t size() const;
+
+		/**	Flush the records and write the index.
+		*/
+		void close();
+
+	private:
+		struct IndexEntry
+		{
+			uint64_t hash;
+			uint64_t offset;
+		};
+
+		void scan();
+
+	private:
+		std::string m_path;
+		std::fstream m_file;
+		uint64_t m_data_size = 0;
+		std::vector<IndexEntry> m_entries;
+		std::unordered_set<std::string> m_keys;
+		mutable std::mutex m_mutex;
+	};
+
+	/**	Reader of mask archives, see MaskArchiveWriter.
+		The data and index files are memory mapped, so opening an archive
+		doesn't read it and masks are decoded directly from the mapping.
+		If the index is missing or stale, it is rebuilt in memory by scanning
+		the data file. The reader is thread safe.
+	*/
+	class MaskArchiveReader
+	{
+	public:
+		/**	Open an archive.
+			@param archive_path Path to the archive's data file.
+			@throw std::runtime_error if the archive can't be opened.
+		*/
+		explicit MaskArchiveReader(const std::string& archive_path);
+
+		/**	Get the number of records, including replaced ones.
+		*/
+		size_t size() const { return m_count; }
+
+		/**	Get the key of a record, records are ordered by the hash of their key.
+		*/
+		std::string key(size_t i) const;
+
+		/**	Decode a record's mask.
+			@param i Record index, in the order of key().
+			@param mask Output 8-bit mask.
+			@throw std::runtime_error if the record is corrupted.
+		*/
+		void read(size_t i, cv::Mat& mask) const;
+
+		/**	Decode the mask of a key, the last appended if there are several.
+			@param key Key of the mask.
+			@param mask Output 8-bit mask.
+			@return false if the key is not in the archive.
+			@throw std::runtime_error if the record is corrupted.
+		*/
+		bool read(const std::string& key, cv::Mat& mask) const;
+
+	private:
+		struct IndexEntry
+		{
+			uint64_t hash;
+			uint64_t offset;
+		};
+
+		void scan();
+		const char* record(size_t i, std::string* key) const;
+
+	private:
+		MappedFile m_data;
+		MappedFile m_index;
+		uint64_t m_data_size = 0;
+		const IndexEntry* m_entries = nullptr;
+		size_t m_count = 0;
+		std::vector<IndexEntry> m_scanned_entries;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_MASK_ARCHIVE_H
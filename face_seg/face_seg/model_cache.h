@@ -0,0 +1,89 @@
+/** @file
+@brief Compiled model cache: network definition and memory mappable weights in a single file.
+*/
+
+#ifndef FACE_SEG_MODEL_CACHE_H
+#define FACE_SEG_MODEL_CACHE_H
+
+// std
+#include <string>
+#include <vector>
+#include <map>
+
+// Caffe
+#include <caffe/caffe.hpp>
+
+// face_seg
+#include "face_seg/mapped_file.h"
+
+namespace face_seg
+{
+	/**	Compiled model cache.
+		A single file that contains the deploy network definition and the trained
+		weights as raw, 64 byte aligned floats. The file is memory mapped and the
+		network's weight blobs point directly into the mapping, so loading doesn't
+		parse or copy the weights. The mapping is private but never written to,
+		so processes that load the same cache share its pages in the page cache.
+
+		File layout (little endian):
+		- Header: magic "FSEGNET1", byte order mark, offsets and sizes of the definition and the table.
+		- Deploy network definition (prototxt text).
+		- Table: for each layer with weights, its name and the shape and data
+		offset of each of its blobs.
+		- Weights.
+	*/
+	class ModelCache
+	{
+	public:
+		/**	Map a compiled model cache.
+			@param cache_file Path to the compiled model cache.
+		*/
+		explicit ModelCache(const std::string& cache_file);
+
+		ModelCache(const ModelCache&) = delete;
+		ModelCache& operator=(const ModelCache&) = delete;
+
+		/**	Check whether a file is a compiled model cache.
+		*/
+		static bool isModelCache(const std::string& file_path);
+
+		/**	Write a compiled model cache.
+			@param deploy_file Network definition file for deployment (.prototxt).
+			@param model_file Network weights model file (.caffemodel).
+			@param cache_file Output compiled model cache.
+		*/
+		static void compile(const std::string& deploy_file, const std::string& model_file,
+			const std::string& cache_file);
+
+		/**	Get the network definition, in TEST phase.
+			The layers with weights are replaced by mapped layers, which create
+			their weight blobs without allocating or filling them.
+		*/
+		const caffe::NetParameter& netParameter() const { return m_net_param; }
+
+		/**	Point the weight blobs of a network, created from netParameter(),
+			to the mapped weights. Must be called before the network is used,
+			otherwise its blobs allocate zero weights on first access.
+		*/
+		void apply(caffe::Net<float>& net) const;
+
+	private:
+		/**	Blob in the mapped weights.
+		*/
+		struct BlobEntry
+		{
+			std::vector<int> shape;
+			const float* data;
+		};
+
+		void parse();
+
+	private:
+		MappedFile m_file;
+		std::map<std::string, std::vector<BlobEntry>> m_layers;
+		caffe::NetParameter m_net_param;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_MODEL_CACHE_H
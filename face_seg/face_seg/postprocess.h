@@ -0,0 +1,103 @@
+/** @file
+@brief Segmentation postprocessing restricted to the foreground region.
+*/
+
+#ifndef FACE_SEG_POSTPROCESS_H
+#define FACE_SEG_POSTPROCESS_H
+
+// std
+#include <vector>
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+namespace face_seg
+{
+	/**	Segmentation postprocessing engine.
+		Produces the same masks as removeSmallerComponents, fillHoles and
+		smoothFlaws, but only processes the bounding box of the foreground.
+		The mask is converted to horizontal runs in a single pass, the largest
+		component selection and the hole filling are then both resolved on the
+		runs using union-find. The scratch buffers are kept between calls, so an
+		instance should be reused, but it must not be shared between threads.
+	*/
+	class PostProcessor
+	{
+	public:
+		/**	Run the full postprocessing pipeline, same as postprocessSegmentation.
+			@param seg 8-bit segmentation mask, modified in place.
+			@param disconnected Toggle removal of all but the largest connected component.
+			@param holes Toggle filling of the holes in the segmentation.
+			@param smooth Toggle smoothing of the segmentation.
+			@param smooth_iterations Number of the morphological open and close iterations.
+			@param smooth_kernel_radius The radius of the elliptic smoothing kernel.
+		*/
+		void process(cv::Mat& seg, bool disconnected = true, bool holes = true,
+			bool smooth = true, int smooth_iterations = 1, int smooth_kernel_radius = 2);
+
+		/**	Remove all but the largest connected component and then fill holes,
+			in a single labeling pass. The result is identical to calling
+			removeSmallerComponents followed by fillHoles.
+			@param seg 8-bit segmentation mask, modified in place.
+			@param disconnected Toggle removal of all but the largest (8-connected) component.
+			@param holes Toggle filling of the regions that are not 4-connected
+			to the top left pixel.
+		*/
+		void filterComponents(cv::Mat& seg, bool disconnected = true, bool holes = true);
+
+		/**	Smooth the segmentation using morphological open and close,
+			identical to smoothFlaws.
+			@param seg 8-bit segmentation mask, modified in place.
+			@param smooth_iterations Number of the morphological open and close iterations.
+			@param smooth_kernel_radius The radius of the elliptic smoothing kernel.
+		*/
+		void smooth(cv::Mat& seg, int smooth_iterations = 1, int smooth_kernel_radius = 2);
+
+	private:
+		/**	Horizontal run of pixels in a row.
+		*/
+		struct Run
+		{
+			int y, x0, x1;	// Row and column range [x0, x1)
+			uchar max_val;	// Maximum pixel value in the run
+		};
+
+		/**	Extract the foreground runs of a region in the mask.
+		*/
+		void extractRuns(const cv::Mat& seg, const cv::Rect& roi);
+
+		/**	Label the foreground runs (8-connected) and find the largest component.
+			@return The root of the largest component.
+		*/
+		int findLargestComponent();
+
+		/**	Find the parent's root of a node, compressing the path.
+		*/
+		static int findRoot(std::vector<int>& parent, int i);
+
+		/**	Merge the sets of two nodes, the smaller root becomes the root.
+		*/
+		static void unite(std::vector<int>& parent, int i, int j);
+
+	private:
+		// Foreground runs
+		std::vector<Run> m_runs;
+		std::vector<int> m_row_start;
+		std::vector<int> m_parent;
+		std::vector<int64> m_area;
+		std::vector<int64> m_first_block;
+
+		// Background runs
+		std::vector<Run> m_gaps;
+		std::vector<int> m_gap_row_start;
+		std::vector<int> m_gap_parent;
+
+		// Smoothing
+		cv::Mat m_kernel;
+		int m_kernel_radius = -1;
+		cv::Mat m_smooth_buf;
+	};
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_POSTPROCESS_H
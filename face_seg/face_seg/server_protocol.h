@@ -0,0 +1,111 @@
+/** @file
+@brief Protocol between face_seg_server and its clients.
+*/
+
+#ifndef FACE_SEG_SERVER_PROTOCOL_H
+#define FACE_SEG_SERVER_PROTOCOL_H
+
+// std
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+namespace face_seg
+{
+	/**	Default path of the server's Unix domain socket.
+	*/
+	const char* const DEFAULT_SERVER_SOCKET = "/tmp/face_seg.sock";
+
+	const uint32_t SERVER_PROTOCOL_MAGIC = 0x47455346;	// "FSEG"
+	const uint32_t SERVER_PROTOCOL_VERSION = 1;
+
+	/**	Request flags.
+	*/
+	enum ServerRequestFlags
+	{
+		SERVER_CROP_FACE = 1	///< Crop the image to the face found by the server's landmarks model
+	};
+
+	/**	Request sent by the client over the socket.
+		The image and the mask are not sent, they are passed in a POSIX shared
+		memory object created by the client: the server reads the image from
+		offset 0 and writes the mask at mask_offset, the mask's size is the size
+		of the segmented region in the response.
+	*/
+	struct ServerRequest
+	{
+		uint32_t magic = SERVER_PROTOCOL_MAGIC;
+		uint32_t version = SERVER_PROTOCOL_VERSION;
+		char shm_name[64] = {};	///< Name of the shared memory object
+		uint64_t shm_size = 0;	///< Size of the shared memory object in bytes
+		int32_t rows = 0;		///< Image rows
+		int32_t cols = 0;		///< Image columns
+		int32_t type = 0;		///< Image type: CV_8UC1, CV_8UC3 or CV_8UC4
+		uint32_t flags = 0;		///< Combination of ServerRequestFlags
+		uint64_t img_step = 0;	///< Bytes per image row
+		uint64_t mask_offset = 0;	///< Offset of the mask, continuous with cols bytes per row
+	};
+
+	/**	Response sent by the server over the socket, after the mask was written.
+	*/
+	struct ServerResponse
+	{
+		int32_t status = 0;		///< 0 on success
+		int32_t x = 0, y = 0;	///< Top left corner of the segmented region in the image
+		int32_t width = 0;		///< Width of the segmented region and the mask
+		int32_t height = 0;		///< Height of the segmented region and the mask
+		char message[256] = {};	///< Error message
+	};
+
+	/**	POSIX shared memory object mapped into the process.
+	*/
+	class SharedMemory
+	{
+	public:
+		SharedMemory() = default;
+		~SharedMemory();
+
+		SharedMemory(const SharedMemory&) = delete;
+		SharedMemory& operator=(const SharedMemory&) = delete;
+
+		/**	Create and map a new shared memory object, it is removed when
+			this instance is closed.
+		*/
+		void create(const std::string& name, size_t size);
+
+		/**	Map an existing shared memory object.
+		*/
+		void open(const std::string& name, size_t size);
+
+		/**	Unmap the shared memory object, and remove it if it was created by
+			this instance.
+		*/
+		void close();
+
+		unsigned char* data() const { return m_data; }
+		size_t size() const { return m_size; }
+		const std::string& name() const { return m_name; }
+
+	private:
+		void map(int fd, size_t size);
+
+	private:
+		unsigned char* m_data = nullptr;
+		size_t m_size = 0;
+		std::string m_name;
+		bool m_owner = false;
+	};
+
+	/**	Write all the bytes to a socket.
+		@return false if the connection was closed or failed.
+	*/
+	bool sendAll(int fd, const void* data, size_t size);
+
+	/**	Read exactly size bytes from a socket.
+		@return false if the connection was closed or failed.
+	*/
+	bool recvAll(int fd, void* data, size_t size);
+
+}   // namespace face_seg
+
+#endif // FACE_SEG_SERVER_PROTOCOL_H
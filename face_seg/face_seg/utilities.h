@@ -11,8 +11,9 @@
 namespace face_seg
 {
 	/** Render segmentation blended with image
-	@param img The image that the segmentation will be blended with.
-	@param seg The segmentation as an 8-bit image.
+	@param img The image that the segmentation will be blended with (8-bit BGR).
+	@param seg The segmentation as an 8-bit image of the same size. Used as a
+	soft mask: each pixel's value (0 - 255) scales the blending weight.
 	@param alpha Blending weight [0, 1].
 	0 means completely transparent and 1 means completely opaque.
 	@param color The color to blend with.
@@ -20,12 +21,21 @@ namespace face_seg
 	void renderSegmentationBlend(cv::Mat& img, const cv::Mat& seg, float alpha = 0.5f,
 		const cv::Scalar& color = cv::Scalar(0, 0, 255));
 
+	/** Remove all but the largest connected component of the segmentation.
+	Uses PostProcessor, reuse an instance of it when processing many masks.
+	*/
 	void removeSmallerComponents(cv::Mat& seg);
 
+	/** Smooth the segmentation using morphological open and close.
+	*/
 	void smoothFlaws(cv::Mat& seg, int smooth_iterations = 1, int smooth_kernel_radius = 2);
 
+	/** Fill the regions of the segmentation that are not connected to the top left pixel.
+	*/
 	void fillHoles(cv::Mat& seg);
 
+	/** Remove smaller components, fill holes and smooth the segmentation.
+	*/
 	void postprocessSegmentation(cv::Mat& seg, bool disconnected = true,
 		bool holes = true, bool smooth = true, int smooth_iterations = 1,
 		int smooth_kernel_radius = 2);
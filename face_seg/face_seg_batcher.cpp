@@ -0,0 +1,155 @@
+#include "face_seg/face_seg_batcher.h"
+#include <stdexcept>
+#include <algorithm>
+
+namespace face_seg
+{
+	FaceSegBatcher::FaceSegBatcher(std::shared_ptr<FaceSeg> fs, int instances,
+		int max_batch_size, double max_wait) :
+		m_max_batch_size((size_t)max_batch_size),
+		m_max_wait(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(max_wait))),
+		m_queue_depths(1.0, 2.0, 16), m_batch_sizes(1.0, 2.0, 10)
+	{
+		if (fs == nullptr) throw std::runtime_error("Batcher requires a face segmentation instance!");
+		if (instances <= 0) throw std::runtime_error("Batcher requires at least one instance!");
+		if (max_batch_size <= 0) throw std::runtime_error("Batch size must be positive!");
+		if (max_wait < 0.0) throw std::runtime_error("Maximum wait must not be negative!");
+
+		// Create the instances, all sharing the trained weights of the first
+		for (int i = 0; i < instances; ++i)
+			m_instances.push_back((i == 0) ? fs : fs->clone());
+
+		// Start the worker threads one at a time, each after the previous
+		// worker's warm up (see startWorkerThread). If a warm up fails, stop
+		// the workers already started.
+		try
+		{
+			for (auto& instance : m_instances)
+			{
+				FaceSeg* worker_fs = instance.get();
+				m_threads.push_back(startWorkerThread(*worker_fs, [this, worker_fs]() { run(*worker_fs); }));
+			}
+		}
+		catch (...)
+		{
+			stop();
+			throw;
+		}
+	}
+
+	FaceSegBatcher::~FaceSegBatcher()
+	{
+		stop();
+	}
+
+	void FaceSegBatcher::stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cond.notify_all();
+		for (auto& thread : m_threads)
+			if (thread.joinable()) thread.join();
+	}
+
+	std::future<cv::Mat> FaceSegBatcher::submit(const cv::Mat& img)
+	{
+		Request request;
+		request.img = img;
+		request.time = Clock::now();
+		std::future<cv::Mat> future = request.promise.get_future();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_requests.push_back(std::move(request));
+			m_queue_depths.add((double)m_requests.size());
+		}
+
+		// Wake all the workers, those waiting to fill a batch check whether it's full
+		m_cond.notify_all();
+		return future;
+	}
+
+	size_t FaceSegBatcher::queueDepth() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_requests.size();
+	}
+
+	Histogram FaceSegBatcher::queueDepths() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_queue_depths;
+	}
+
+	Histogram FaceSegBatcher::batchSizes() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_batch_sizes;
+	}
+
+	Histogram FaceSegBatcher::queueTimes() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_queue_times;
+	}
+
+	bool FaceSegBatcher::takeBatch(std::vector<Request>& batch)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while (true)
+		{
+			if (m_requests.empty())
+			{
+				if (m_stop) return false;
+				m_cond.wait(lock);
+				continue;
+			}
+
+			// Start the batch when it's full or when the oldest request's deadline
+			// has passed, otherwise wait for more requests. Other workers may take
+			// the requests in the meantime.
+			Clock::time_point deadline = m_requests.front().time + m_max_wait;
+			if (m_stop || m_requests.size() >= m_max_batch_size || Clock::now() >= deadline)
+				break;
+			m_cond.wait_until(lock, deadline);
+		}
+
+		// Take the oldest requests
+		Clock::time_point now = Clock::now();
+		size_t batch_size = std::min(m_requests.size(), m_max_batch_size);
+		for (size_t i = 0; i < batch_size; ++i)
+		{
+			m_queue_times.add(std::chrono::duration<double>(now - m_requests.front().time).count());
+			batch.push_back(std::move(m_requests.front()));
+			m_requests.pop_front();
+		}
+		m_batch_sizes.add((double)batch_size);
+		return true;
+	}
+
+	void FaceSegBatcher::run(FaceSeg& fs)
+	{
+		std::vector<Request> batch;
+		std::vector<cv::Mat> imgs;
+		while (takeBatch(batch))
+		{
+			imgs.clear();
+			for (const Request& request : batch)
+				imgs.push_back(request.img);
+			try
+			{
+				std::vector<cv::Mat> segs = fs.processBatch(imgs);
+				for (size_t i = 0; i < batch.size(); ++i)
+					batch[i].promise.set_value(segs[i]);
+			}
+			catch (...)
+			{
+				for (Request& request : batch)
+					request.promise.set_exception(std::current_exception());
+			}
+			batch.clear();
+		}
+	}
+
+}   // namespace face_seg
@@ -0,0 +1,216 @@
+#include "face_seg/face_seg_pool.h"
+#include <stdexcept>
+
+namespace face_seg
+{
+	FaceSegPool::FaceSegPool(std::shared_ptr<FaceSeg> fs, int instances) :
+		m_next_worker(0)
+	{
+		init(fs, instances);
+	}
+
+	FaceSegPool::FaceSegPool(const std::string& deploy_file, const std::string& model_file,
+		int instances, bool with_gpu, int gpu_device_id, bool scale, bool postprocess_seg,
+		const std::string& engine) :
+		m_next_worker(0)
+	{
+		init(std::make_shared<FaceSeg>(deploy_file, model_file, with_gpu,
+			gpu_device_id, scale, postprocess_seg, engine), instances);
+	}
+
+	std::thread startWorkerThread(FaceSeg& fs, std::function<void()> run)
+	{
+		auto ready = std::make_shared<std::promise<void>>();
+		std::future<void> ready_future = ready->get_future();
+		std::thread thread([&fs, ready, run]()
+		{
+			try
+			{
+				fs.initThread();
+				if (fs.withGpu()) fs.process(cv::Mat::zeros(fs.inputSize(), CV_8UC3));
+			}
+			catch (...)
+			{
+				ready->set_exception(std::current_exception());
+				return;
+			}
+			ready->set_value();
+			run();
+		});
+
+		try
+		{
+			ready_future.get();
+		}
+		catch (...)
+		{
+			thread.join();
+			throw;
+		}
+		return thread;
+	}
+
+	FaceSegPool::~FaceSegPool()
+	{
+		stop();
+	}
+
+	void FaceSegPool::init(std::shared_ptr<FaceSeg> fs, int instances)
+	{
+		if (fs == nullptr) throw std::runtime_error("Pool requires a face segmentation instance!");
+		if (instances <= 0) throw std::runtime_error("Pool requires at least one instance!");
+
+		// Create the instances, all sharing the trained weights of the first
+		for (int i = 0; i < instances; ++i)
+		{
+			m_workers.emplace_back(new Worker);
+			m_workers.back()->fs = (i == 0) ? fs : fs->clone();
+		}
+
+		// Start the worker threads one at a time, each after the previous
+		// worker's warm up. If a warm up fails, stop the workers already started.
+		try
+		{
+			for (size_t i = 0; i < m_workers.size(); ++i)
+				m_workers[i]->thread = startWorkerThread(*m_workers[i]->fs, [this, i]() { run(i); });
+		}
+		catch (...)
+		{
+			stop();
+			throw;
+		}
+	}
+
+	void FaceSegPool::stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cond.notify_all();
+		for (auto& worker : m_workers)
+			if (worker->thread.joinable()) worker->thread.join();
+	}
+
+	std::future<cv::Mat> FaceSegPool::submit(const cv::Mat& img)
+	{
+		auto promise = std::make_shared<std::promise<cv::Mat>>();
+		pushTask([promise, img](FaceSeg& fs)
+		{
+			try { promise->set_value(fs.process(img)); }
+			catch (...) { promise->set_exception(std::current_exception()); }
+		});
+		return promise->get_future();
+	}
+
+	std::future<std::vector<cv::Mat>> FaceSegPool::submitBatch(const std::vector<cv::Mat>& imgs)
+	{
+		auto promise = std::make_shared<std::promise<std::vector<cv::Mat>>>();
+		pushTask([promise, imgs](FaceSeg& fs)
+		{
+			try { promise->set_value(fs.processBatch(imgs)); }
+			catch (...) { promise->set_exception(std::current_exception()); }
+		});
+		return promise->get_future();
+	}
+
+	std::future<cv::Mat> FaceSegPool::submitRegions(const cv::Mat& frame,
+		const std::vector<cv::Rect>& rois, bool labeled)
+	{
+		auto promise = std::make_shared<std::promise<cv::Mat>>();
+		pushTask([promise, frame, rois, labeled](FaceSeg& fs)
+		{
+			try
+			{
+				cv::Mat seg;
+				fs.processRegions(frame, rois, seg, labeled);
+				promise->set_value(seg);
+			}
+			catch (...) { promise->set_exception(std::current_exception()); }
+		});
+		return promise->get_future();
+	}
+
+	std::vector<cv::Mat> FaceSegPool::process(const std::vector<cv::Mat>& imgs)
+	{
+		std::vector<std::future<cv::Mat>> futures;
+		futures.reserve(imgs.size());
+		for (const cv::Mat& img : imgs)
+			futures.push_back(submit(img));
+
+		std::vector<cv::Mat> segs;
+		segs.reserve(imgs.size());
+		for (auto& f : futures)
+			segs.push_back(f.get());
+
+		return segs;
+	}
+
+	void FaceSegPool::pushTask(Task task)
+	{
+		// Count the task before it's visible in a queue, so a worker that pops
+		// it never decrements the count below zero
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++m_pending;
+		}
+
+		// Distribute the tasks between the workers in round robin order
+		Worker& worker = *m_workers[m_next_worker++ % m_workers.size()];
+		{
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			worker.tasks.push_back(std::move(task));
+		}
+		m_cond.notify_one();
+	}
+
+	bool FaceSegPool::popTask(size_t worker_index, Task& task)
+	{
+		// Take the oldest task from our own queue, otherwise steal the newest
+		// task from the other workers' queues
+		for (size_t i = 0; i < m_workers.size(); ++i)
+		{
+			Worker& worker = *m_workers[(worker_index + i) % m_workers.size()];
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			if (worker.tasks.empty()) continue;
+			if (i == 0)
+			{
+				task = std::move(worker.tasks.front());
+				worker.tasks.pop_front();
+			}
+			else
+			{
+				task = std::move(worker.tasks.back());
+				worker.tasks.pop_back();
+			}
+			return true;
+		}
+
+		return false;
+	}
+
+	void FaceSegPool::run(size_t worker_index)
+	{
+		FaceSeg& fs = *m_workers[worker_index]->fs;
+		Task task;
+		while (true)
+		{
+			if (popTask(worker_index, task))
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					--m_pending;
+				}
+				task(fs);
+				task = nullptr;
+				continue;
+			}
+
+			// Wait for new tasks
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this] { return m_stop || m_pending > 0; });
+			if (m_stop && m_pending == 0) return;
+		}
+	}
+
+}   // namespace face_seg
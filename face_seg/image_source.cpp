@@ -0,0 +1,323 @@
+#include "face_seg/image_source.h"
+#include <stdexcept>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cctype>
+#include <cstdint>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
+
+namespace face_seg
+{
+	static const char* IMAGE_EXTENSIONS[] = { "bmp", "dib", "jpeg", "jpg", "jpe", "jp2", "png",
+		"pbm", "pgm", "ppm", "sr", "ras" };
+	static const size_t TAR_BLOCK_SIZE = 512;
+
+	bool hasImageExtension(const std::string& file_name)
+	{
+		size_t dot = file_name.find_last_of('.');
+		if (dot == std::string::npos || file_name.size() - dot > 5) return false;
+		std::string ext = file_name.substr(dot + 1);
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+		for (const char* image_ext : IMAGE_EXTENSIONS)
+			if (ext == image_ext) return true;
+		return false;
+	}
+
+#ifdef _WIN32
+	void listImageFiles(const std::string& dir_path, std::vector<std::string>& img_paths)
+	{
+		WIN32_FIND_DATAA entry;
+		HANDLE find = FindFirstFileA((dir_path + "\\*").c_str(), &entry);
+		if (find == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("Failed to read \"" + dir_path + "\"!");
+		std::string prefix = dir_path;
+		if (prefix.back() != '\\' && prefix.back() != '/') prefix += '\\';
+		do
+		{
+			if (entry.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+			if (hasImageExtension(entry.cFileName)) img_paths.push_back(prefix + entry.cFileName);
+		} while (FindNextFileA(find, &entry));
+		FindClose(find);
+	}
+#else
+	void listImageFiles(const std::string& dir_path, std::vector<std::string>& img_paths)
+	{
+		DIR* dir = opendir(dir_path.c_str());
+		if (dir == nullptr) throw std::runtime_error("Failed to read \"" + dir_path + "\"!");
+		std::string prefix = dir_path;
+		if (prefix.back() != '/') prefix += '/';
+		while (const dirent* entry = readdir(dir))
+		{
+			// The extension is checked first, so other files are never stat'ed
+			if (!hasImageExtension(entry->d_name)) continue;
+			std::string img_path = prefix + entry->d_name;
+#ifdef DT_REG
+			// Only links and file systems that don't report types need a stat
+			if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_LNK)
+			{
+				if (entry->d_type == DT_REG) img_paths.push_back(img_path);
+				continue;
+			}
+#endif
+			struct stat st;
+			if (stat(img_path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) img_paths.push_back(img_path);
+		}
+		closedir(dir);
+	}
+#endif
+
+	void readImageList(const std::string& list_path, std::vector<std::string>& img_paths)
+	{
+		std::ifstream file(list_path);
+		std::string img_path;
+		while (file.good())
+		{
+			std::getline(file, img_path, '\n');
+			if (img_path.empty()) return;
+			img_paths.push_back(img_path);
+		}
+	}
+
+	bool readJpegSize(const uchar* data, size_t size, cv::Size& img_size)
+	{
+		if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+		size_t pos = 2;
+		while (pos < size)
+		{
+			// Markers may be preceded by any number of fill bytes
+			if (data[pos] != 0xFF) return false;
+			while (pos < size && data[pos] == 0xFF) ++pos;
+			if (pos >= size) return false;
+			uchar marker = data[pos++];
+
+			// Standalone markers have no segment
+			if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) continue;
+			if (marker == 0xD9 || marker == 0xDA || size - pos < 2) return false;
+			size_t length = ((size_t)data[pos] << 8) | data[pos + 1];
+			if (length < 2 || length > size - pos) return false;
+
+			// Start of frame, except DHT, JPG and DAC that share the range
+			if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+			{
+				if (length < 7) return false;
+				img_size.height = (data[pos + 3] << 8) | data[pos + 4];
+				img_size.width = (data[pos + 5] << 8) | data[pos + 6];
+				return img_size.width > 0 && img_size.height > 0;
+			}
+			pos += length;
+		}
+		return false;
+	}
+
+	int reducedDecodeScale(const cv::Size& img_size, const cv::Size& min_size)
+	{
+		int scale = 8;
+		while (scale > 1 && ((img_size.width + scale - 1) / scale < min_size.width ||
+			(img_size.height + scale - 1) / scale < min_size.height))
+			scale /= 2;
+		return scale;
+	}
+
+	cv::Mat decodeImageReduced(const uchar* data, size_t size, const cv::Size& min_size,
+		cv::Size* original_size)
+	{
+		cv::Mat buf(1, (int)size, CV_8U, (void*)data);
+		cv::Size jpeg_size;
+		int scale = 1;
+		if (min_size.area() > 0 && readJpegSize(data, size, jpeg_size))
+			scale = reducedDecodeScale(jpeg_size, min_size);
+		const int flags[] = { cv::IMREAD_COLOR, cv::IMREAD_REDUCED_COLOR_2, 0,
+			cv::IMREAD_REDUCED_COLOR_4, 0, 0, 0, cv::IMREAD_REDUCED_COLOR_8 };
+		cv::Mat img = cv::imdecode(buf, flags[scale - 1]);
+
+		if (original_size != nullptr)
+		{
+			// The decoded image is transposed from the frame if it was rotated
+			// by its EXIF orientation
+			*original_size = img.size();
+			if (scale > 1)
+			{
+				cv::Size expected((jpeg_size.width + scale - 1) / scale, (jpeg_size.height + scale - 1) / scale);
+				*original_size = img.size() == expected ? jpeg_size : cv::Size(jpeg_size.height, jpeg_size.width);
+			}
+		}
+		return img;
+	}
+
+	cv::Mat readImageReduced(const std::string& img_path, const cv::Size& min_size,
+		cv::Size* original_size, std::vector<uchar>* data)
+	{
+		std::vector<uchar> buf;
+		std::vector<uchar>& file_data = data != nullptr ? *data : buf;
+		std::ifstream file(img_path, std::ios::binary | std::ios::ate);
+		if (!file.is_open()) return cv::Mat();
+		file_data.resize((size_t)file.tellg());
+		file.seekg(0);
+		if (file_data.empty() || !file.read((char*)file_data.data(), file_data.size())) return cv::Mat();
+		return decodeImageReduced(file_data.data(), file_data.size(), min_size, original_size);
+	}
+
+	bool decodeImageForRegions(const uchar* data, size_t size, const cv::Size& min_region_size,
+		cv::Mat& img, std::vector<cv::Rect>& regions)
+	{
+		if (regions.empty() || img.empty()) return false;
+		const cv::Rect& largest = *std::max_element(regions.begin(), regions.end(),
+			[](const cv::Rect& a, const cv::Rect& b) { return a.area() < b.area(); });
+		if (largest.area() == 0 ||
+			(largest.width >= min_region_size.width && largest.height >= min_region_size.height))
+			return false;
+
+		// Size of the whole image for the largest region to reach the minimum size
+		cv::Size min_size(
+			(int)std::ceil((double)img.cols * min_region_size.width / largest.width),
+			(int)std::ceil((double)img.rows * min_region_size.height / largest.height));
+		cv::Mat larger = decodeImageReduced(data, size, min_size);
+		if (larger.empty() || larger.cols <= img.cols) return false;
+
+		double sx = (double)larger.cols / img.cols, sy = (double)larger.rows / img.rows;
+		cv::Rect bounds(0, 0, larger.cols, larger.rows);
+		for (cv::Rect& r : regions)
+		{
+			r = cv::Rect(cvRound(r.x * sx), cvRound(r.y * sy), cvRound(r.width * sx),
+				cvRound(r.height * sy)) & bounds;
+		}
+		img = larger;
+		return true;
+	}
+
+	/**	Parse a numeric field of a tar header: octal, or GNU base-256 for large values.
+	*/
+	static bool parseTarNumber(const char* field, size_t length, uint64_t& value)
+	{
+		value = 0;
+		if ((unsigned char)field[0] & 0x80)
+		{
+			value = field[0] & 0x7F;
+			for (size_t i = 1; i < length; ++i) value = (value << 8) | (unsigned char)field[i];
+			return true;
+		}
+		size_t i = 0;
+		while (i < length && field[i] == ' ') ++i;
+		for (; i < length && field[i] >= '0' && field[i] <= '7'; ++i) value = value * 8 + (field[i] - '0');
+		return i == length || field[i] == ' ' || field[i] == '\0';
+	}
+
+	/**	Verify the checksum of a tar header, the sum of its bytes with the
+		checksum field taken as spaces.
+	*/
+	static bool checkTarHeader(const char* header)
+	{
+		uint64_t checksum;
+		if (!parseTarNumber(header + 148, 8, checksum)) return false;
+		uint64_t sum = 0;
+		for (size_t i = 0; i < TAR_BLOCK_SIZE; ++i)
+			sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)header[i];
+		return sum == checksum;
+	}
+
+	static std::string tarString(const char* field, size_t length)
+	{
+		return std::string(field, std::find(field, field + length, '\0'));
+	}
+
+	/**	Get the path from the records of a pax extended header, empty if it has none.
+		Each record is "<length> <key>=<value>\n", the length includes the whole record.
+	*/
+	static std::string paxPath(const char* data, size_t size)
+	{
+		std::string path;
+		size_t pos = 0;
+		while (pos < size)
+		{
+			size_t length = 0, i = pos;
+			for (; i < size && data[i] >= '0' && data[i] <= '9'; ++i) length = length * 10 + (data[i] - '0');
+			if (i >= size || data[i] != ' ' || length <= i - pos + 1 || length > size - pos) break;
+			std::string record(data + i + 1, data + pos + length - 1);
+			if (record.compare(0, 5, "path=") == 0) path = record.substr(5);
+			pos += length;
+		}
+		return path;
+	}
+
+	ImageShard::ImageShard(const std::string& shard_path) : m_file(shard_path)
+	{
+		parse(shard_path);
+	}
+
+	bool ImageShard::isImageShard(const std::string& file_path)
+	{
+		if (file_path.size() < 4) return false;
+		std::string ext = file_path.substr(file_path.size() - 4);
+		std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+		return ext == ".tar";
+	}
+
+	cv::Mat ImageShard::decode(size_t i, int flags) const
+	{
+		const Entry& entry = m_entries[i];
+		if (entry.size == 0) return cv::Mat();
+		cv::Mat buf(1, (int)entry.size, CV_8U, (void*)data(i));
+		return cv::imdecode(buf, flags);
+	}
+
+	void ImageShard::parse(const std::string& shard_path)
+	{
+		const char* data = m_file.data();
+		size_t size = m_file.size();
+		std::string long_name;
+		size_t offset = 0;
+		while (size - offset >= TAR_BLOCK_SIZE)
+		{
+			// The archive ends with zero blocks
+			const char* header = data + offset;
+			if (header[0] == '\0' && std::all_of(header, header + TAR_BLOCK_SIZE,
+				[](char c) { return c == '\0'; }))
+				break;
+
+			uint64_t member_size;
+			if (!checkTarHeader(header) || !parseTarNumber(header + 124, 12, member_size))
+				throw std::runtime_error("Corrupted image shard \"" + shard_path + "\"!");
+			size_t member_offset = offset + TAR_BLOCK_SIZE;
+			if (member_size > size - member_offset)
+				throw std::runtime_error("Truncated image shard \"" + shard_path + "\"!");
+
+			char type = header[156];
+			if (type == 'L') long_name = tarString(data + member_offset, (size_t)member_size);
+			else if (type == 'x') long_name = paxPath(data + member_offset, (size_t)member_size);
+			else if (type == '0' || type == '\0' || type == '7')
+			{
+				// Regular file, the POSIX ustar prefix holds the leading directories
+				// of long paths. The old GNU format uses the same bytes for times
+				std::string name = long_name;
+				if (name.empty())
+				{
+					name = tarString(header, 100);
+					std::string prefix = tarString(header + 345, 155);
+					if (std::memcmp(header + 257, "ustar", 6) == 0 && !prefix.empty())
+						name = prefix + "/" + name;
+				}
+				if (name.compare(0, 2, "./") == 0) name.erase(0, 2);
+				if (hasImageExtension(name))
+					m_entries.push_back({ name, member_offset, (size_t)member_size });
+				long_name.clear();
+			}
+			else long_name.clear();
+
+			offset = member_offset + (size_t)(member_size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+			offset = std::min(offset, size);
+		}
+
+		// Tar archives are padded to whole blocks
+		if (size - offset > 0 && size - offset < TAR_BLOCK_SIZE)
+			throw std::runtime_error("Truncated image shard \"" + shard_path + "\"!");
+	}
+
+}   // namespace face_seg
@@ -0,0 +1,41 @@
+#include "face_seg/inference_engine.h"
+#include <stdexcept>
+#if WITH_CAFFE
+#include "face_seg/caffe_engine.h"
+#endif
+#if WITH_OPENCV_DNN
+#include "face_seg/dnn_engine.h"
+#endif
+
+namespace face_seg
+{
+	std::shared_ptr<InferenceEngine> createInferenceEngine(const std::string& engine,
+		const std::string& deploy_file, const std::string& model_file,
+		bool with_gpu, int gpu_device_id)
+	{
+		std::vector<std::string> engines = inferenceEngines();
+		const std::string& name = engine.empty() ? engines.front() : engine;
+#if WITH_CAFFE
+		if (name == "caffe")
+			return std::make_shared<CaffeEngine>(deploy_file, model_file, with_gpu, gpu_device_id);
+#endif
+#if WITH_OPENCV_DNN
+		if (name == "opencv")
+			return std::make_shared<DnnEngine>(deploy_file, model_file, with_gpu, gpu_device_id);
+#endif
+		throw std::runtime_error("Inference engine \"" + name + "\" is not available!");
+	}
+
+	std::vector<std::string> inferenceEngines()
+	{
+		std::vector<std::string> engines;
+#if WITH_CAFFE
+		engines.push_back("caffe");
+#endif
+#if WITH_OPENCV_DNN
+		engines.push_back("opencv");
+#endif
+		return engines;
+	}
+
+}   // namespace face_seg
@@ -0,0 +1,289 @@
+#include "face_seg/instrumentation.h"
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <opencv2/core.hpp>
+
+namespace face_seg
+{
+	// Histogram buckets: seconds from 1us to ~2 minutes, bytes from 1KB to ~1TB
+	static const Histogram TIME_HISTOGRAM(1.0e-6, 2.0, 28);
+	static const Histogram BYTES_HISTOGRAM(1024.0, 4.0, 16);
+
+	Histogram::Histogram(double first_bound, double factor, int bucket_count) :
+		m_counts(bucket_count + 1, 0)
+	{
+		m_bounds.reserve(bucket_count);
+		for (int i = 0; i < bucket_count; ++i)
+			m_bounds.push_back(first_bound * std::pow(factor, i));
+	}
+
+	void Histogram::add(double value)
+	{
+		size_t i = std::lower_bound(m_bounds.begin(), m_bounds.end(), value) - m_bounds.begin();
+		++m_counts[i];
+		m_min = m_count > 0 ? std::min(m_min, value) : value;
+		m_max = m_count > 0 ? std::max(m_max, value) : value;
+		m_sum += value;
+		++m_count;
+	}
+
+	void Histogram::merge(const Histogram& other)
+	{
+		if (other.m_count == 0) return;
+		CV_Assert(other.m_bounds == m_bounds);
+		for (size_t i = 0; i < m_counts.size(); ++i)
+			m_counts[i] += other.m_counts[i];
+		m_min = m_count > 0 ? std::min(m_min, other.m_min) : other.m_min;
+		m_max = m_count > 0 ? std::max(m_max, other.m_max) : other.m_max;
+		m_sum += other.m_sum;
+		m_count += other.m_count;
+	}
+
+	double Histogram::percentile(double p) const
+	{
+		if (m_count == 0) return 0.0;
+		double rank = std::min(std::max(p, 0.0), 100.0) / 100.0 * m_count;
+		size_t cumulative = 0;
+		for (size_t i = 0; i < m_counts.size(); ++i)
+		{
+			if (m_counts[i] == 0 || cumulative + m_counts[i] < rank)
+			{
+				cumulative += m_counts[i];
+				continue;
+			}
+
+			// Interpolate linearly inside the bucket, clamped to the observed range
+			double lower = i > 0 ? m_bounds[i - 1] : 0.0;
+			double upper = i < m_bounds.size() ? m_bounds[i] : m_max;
+			lower = std::max(lower, m_min);
+			upper = std::min(upper, m_max);
+			double t = (rank - cumulative) / m_counts[i];
+			return lower + (upper - lower) * t;
+		}
+
+		return m_max;
+	}
+
+	Histogram& Instrumentation::HistogramSet::get(const std::string& name, const Histogram& empty)
+	{
+		auto it = index.find(name);
+		if (it != index.end()) return histograms[it->second].second;
+		index[name] = histograms.size();
+		histograms.emplace_back(name, empty);
+		return histograms.back().second;
+	}
+
+	Instrumentation::Instrumentation() : m_mat_allocations(BYTES_HISTOGRAM)
+	{
+	}
+
+	void Instrumentation::addStage(const std::string& name, double seconds)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stages.get(name, TIME_HISTOGRAM).add(seconds);
+	}
+
+	void Instrumentation::addLayers(const std::vector<std::string>& names,
+		const std::vector<double>& seconds)
+	{
+		CV_Assert(names.size() == seconds.size());
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t i = 0; i < names.size(); ++i)
+			m_layers.get(names[i], TIME_HISTOGRAM).add(seconds[i]);
+	}
+
+	void Instrumentation::addMatAllocation(size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_mat_allocations.add((double)bytes);
+	}
+
+	std::vector<std::string> Instrumentation::stageNames() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::vector<std::string> names;
+		for (auto& h : m_stages.histograms) names.push_back(h.first);
+		return names;
+	}
+
+	std::vector<std::string> Instrumentation::layerNames() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::vector<std::string> names;
+		for (auto& h : m_layers.histograms) names.push_back(h.first);
+		return names;
+	}
+
+	Histogram Instrumentation::stage(const std::string& name) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_stages.index.find(name);
+		return it != m_stages.index.end() ? m_stages.histograms[it->second].second : TIME_HISTOGRAM;
+	}
+
+	Histogram Instrumentation::layer(const std::string& name) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_layers.index.find(name);
+		return it != m_layers.index.end() ? m_layers.histograms[it->second].second : TIME_HISTOGRAM;
+	}
+
+	Histogram Instrumentation::matAllocations() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_mat_allocations;
+	}
+
+	void Instrumentation::reset()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stages = HistogramSet();
+		m_layers = HistogramSet();
+		m_mat_allocations = BYTES_HISTOGRAM;
+	}
+
+	static void writeHistogramJson(std::ostream& out, const Histogram& h)
+	{
+		out << "{\"count\": " << h.count() << ", \"sum\": " << h.sum() <<
+			", \"mean\": " << h.mean() << ", \"min\": " << h.min() << ", \"max\": " << h.max() <<
+			", \"p50\": " << h.percentile(50) << ", \"p95\": " << h.percentile(95) <<
+			", \"p99\": " << h.percentile(99) << ", \"buckets\": [";
+		const std::vector<size_t>& counts = h.bucketCounts();
+		for (size_t i = 0; i < counts.size(); ++i)
+		{
+			out << (i > 0 ? ", " : "") << "{\"le\": ";
+			if (i < h.bounds().size()) out << h.bounds()[i];
+			else out << "\"+Inf\"";
+			out << ", \"count\": " << counts[i] << "}";
+		}
+		out << "]}";
+	}
+
+	void Instrumentation::writeJson(std::ostream& out) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const HistogramSet* sets[2] = { &m_stages, &m_layers };
+		const char* set_names[2] = { "stages", "layers" };
+		out << "{\n";
+		for (int s = 0; s < 2; ++s)
+		{
+			out << "  \"" << set_names[s] << "\": {";
+			for (size_t i = 0; i < sets[s]->histograms.size(); ++i)
+			{
+				out << (i > 0 ? ",\n" : "\n") << "    \"" << sets[s]->histograms[i].first << "\": ";
+				writeHistogramJson(out, sets[s]->histograms[i].second);
+			}
+			out << "\n  },\n";
+		}
+		out << "  \"mat_alloc_bytes\": ";
+		writeHistogramJson(out, m_mat_allocations);
+		out << "\n}\n";
+	}
+
+	void Instrumentation::writeJson(const std::string& file_path) const
+	{
+		std::ofstream out(file_path);
+		if (!out.is_open()) throw std::runtime_error("Failed to write \"" + file_path + "\"!");
+		writeJson(out);
+	}
+
+	static void writeHistogramPrometheus(std::ostream& out, const std::string& metric,
+		const std::string& labels, const Histogram& h)
+	{
+		std::string sep = labels.empty() ? "" : ",";
+		size_t cumulative = 0;
+		const std::vector<size_t>& counts = h.bucketCounts();
+		for (size_t i = 0; i < h.bounds().size(); ++i)
+		{
+			cumulative += counts[i];
+			out << metric << "_bucket{" << labels << sep << "le=\"" << h.bounds()[i] << "\"} " <<
+				cumulative << "\n";
+		}
+		out << metric << "_bucket{" << labels << sep << "le=\"+Inf\"} " << h.count() << "\n";
+		std::string braces = labels.empty() ? "" : "{" + labels + "}";
+		out << metric << "_sum" << braces << " " << h.sum() << "\n";
+		out << metric << "_count" << braces << " " << h.count() << "\n";
+	}
+
+	void Instrumentation::writePrometheus(std::ostream& out) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		out << "# HELP face_seg_stage_seconds Time spent in each face segmentation stage.\n";
+		out << "# TYPE face_seg_stage_seconds histogram\n";
+		for (auto& h : m_stages.histograms)
+			writeHistogramPrometheus(out, "face_seg_stage_seconds", "stage=\"" + h.first + "\"", h.second);
+		out << "# HELP face_seg_layer_seconds Forward time of each network layer.\n";
+		out << "# TYPE face_seg_layer_seconds histogram\n";
+		for (auto& h : m_layers.histograms)
+			writeHistogramPrometheus(out, "face_seg_layer_seconds", "layer=\"" + h.first + "\"", h.second);
+		out << "# HELP face_seg_mat_alloc_bytes Bytes of Mat data allocated per call.\n";
+		out << "# TYPE face_seg_mat_alloc_bytes histogram\n";
+		writeHistogramPrometheus(out, "face_seg_mat_alloc_bytes", "", m_mat_allocations);
+	}
+
+	void Instrumentation::writePrometheus(const std::string& file_path) const
+	{
+		std::ofstream out(file_path);
+		if (!out.is_open()) throw std::runtime_error("Failed to write \"" + file_path + "\"!");
+		writePrometheus(out);
+	}
+
+	// Mat allocation counting
+
+#if CV_VERSION_MAJOR >= 4
+	typedef cv::AccessFlag AccessFlags;
+#else
+	typedef int AccessFlags;
+#endif
+
+	static thread_local size_t t_mat_allocated_bytes = 0;
+
+	/**	Forwards to another allocator and counts the bytes it allocates.
+		The allocated data refers to the wrapped allocator, so only allocation
+		passes through this class.
+	*/
+	class CountingAllocator : public cv::MatAllocator
+	{
+	public:
+		explicit CountingAllocator(cv::MatAllocator* allocator) : m_allocator(allocator) {}
+
+		cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+			AccessFlags flags, cv::UMatUsageFlags usage_flags) const override
+		{
+			cv::UMatData* u = m_allocator->allocate(dims, sizes, type, data, step, flags, usage_flags);
+			if (u != nullptr && data == nullptr) t_mat_allocated_bytes += u->size;
+			return u;
+		}
+
+		bool allocate(cv::UMatData* data, AccessFlags flags, cv::UMatUsageFlags usage_flags) const override
+		{
+			return m_allocator->allocate(data, flags, usage_flags);
+		}
+
+		void deallocate(cv::UMatData* data) const override
+		{
+			m_allocator->deallocate(data);
+		}
+
+	private:
+		cv::MatAllocator* m_allocator;
+	};
+
+	void Instrumentation::installMatAllocationCounter()
+	{
+		static std::once_flag once;
+		std::call_once(once, []()
+		{
+			static CountingAllocator allocator(cv::Mat::getDefaultAllocator());
+			cv::Mat::setDefaultAllocator(&allocator);
+		});
+	}
+
+	size_t Instrumentation::threadMatAllocatedBytes()
+	{
+		return t_mat_allocated_bytes;
+	}
+
+}   // namespace face_seg
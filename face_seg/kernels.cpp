@@ -0,0 +1,348 @@
+#include "face_seg/kernels.h"
+#include <algorithm>
+
+#if WITH_AVX2
+#include <immintrin.h>
+#elif WITH_SSSE3
+#include <tmmintrin.h>
+#endif
+
+namespace face_seg
+{
+	// OpenCV's BGR to gray weights
+	static const float GRAY_B = 0.114f, GRAY_G = 0.587f, GRAY_R = 0.299f;
+
+#if WITH_AVX2 || WITH_SSSE3
+
+#if WITH_AVX2
+	typedef __m256 vfloat;
+	static const int VFLOAT_LANES = 8;
+	static inline vfloat vset1(float a) { return _mm256_set1_ps(a); }
+	static inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+	static inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+	static inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+	static inline void vstore(float* dst, vfloat a) { _mm256_storeu_ps(dst, a); }
+
+	// Convert 16 8-bit values to float
+	static inline void vconvert16(__m128i v, vfloat* f)
+	{
+		f[0] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+		f[1] = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+	}
+#else
+	typedef __m128 vfloat;
+	static const int VFLOAT_LANES = 4;
+	static inline vfloat vset1(float a) { return _mm_set1_ps(a); }
+	static inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+	static inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+	static inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+	static inline void vstore(float* dst, vfloat a) { _mm_storeu_ps(dst, a); }
+
+	// Convert 16 8-bit values to float
+	static inline void vconvert16(__m128i v, vfloat* f)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+		f[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero));
+		f[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero));
+		f[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero));
+		f[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero));
+	}
+#endif
+	static const int VFLOAT_COUNT = 16 / VFLOAT_LANES;
+
+	// Load 16 pixels and deinterleave them into separate B, G and R vectors
+	static inline void vload16(const uchar* src, int cn, __m128i& b, __m128i& g, __m128i& r)
+	{
+		if (cn == 1)
+		{
+			b = g = r = _mm_loadu_si128((const __m128i*)src);
+		}
+		else if (cn == 3)
+		{
+			__m128i v0 = _mm_loadu_si128((const __m128i*)src);
+			__m128i v1 = _mm_loadu_si128((const __m128i*)(src + 16));
+			__m128i v2 = _mm_loadu_si128((const __m128i*)(src + 32));
+			b = _mm_or_si128(_mm_or_si128(
+				_mm_shuffle_epi8(v0, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+				_mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+				_mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+			g = _mm_or_si128(_mm_or_si128(
+				_mm_shuffle_epi8(v0, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+				_mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+				_mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+			r = _mm_or_si128(_mm_or_si128(
+				_mm_shuffle_epi8(v0, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+				_mm_shuffle_epi8(v1, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+				_mm_shuffle_epi8(v2, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+		}
+		else // cn == 4
+		{
+			// Group the channels of each 4 pixels: B0-3 G0-3 R0-3 A0-3
+			const __m128i group = _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+			__m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)src), group);
+			__m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 16)), group);
+			__m128i v2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 32)), group);
+			__m128i v3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + 48)), group);
+
+			// Transpose the 32-bit groups
+			__m128i t0 = _mm_unpacklo_epi32(v0, v1), t1 = _mm_unpacklo_epi32(v2, v3);
+			__m128i t2 = _mm_unpackhi_epi32(v0, v1), t3 = _mm_unpackhi_epi32(v2, v3);
+			b = _mm_unpacklo_epi64(t0, t1);
+			g = _mm_unpackhi_epi64(t0, t1);
+			r = _mm_unpacklo_epi64(t2, t3);
+		}
+	}
+
+	// Convert 16 8-bit values to float, subtract the mean and store
+	static inline void vstore16(__m128i v, float* dst, float mean)
+	{
+		vfloat f[VFLOAT_COUNT];
+		vconvert16(v, f);
+		vfloat m = vset1(mean);
+		for (int i = 0; i < VFLOAT_COUNT; ++i)
+			vstore(dst + i * VFLOAT_LANES, vsub(f[i], m));
+	}
+
+	// Convert 16 BGR pixels to gray float, subtract the mean and store
+	static inline void vstoreGray16(__m128i b, __m128i g, __m128i r, float* dst, float mean)
+	{
+		vfloat fb[VFLOAT_COUNT], fg[VFLOAT_COUNT], fr[VFLOAT_COUNT];
+		vconvert16(b, fb);
+		vconvert16(g, fg);
+		vconvert16(r, fr);
+		vfloat wb = vset1(GRAY_B), wg = vset1(GRAY_G), wr = vset1(GRAY_R), m = vset1(mean);
+		for (int i = 0; i < VFLOAT_COUNT; ++i)
+		{
+			vfloat gray = vadd(vadd(vmul(fb[i], wb), vmul(fg[i], wg)), vmul(fr[i], wr));
+			vstore(dst + i * VFLOAT_LANES, vsub(gray, m));
+		}
+	}
+
+#endif	// WITH_AVX2 || WITH_SSSE3
+
+	/**	Convert a single row, see toPlanarFloat.
+		@param mean Mean per output channel.
+	*/
+	static void toPlanarFloatRow(const uchar* src, int cn, float** dst, int dst_cn,
+		int width, const float* mean)
+	{
+		int x = 0;
+#if WITH_AVX2 || WITH_SSSE3
+		__m128i b, g, r;
+		for (; x <= width - 16; x += 16, src += 16 * cn)
+		{
+			vload16(src, cn, b, g, r);
+			if (dst_cn == 3)
+			{
+				vstore16(b, dst[0] + x, mean[0]);
+				vstore16(g, dst[1] + x, mean[1]);
+				vstore16(r, dst[2] + x, mean[2]);
+			}
+			else if (cn == 1) vstore16(b, dst[0] + x, mean[0]);
+			else vstoreGray16(b, g, r, dst[0] + x, mean[0]);
+		}
+#endif
+		for (; x < width; ++x, src += cn)
+		{
+			if (dst_cn == 3)
+			{
+				if (cn == 1)
+				{
+					dst[0][x] = src[0] - mean[0];
+					dst[1][x] = src[0] - mean[1];
+					dst[2][x] = src[0] - mean[2];
+				}
+				else
+				{
+					dst[0][x] = src[0] - mean[0];
+					dst[1][x] = src[1] - mean[1];
+					dst[2][x] = src[2] - mean[2];
+				}
+			}
+			else if (cn == 1) dst[0][x] = src[0] - mean[0];
+			else dst[0][x] = src[0] * GRAY_B + src[1] * GRAY_G + src[2] * GRAY_R - mean[0];
+		}
+	}
+
+	void toPlanarFloat(const cv::Mat& src, float* dst, int dst_channels,
+		const cv::Scalar& mean, const cv::Size& dst_size, bool subtract_mean)
+	{
+		CV_Assert(src.depth() == CV_8U);
+		CV_Assert(src.channels() == 1 || src.channels() == 3 || src.channels() == 4);
+		CV_Assert(dst_channels == 1 || dst_channels == 3);
+		int dst_width = dst_size.width > 0 ? dst_size.width : src.cols;
+		int dst_height = dst_size.height > 0 ? dst_size.height : src.rows;
+		CV_Assert(dst_width >= src.cols && dst_height >= src.rows);
+
+		// Mean per output channel
+		float m[3] = { (float)mean[0], (float)mean[1], (float)mean[2] };
+		if (dst_channels == 1)
+			m[0] = (float)(mean[0] * GRAY_B + mean[1] * GRAY_G + mean[2] * GRAY_R);
+
+		// Without mean subtraction the padding is the mean color instead
+		float pad[3] = { 0.0f, 0.0f, 0.0f };
+		if (!subtract_mean)
+			for (int c = 0; c < 3; ++c) std::swap(m[c], pad[c]);
+
+		size_t plane_size = (size_t)dst_width * dst_height;
+		for (int r = 0; r < src.rows; ++r)
+		{
+			float* dst_rows[3];
+			for (int c = 0; c < dst_channels; ++c)
+			{
+				dst_rows[c] = dst + c * plane_size + (size_t)r * dst_width;
+				std::fill(dst_rows[c] + src.cols, dst_rows[c] + dst_width, pad[c]);
+			}
+			toPlanarFloatRow(src.ptr<uchar>(r), src.channels(), dst_rows,
+				dst_channels, src.cols, m);
+		}
+
+		// Fill the padding rows
+		for (int c = 0; c < dst_channels; ++c)
+		{
+			float* plane = dst + c * plane_size;
+			std::fill(plane + (size_t)src.rows * dst_width, plane + plane_size, pad[c]);
+		}
+	}
+
+	void scoresToMask(const float* back, const float* fore, uchar* dst, size_t count)
+	{
+		size_t i = 0;
+#if WITH_AVX2 || WITH_SSSE3
+		// Compare 16 pixels at a time and narrow the 32-bit results to bytes
+		for (; i + 16 <= count; i += 16)
+		{
+			__m128i m0 = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(back + i), _mm_loadu_ps(fore + i)));
+			__m128i m1 = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(back + i + 4), _mm_loadu_ps(fore + i + 4)));
+			__m128i m2 = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(back + i + 8), _mm_loadu_ps(fore + i + 8)));
+			__m128i m3 = _mm_castps_si128(_mm_cmplt_ps(_mm_loadu_ps(back + i + 12), _mm_loadu_ps(fore + i + 12)));
+			__m128i m = _mm_packs_epi16(_mm_packs_epi32(m0, m1), _mm_packs_epi32(m2, m3));
+			_mm_storeu_si128((__m128i*)(dst + i), m);
+		}
+#endif
+		for (; i < count; ++i)
+			dst[i] = (back[i] < fore[i]) ? 255 : 0;
+	}
+
+	// Divide by 255 with rounding, exact for 0 <= x <= 255 * 255
+	static inline int div255(int x)
+	{
+		x += 128;
+		return (x + (x >> 8)) >> 8;
+	}
+
+#if WITH_AVX2 || WITH_SSSE3
+	// Divide 8 16-bit values by 255 with rounding
+	static inline __m128i vdiv255(__m128i x)
+	{
+		x = _mm_add_epi16(x, _mm_set1_epi16(128));
+		return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+	}
+
+	// Blend 16 bytes with a color, using per byte opacities (0..255)
+	static inline __m128i vblend16(__m128i p, __m128i c, __m128i a)
+	{
+		const __m128i zero = _mm_setzero_si128(), v255 = _mm_set1_epi16(255);
+		__m128i al = _mm_unpacklo_epi8(a, zero), ah = _mm_unpackhi_epi8(a, zero);
+		__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(c, zero), al),
+			_mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), _mm_sub_epi16(v255, al)));
+		__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(c, zero), ah),
+			_mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), _mm_sub_epi16(v255, ah)));
+		return _mm_packus_epi16(vdiv255(lo), vdiv255(hi));
+	}
+#endif	// WITH_AVX2 || WITH_SSSE3
+
+	void blendMask(uchar* img, const uchar* mask, size_t count, const uchar* color, int alpha)
+	{
+		size_t i = 0;
+#if WITH_AVX2 || WITH_SSSE3
+		const __m128i zero = _mm_setzero_si128(), valpha = _mm_set1_epi16((short)alpha);
+
+		// The color repeated over 48 bytes (16 BGR pixels)
+		uchar colors[48];
+		for (int k = 0; k < 48; ++k) colors[k] = color[k % 3];
+		const __m128i c0 = _mm_loadu_si128((const __m128i*)colors);
+		const __m128i c1 = _mm_loadu_si128((const __m128i*)(colors + 16));
+		const __m128i c2 = _mm_loadu_si128((const __m128i*)(colors + 32));
+
+		// Expand the opacity of each pixel to its 3 channels
+		const __m128i e0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+		const __m128i e1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+		const __m128i e2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+
+		for (; i + 16 <= count; i += 16)
+		{
+			// Skip background pixels
+			__m128i m = _mm_loadu_si128((const __m128i*)(mask + i));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(m, zero)) == 0xFFFF) continue;
+
+			// Per pixel opacity: mask * alpha / 255
+			__m128i a = _mm_packus_epi16(
+				vdiv255(_mm_mullo_epi16(_mm_unpacklo_epi8(m, zero), valpha)),
+				vdiv255(_mm_mullo_epi16(_mm_unpackhi_epi8(m, zero), valpha)));
+
+			uchar* p = img + i * 3;
+			_mm_storeu_si128((__m128i*)p, vblend16(
+				_mm_loadu_si128((const __m128i*)p), c0, _mm_shuffle_epi8(a, e0)));
+			_mm_storeu_si128((__m128i*)(p + 16), vblend16(
+				_mm_loadu_si128((const __m128i*)(p + 16)), c1, _mm_shuffle_epi8(a, e1)));
+			_mm_storeu_si128((__m128i*)(p + 32), vblend16(
+				_mm_loadu_si128((const __m128i*)(p + 32)), c2, _mm_shuffle_epi8(a, e2)));
+		}
+#endif
+		for (; i < count; ++i)
+		{
+			int a = div255(mask[i] * alpha);
+			if (a == 0) continue;
+			uchar* p = img + i * 3;
+			p[0] = (uchar)div255(color[0] * a + p[0] * (255 - a));
+			p[1] = (uchar)div255(color[1] * a + p[1] * (255 - a));
+			p[2] = (uchar)div255(color[2] * a + p[2] * (255 - a));
+		}
+	}
+
+	void packMask(const cv::Mat& mask, cv::Mat& packed)
+	{
+		CV_Assert(mask.type() == CV_8UC1);
+		packed.create(mask.rows, (mask.cols + 7) / 8, CV_8U);
+		for (int r = 0; r < mask.rows; ++r)
+		{
+			const uchar* src = mask.ptr<uchar>(r);
+			uchar* dst = packed.ptr<uchar>(r);
+			int x = 0;
+#if WITH_AVX2 || WITH_SSSE3
+			// The byte sign bits of (mask != 0) are the packed bits
+			const __m128i zero = _mm_setzero_si128();
+			for (; x + 16 <= mask.cols; x += 16)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+				int bits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+				dst[x / 8] = (uchar)bits;
+				dst[x / 8 + 1] = (uchar)(bits >> 8);
+			}
+#endif
+			for (; x < mask.cols; x += 8)
+			{
+				uchar bits = 0;
+				for (int b = 0; b < 8 && x + b < mask.cols; ++b)
+					if (src[x + b]) bits |= (uchar)(1 << b);
+				dst[x / 8] = bits;
+			}
+		}
+	}
+
+	void unpackMask(const cv::Mat& packed, cv::Mat& mask, int cols)
+	{
+		CV_Assert(packed.type() == CV_8UC1 && packed.cols == (cols + 7) / 8);
+		mask.create(packed.rows, cols, CV_8U);
+		for (int r = 0; r < packed.rows; ++r)
+		{
+			const uchar* src = packed.ptr<uchar>(r);
+			uchar* dst = mask.ptr<uchar>(r);
+			for (int x = 0; x < cols; ++x)
+				dst[x] = ((src[x / 8] >> (x % 8)) & 1) ? 255 : 0;
+		}
+	}
+
+}   // namespace face_seg
@@ -0,0 +1,102 @@
+#include "face_seg/mapped_file.h"
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace face_seg
+{
+	MappedFile::MappedFile(const std::string& file_path, bool copy_on_write)
+	{
+		open(file_path, copy_on_write);
+	}
+
+	MappedFile::~MappedFile()
+	{
+		close();
+	}
+
+#ifdef _WIN32
+	void MappedFile::open(const std::string& file_path, bool copy_on_write)
+	{
+		close();
+		HANDLE file = CreateFileA(file_path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			throw std::runtime_error("Failed to open \"" + file_path + "\"!");
+		m_file_handle = file;
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size))
+		{
+			close();
+			throw std::runtime_error("Failed to read \"" + file_path + "\"!");
+		}
+		m_size = (size_t)size.QuadPart;
+		if (m_size == 0) return;
+
+		HANDLE mapping = CreateFileMappingA(file, NULL,
+			copy_on_write ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, NULL);
+		m_map_handle = mapping;
+		m_data = mapping == NULL ? nullptr : (const char*)MapViewOfFile(mapping,
+			copy_on_write ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+		if (m_data == nullptr)
+		{
+			close();
+			throw std::runtime_error("Failed to map \"" + file_path + "\"!");
+		}
+	}
+
+	void MappedFile::close()
+	{
+		if (m_data != nullptr) UnmapViewOfFile(m_data);
+		if (m_map_handle != nullptr) CloseHandle((HANDLE)m_map_handle);
+		if (m_file_handle != nullptr) CloseHandle((HANDLE)m_file_handle);
+		m_data = nullptr;
+		m_size = 0;
+		m_map_handle = m_file_handle = nullptr;
+	}
+#else
+	void MappedFile::open(const std::string& file_path, bool copy_on_write)
+	{
+		close();
+		int fd = ::open(file_path.c_str(), O_RDONLY);
+		if (fd < 0) throw std::runtime_error("Failed to open \"" + file_path + "\"!");
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			::close(fd);
+			throw std::runtime_error("Failed to read \"" + file_path + "\"!");
+		}
+		m_size = (size_t)st.st_size;
+		if (m_size == 0)
+		{
+			::close(fd);
+			return;
+		}
+
+		void* data = mmap(nullptr, m_size, copy_on_write ? PROT_READ | PROT_WRITE : PROT_READ,
+			copy_on_write ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+		::close(fd);
+		if (data == MAP_FAILED)
+		{
+			m_size = 0;
+			throw std::runtime_error("Failed to map \"" + file_path + "\"!");
+		}
+		m_data = (const char*)data;
+	}
+
+	void MappedFile::close()
+	{
+		if (m_data != nullptr) munmap((void*)m_data, m_size);
+		m_data = nullptr;
+		m_size = 0;
+	}
+#endif
+
+}   // namespace face_seg
@@ -0,0 +1,395 @@
+#include "face_seg/mask_archive.h"
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <share.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace face_seg
+{
+	static const char DATA_MAGIC[8] = { 'F', 'S', 'E', 'G', 'M', 'S', 'K', '1' };
+	static const char INDEX_MAGIC[8] = { 'F', 'S', 'E', 'G', 'M', 'I', 'X', '1' };
+
+	// Sanity limits of a record, to detect corrupted or partial records
+	static const uint32_t MAX_KEY_SIZE = 1 << 16;
+	static const uint64_t MAX_MASK_AREA = 1ULL << 32;
+
+	/**	Header of a record in the data file, followed by the key and the
+		encoded mask. All the integers are in native byte order.
+	*/
+	struct RecordHeader
+	{
+		uint32_t key_size;
+		uint32_t rows;
+		uint32_t cols;
+		uint32_t encoding;
+		uint64_t payload_size;
+	};
+
+	static bool validRecord(const RecordHeader& h, uint64_t offset, uint64_t data_size)
+	{
+		uint64_t end = offset + sizeof(RecordHeader);
+		return h.key_size <= MAX_KEY_SIZE && (uint64_t)h.rows * h.cols <= MAX_MASK_AREA &&
+			h.encoding <= MASK_RLE_VALUES && end <= data_size &&
+			h.payload_size <= data_size - end && h.key_size <= data_size - end - h.payload_size;
+	}
+
+	/**	64-bit FNV-1a hash of a key.
+	*/
+	static uint64_t hashKey(const char* key, size_t size)
+	{
+		uint64_t h = 0xCBF29CE484222325ULL;
+		for (size_t i = 0; i < size; ++i)
+			h = (h ^ (uchar)key[i]) * 0x100000001B3ULL;
+		return h;
+	}
+
+	static std::string indexPath(const std::string& archive_path)
+	{
+		return archive_path + ".idx";
+	}
+
+	// Run-length encoding
+
+	static inline void writeVarint(std::vector<uchar>& data, uint64_t v)
+	{
+		while (v >= 0x80)
+		{
+			data.push_back((uchar)(v | 0x80));
+			v >>= 7;
+		}
+		data.push_back((uchar)v);
+	}
+
+	static inline bool readVarint(const uchar*& p, const uchar* end, uint64_t& v)
+	{
+		v = 0;
+		for (int shift = 0; p < end && shift < 64; shift += 7)
+		{
+			uchar b = *p++;
+			v |= (uint64_t)(b & 0x7F) << shift;
+			if (b < 0x80) return true;
+		}
+		return false;
+	}
+
+	/**	Get the length of the run of value starting at p, up to end.
+	*/
+	static inline size_t runLength(const uchar* p, const uchar* end, uchar value)
+	{
+		// Compare 8 pixels at a time inside long runs
+		const uchar* start = p;
+		uint64_t pattern = 0x0101010101010101ULL * value;
+		uint64_t word;
+		while (p + 8 <= end)
+		{
+			std::memcpy(&word, p, 8);
+			if (word != pattern) break;
+			p += 8;
+		}
+		while (p < end && *p == value) ++p;
+		return p - start;
+	}
+
+	int encodeMask(const cv::Mat& mask, std::vector<uchar>& data)
+	{
+		CV_Assert(mask.type() == CV_8UC1);
+		cv::Mat m = mask.isContinuous() ? mask : mask.clone();
+		const uchar* p = m.data;
+		const uchar* end = p + m.total();
+
+		// Binary runs, until a value other than 0 and 255 is found
+		data.clear();
+		const uchar* q = p;
+		uchar value = 0;
+		while (q < end)
+		{
+			size_t len = runLength(q, end, value);
+			writeVarint(data, len);
+			q += len;
+			if (q < end && *q != 0 && *q != 255) break;
+			value = ~value;
+		}
+		if (q == end) return MASK_RLE_BINARY;
+
+		// Value runs
+		data.clear();
+		for (q = p; q < end;)
+		{
+			size_t len = runLength(q, end, *q);
+			data.push_back(*q);
+			writeVarint(data, len);
+			q += len;
+		}
+		return MASK_RLE_VALUES;
+	}
+
+	bool decodeMask(const uchar* data, size_t size, int encoding, cv::Mat& mask)
+	{
+		CV_Assert(mask.type() == CV_8UC1 && mask.isContinuous());
+		const uchar* p = data;
+		const uchar* end = data + size;
+		uchar* out = mask.data;
+		uchar* out_end = out + mask.total();
+		uchar value = 0;
+		while (p < end)
+		{
+			if (encoding == MASK_RLE_VALUES) value = *p++;
+			uint64_t len;
+			if (!readVarint(p, end, len) || len > (uint64_t)(out_end - out)) return false;
+			std::memset(out, value, (size_t)len);
+			out += len;
+			if (encoding == MASK_RLE_BINARY) value = ~value;
+		}
+		return out == out_end;
+	}
+
+	// Writer
+
+	MaskArchiveWriter::MaskArchiveWriter(const std::string& archive_path) :
+		m_path(archive_path)
+	{
+		// Create the archive, or continue after its last complete record
+		std::ifstream existing(archive_path, std::ios::binary);
+		bool exists = existing.is_open();
+		existing.close();
+		if (exists) scan();
+		else
+		{
+			std::ofstream create(archive_path, std::ios::binary);
+			create.write(DATA_MAGIC, sizeof(DATA_MAGIC));
+			if (!create.good()) throw std::runtime_error("Failed to create \"" + archive_path + "\"!");
+			m_data_size = sizeof(DATA_MAGIC);
+		}
+
+		m_file.open(archive_path, std::ios::binary | std::ios::in | std::ios::out);
+		if (!m_file.is_open()) throw std::runtime_error("Failed to open \"" + archive_path + "\"!");
+		m_file.seekp((std::streamoff)m_data_size);
+	}
+
+	MaskArchiveWriter::~MaskArchiveWriter()
+	{
+		try { close(); }
+		catch (...) {}
+	}
+
+	void MaskArchiveWriter::scan()
+	{
+		std::ifstream file(m_path, std::ios::binary | std::ios::ate);
+		if (!file.is_open()) throw std::runtime_error("Failed to open \"" + m_path + "\"!");
+		uint64_t file_size = (uint64_t)file.tellg();
+		file.seekg(0);
+		char magic[sizeof(DATA_MAGIC)];
+		if (!file.read(magic, sizeof(magic)) || std::memcmp(magic, DATA_MAGIC, sizeof(magic)) != 0)
+			throw std::runtime_error("\"" + m_path + "\" is not a mask archive!");
+
+		// Read the keys of the complete records
+		uint64_t offset = sizeof(DATA_MAGIC);
+		RecordHeader h;
+		std::string key;
+		while (file.read((char*)&h, sizeof(h)) && validRecord(h, offset, file_size))
+		{
+			key.resize(h.key_size);
+			if (!file.read(&key[0], h.key_size)) break;
+			m_entries.push_back({ hashKey(key.data(), key.size()), offset });
+			m_keys.insert(key);
+			offset += sizeof(h) + h.key_size + h.payload_size;
+			file.seekg((std::streamoff)offset);
+		}
+		file.close();
+		m_data_size = offset;
+
+		// Discard a partial last record
+		if (offset < file_size)
+		{
+#ifdef _WIN32
+			int fd = -1;
+			bool truncated = _sopen_s(&fd, m_path.c_str(), _O_RDWR | _O_BINARY, _SH_DENYNO,
+				_S_IREAD | _S_IWRITE) == 0 && _chsize_s(fd, (__int64)offset) == 0;
+			if (fd >= 0) _close(fd);
+#else
+			bool truncated = truncate(m_path.c_str(), (off_t)offset) == 0;
+#endif
+			if (!truncated)
+				throw std::runtime_error("Failed to discard the partial record of \"" + m_path + "\"!");
+		}
+	}
+
+	void MaskArchiveWriter::append(const std::string& key, const cv::Mat& mask)
+	{
+		CV_Assert(key.size() <= MAX_KEY_SIZE);
+
+		// Encode outside the lock
+		std::vector<uchar> payload;
+		RecordHeader h;
+		h.key_size = (uint32_t)key.size();
+		h.rows = (uint32_t)mask.rows;
+		h.cols = (uint32_t)mask.cols;
+		h.encoding = (uint32_t)encodeMask(mask, payload);
+		h.payload_size = payload.size();
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_file.is_open()) throw std::runtime_error("The mask archive is closed!");
+		m_file.write((const char*)&h, sizeof(h));
+		m_file.write(key.data(), key.size());
+		m_file.write((const char*)payload.data(), payload.size());
+		if (!m_file.good()) throw std::runtime_error("Failed to write to \"" + m_path + "\"!");
+		m_entries.push_back({ hashKey(key.data(), key.size()), m_data_size });
+		m_keys.insert(key);
+		m_data_size += sizeof(h) + key.size() + payload.size();
+	}
+
+	bool MaskArchiveWriter::contains(const std::string& key) const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_keys.count(key) > 0;
+	}
+
+	size_t MaskArchiveWriter::size() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_entries.size();
+	}
+
+	void MaskArchiveWriter::close()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_file.is_open()) return;
+		m_file.close();
+
+		// Sort by hash, and by offset so the last record of a key is last
+		std::sort(m_entries.begin(), m_entries.end(), [](const IndexEntry& a, const IndexEntry& b)
+		{
+			return a.hash != b.hash ? a.hash < b.hash : a.offset < b.offset;
+		});
+
+		// Write the index to a temporary file and replace the previous index
+		std::string index_path = indexPath(m_path);
+		std::string tmp_path = index_path + ".tmp";
+		{
+			std::ofstream index(tmp_path, std::ios::binary);
+			uint64_t count = m_entries.size();
+			index.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+			index.write((const char*)&m_data_size, sizeof(m_data_size));
+			index.write((const char*)&count, sizeof(count));
+			index.write((const char*)m_entries.data(), m_entries.size() * sizeof(IndexEntry));
+			if (!index.good()) throw std::runtime_error("Failed to write \"" + tmp_path + "\"!");
+		}
+		std::remove(index_path.c_str());
+		if (std::rename(tmp_path.c_str(), index_path.c_str()) != 0)
+			throw std::runtime_error("Failed to write \"" + index_path + "\"!");
+	}
+
+	// Reader
+
+	MaskArchiveReader::MaskArchiveReader(const std::string& archive_path)
+	{
+		m_data.open(archive_path);
+		if (m_data.size() < sizeof(DATA_MAGIC) ||
+			std::memcmp(m_data.data(), DATA_MAGIC, sizeof(DATA_MAGIC)) != 0)
+			throw std::runtime_error("\"" + archive_path + "\" is not a mask archive!");
+
+		// Use the index if it's valid and covers the whole data file. A writer
+		// that is still appending leaves a stale index, then the data is scanned
+		const size_t index_header_size = sizeof(INDEX_MAGIC) + 2 * sizeof(uint64_t);
+		std::string index_path = indexPath(archive_path);
+		try { m_index.open(index_path); }
+		catch (const std::runtime_error&) {}
+		if (m_index.size() >= index_header_size &&
+			std::memcmp(m_index.data(), INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0)
+		{
+			uint64_t count;
+			std::memcpy(&m_data_size, m_index.data() + sizeof(INDEX_MAGIC), sizeof(uint64_t));
+			std::memcpy(&count, m_index.data() + sizeof(INDEX_MAGIC) + sizeof(uint64_t), sizeof(uint64_t));
+			if (m_data_size == m_data.size() &&
+				count == (m_index.size() - index_header_size) / sizeof(IndexEntry))
+			{
+				m_entries = (const IndexEntry*)(m_index.data() + index_header_size);
+				m_count = (size_t)count;
+				return;
+			}
+		}
+		m_index.close();
+		scan();
+	}
+
+	void MaskArchiveReader::scan()
+	{
+		m_data_size = m_data.size();
+		uint64_t offset = sizeof(DATA_MAGIC);
+		RecordHeader h;
+		while (offset + sizeof(h) <= m_data_size)
+		{
+			std::memcpy(&h, m_data.data() + offset, sizeof(h));
+			if (!validRecord(h, offset, m_data_size)) break;
+			m_scanned_entries.push_back({ hashKey(m_data.data() + offset + sizeof(h), h.key_size), offset });
+			offset += sizeof(h) + h.key_size + h.payload_size;
+		}
+		m_data_size = offset;
+		std::sort(m_scanned_entries.begin(), m_scanned_entries.end(), [](const IndexEntry& a, const IndexEntry& b)
+		{
+			return a.hash != b.hash ? a.hash < b.hash : a.offset < b.offset;
+		});
+		m_entries = m_scanned_entries.data();
+		m_count = m_scanned_entries.size();
+	}
+
+	const char* MaskArchiveReader::record(size_t i, std::string* key) const
+	{
+		CV_Assert(i < m_count);
+		uint64_t offset = m_entries[i].offset;
+		RecordHeader h;
+		if (offset + sizeof(h) > m_data_size) throw std::runtime_error("Corrupted mask archive!");
+		std::memcpy(&h, m_data.data() + offset, sizeof(h));
+		if (!validRecord(h, offset, m_data_size)) throw std::runtime_error("Corrupted mask archive!");
+		if (key != nullptr) key->assign(m_data.data() + offset + sizeof(h), h.key_size);
+		return m_data.data() + offset;
+	}
+
+	std::string MaskArchiveReader::key(size_t i) const
+	{
+		std::string k;
+		record(i, &k);
+		return k;
+	}
+
+	void MaskArchiveReader::read(size_t i, cv::Mat& mask) const
+	{
+		const char* r = record(i, nullptr);
+		RecordHeader h;
+		std::memcpy(&h, r, sizeof(h));
+		mask.create((int)h.rows, (int)h.cols, CV_8U);
+		if (!mask.isContinuous()) mask = cv::Mat((int)h.rows, (int)h.cols, CV_8U);
+		const uchar* payload = (const uchar*)r + sizeof(h) + h.key_size;
+		if (!decodeMask(payload, (size_t)h.payload_size, (int)h.encoding, mask))
+			throw std::runtime_error("Corrupted mask archive!");
+	}
+
+	bool MaskArchiveReader::read(const std::string& key, cv::Mat& mask) const
+	{
+		// Search the records with the key's hash from the last
+		uint64_t hash = hashKey(key.data(), key.size());
+		const IndexEntry* first = std::lower_bound(m_entries, m_entries + m_count, hash,
+			[](const IndexEntry& e, uint64_t h) { return e.hash < h; });
+		const IndexEntry* last = first;
+		while (last < m_entries + m_count && last->hash == hash) ++last;
+		std::string k;
+		for (const IndexEntry* e = last; e-- > first;)
+		{
+			record(e - m_entries, &k);
+			if (k != key) continue;
+			read(e - m_entries, mask);
+			return true;
+		}
+		return false;
+	}
+
+}   // namespace face_seg
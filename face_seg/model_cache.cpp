@@ -0,0 +1,271 @@
+#include "face_seg/model_cache.h"
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <google/protobuf/text_format.h>
+
+using namespace caffe;
+
+namespace face_seg
+{
+	static const char MAGIC[8] = { 'F', 'S', 'E', 'G', 'N', 'E', 'T', '1' };
+	static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+	static const size_t HEADER_SIZE = 48;
+	static const size_t ALIGNMENT = 64;
+
+	static size_t align(size_t offset)
+	{
+		return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+	}
+
+	template<typename T>
+	static void append(std::string& buf, const T& value)
+	{
+		buf.append((const char*)&value, sizeof(T));
+	}
+
+	static const std::string MAPPED_TYPE_PREFIX = "FaceSegMapped";
+
+	/**	Create a layer of a mapped layer type: a layer of the original type,
+		whose weight blobs are shaped from the definition but not allocated.
+		Caffe's layers skip their weight fillers when their blobs already exist.
+	*/
+	static shared_ptr<Layer<float>> createMappedLayer(const LayerParameter& param)
+	{
+		LayerParameter layer_param = param;
+		layer_param.set_type(param.type().substr(MAPPED_TYPE_PREFIX.size()));
+		layer_param.clear_blobs();
+		shared_ptr<Layer<float>> layer = LayerRegistry<float>::CreateLayer(layer_param);
+		for (int i = 0; i < param.blobs_size(); ++i)
+		{
+			const BlobShape& shape = param.blobs(i).shape();
+			std::vector<int> dims;
+			for (int d = 0; d < shape.dim_size(); ++d) dims.push_back((int)shape.dim(d));
+			layer->blobs().push_back(shared_ptr<Blob<float>>(new Blob<float>(dims)));
+		}
+		return layer;
+	}
+
+	/**	Get the mapped layer type of a layer type, registering it on first use.
+	*/
+	static std::string mappedLayerType(const std::string& type)
+	{
+		static std::mutex mutex;
+		std::lock_guard<std::mutex> lock(mutex);
+		std::string mapped_type = MAPPED_TYPE_PREFIX + type;
+		if (LayerRegistry<float>::Registry().count(mapped_type) == 0)
+			LayerRegistry<float>::AddCreator(mapped_type, createMappedLayer);
+		return mapped_type;
+	}
+
+	/**	Sequential reader of the mapped cache, with bounds checking.
+	*/
+	class CacheReader
+	{
+	public:
+		CacheReader(const char* data, size_t size, size_t offset) :
+			m_data(data), m_size(size), m_offset(offset) {}
+
+		template<typename T>
+		T read()
+		{
+			T value;
+			std::memcpy(&value, bytes(sizeof(T)), sizeof(T));
+			return value;
+		}
+
+		std::string readString(size_t length)
+		{
+			return std::string(bytes(length), length);
+		}
+
+		size_t offset() const { return m_offset; }
+
+	private:
+		const char* bytes(size_t length)
+		{
+			CHECK_LE(length, m_size - std::min(m_offset, m_size)) << "Corrupted model cache.";
+			const char* p = m_data + m_offset;
+			m_offset += length;
+			return p;
+		}
+
+		const char* m_data;
+		size_t m_size;
+		size_t m_offset;
+	};
+
+	ModelCache::ModelCache(const std::string& cache_file)
+	{
+		// The mapping must be writable because Caffe's blobs take non-const
+		// pointers, but it's never written to
+		m_file.open(cache_file, true);
+		parse();
+	}
+
+	bool ModelCache::isModelCache(const std::string& file_path)
+	{
+		std::ifstream file(file_path, std::ios::binary);
+		char magic[sizeof(MAGIC)];
+		if (!file.read(magic, sizeof(MAGIC))) return false;
+		return std::memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+	}
+
+	void ModelCache::compile(const std::string& deploy_file, const std::string& model_file,
+		const std::string& cache_file)
+	{
+		// Load the network
+		Net<float> net(deploy_file, caffe::TEST);
+		net.CopyTrainedLayersFrom(model_file);
+		std::ifstream deploy_stream(deploy_file);
+		CHECK(deploy_stream.is_open()) << "Failed to read \"" << deploy_file << "\".";
+		std::stringstream deploy_text;
+		deploy_text << deploy_stream.rdbuf();
+		std::string deploy = deploy_text.str();
+
+		// Compute the size of the table
+		const std::vector<std::string>& layer_names = net.layer_names();
+		size_t table_size = 0;
+		for (size_t i = 0; i < layer_names.size(); ++i)
+		{
+			const auto& blobs = net.layers()[i]->blobs();
+			if (blobs.empty()) continue;
+			table_size += 2 * sizeof(uint32_t) + layer_names[i].size();
+			for (const auto& blob : blobs)
+				table_size += sizeof(uint32_t) * (1 + blob->shape().size()) + sizeof(uint64_t);
+		}
+
+		// Write the table, the weights start after it
+		std::string table;
+		size_t table_offset = HEADER_SIZE + deploy.size();
+		size_t data_offset = align(table_offset + table_size);
+		std::vector<const Blob<float>*> data_blobs;
+		for (size_t i = 0; i < layer_names.size(); ++i)
+		{
+			const auto& blobs = net.layers()[i]->blobs();
+			if (blobs.empty()) continue;
+			append(table, (uint32_t)layer_names[i].size());
+			table.append(layer_names[i]);
+			append(table, (uint32_t)blobs.size());
+			for (const auto& blob : blobs)
+			{
+				append(table, (uint32_t)blob->shape().size());
+				for (int d : blob->shape()) append(table, (int32_t)d);
+				append(table, (uint64_t)data_offset);
+				data_offset = align(data_offset + blob->count() * sizeof(float));
+				data_blobs.push_back(blob.get());
+			}
+		}
+
+		// Write the file
+		std::ofstream out(cache_file, std::ios::binary);
+		CHECK(out.is_open()) << "Failed to write \"" << cache_file << "\".";
+		std::string header(MAGIC, sizeof(MAGIC));
+		append(header, BYTE_ORDER_MARK);
+		append(header, (uint32_t)0);
+		append(header, (uint64_t)HEADER_SIZE);
+		append(header, (uint64_t)deploy.size());
+		append(header, (uint64_t)table_offset);
+		append(header, (uint64_t)table.size());
+		out.write(header.data(), header.size());
+		out.write(deploy.data(), deploy.size());
+		out.write(table.data(), table.size());
+		size_t offset = table_offset + table.size();
+		const char zeros[ALIGNMENT] = {};
+		for (const Blob<float>* blob : data_blobs)
+		{
+			out.write(zeros, align(offset) - offset);
+			offset = align(offset);
+			out.write((const char*)blob->cpu_data(), blob->count() * sizeof(float));
+			offset += blob->count() * sizeof(float);
+		}
+		CHECK(out.good()) << "Failed to write \"" << cache_file << "\".";
+	}
+
+	void ModelCache::apply(Net<float>& net) const
+	{
+		const std::vector<std::string>& layer_names = net.layer_names();
+		for (size_t i = 0; i < layer_names.size(); ++i)
+		{
+			auto it = m_layers.find(layer_names[i]);
+			if (it == m_layers.end()) continue;
+			const auto& blobs = net.layers()[i]->blobs();
+			CHECK_EQ(blobs.size(), it->second.size()) <<
+				"Incompatible number of blobs for layer " << layer_names[i];
+			for (size_t j = 0; j < blobs.size(); ++j)
+			{
+				CHECK(blobs[j]->shape() == it->second[j].shape) <<
+					"Incompatible blob shape for layer " << layer_names[i];
+				blobs[j]->set_cpu_data(const_cast<float*>(it->second[j].data));
+			}
+		}
+	}
+
+	void ModelCache::parse()
+	{
+		// Header
+		CacheReader header(m_file.data(), m_file.size(), 0);
+		CHECK(std::memcmp(header.readString(sizeof(MAGIC)).data(), MAGIC, sizeof(MAGIC)) == 0) <<
+			"Not a compiled model cache.";
+		CHECK_EQ(header.read<uint32_t>(), BYTE_ORDER_MARK) <<
+			"The model cache was compiled on a machine with a different byte order.";
+		header.read<uint32_t>();
+		uint64_t deploy_offset = header.read<uint64_t>();
+		uint64_t deploy_size = header.read<uint64_t>();
+		uint64_t table_offset = header.read<uint64_t>();
+		uint64_t table_size = header.read<uint64_t>();
+
+		// Network definition
+		CacheReader deploy(m_file.data(), m_file.size(), (size_t)deploy_offset);
+		CHECK(google::protobuf::TextFormat::ParseFromString(
+			deploy.readString((size_t)deploy_size), &m_net_param)) << "Failed to parse the network definition.";
+		UpgradeNetAsNeeded("model cache", &m_net_param);
+		m_net_param.mutable_state()->set_phase(caffe::TEST);
+
+		// Weights table
+		CacheReader table(m_file.data(), m_file.size(), (size_t)table_offset);
+		while (table.offset() < table_offset + table_size)
+		{
+			std::string name = table.readString(table.read<uint32_t>());
+			std::vector<BlobEntry>& blobs = m_layers[name];
+			uint32_t blob_count = table.read<uint32_t>();
+			for (uint32_t i = 0; i < blob_count; ++i)
+			{
+				BlobEntry blob;
+				uint32_t axes = table.read<uint32_t>();
+				size_t count = 1;
+				for (uint32_t a = 0; a < axes; ++a)
+				{
+					blob.shape.push_back(table.read<int32_t>());
+					count *= blob.shape.back();
+				}
+				uint64_t offset = table.read<uint64_t>();
+				CHECK(offset % sizeof(float) == 0 && offset <= m_file.size() &&
+					count * sizeof(float) <= m_file.size() - offset) << "Corrupted model cache.";
+				blob.data = (const float*)(m_file.data() + offset);
+				blobs.push_back(blob);
+			}
+		}
+
+		// Create the layers with weights as mapped layers. Their blob shapes
+		// are added to the definition, without data, and the mapped layer
+		// creates the blobs itself, so no weights are allocated or filled
+		// before apply() points the blobs to the mapped weights
+		for (int i = 0; i < m_net_param.layer_size(); ++i)
+		{
+			LayerParameter* layer = m_net_param.mutable_layer(i);
+			auto it = m_layers.find(layer->name());
+			if (it == m_layers.end()) continue;
+			layer->clear_blobs();
+			for (const BlobEntry& blob : it->second)
+			{
+				BlobShape* shape = layer->add_blobs()->mutable_shape();
+				for (int d : blob.shape) shape->add_dim(d);
+			}
+			layer->set_type(mappedLayerType(layer->type()));
+		}
+	}
+
+}   // namespace face_seg
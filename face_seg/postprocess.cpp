@@ -0,0 +1,253 @@
+#include "face_seg/postprocess.h"
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+#include <opencv2/imgproc.hpp>
+
+namespace face_seg
+{
+	void PostProcessor::process(cv::Mat& seg, bool disconnected, bool holes,
+		bool smooth, int smooth_iterations, int smooth_kernel_radius)
+	{
+		if (disconnected || holes) filterComponents(seg, disconnected, holes);
+		if (smooth) this->smooth(seg, smooth_iterations, smooth_kernel_radius);
+		if (disconnected || holes) filterComponents(seg, disconnected, holes);
+	}
+
+	void PostProcessor::filterComponents(cv::Mat& seg, bool disconnected, bool holes)
+	{
+		CV_Assert(seg.type() == CV_8U);
+		if (!disconnected && !holes) return;
+
+		// Everything outside the bounding box of the foreground is background
+		cv::Rect roi = cv::boundingRect(seg);
+		if (roi.area() == 0) return;
+		extractRuns(seg, roi);
+
+		// The runs to keep, either the largest component or all of them
+		int keep_root = disconnected ? findLargestComponent() : -1;
+		auto kept = [&](int i) { return keep_root < 0 || findRoot(m_parent, i) == keep_root; };
+
+		if (!holes)
+		{
+			for (int i = 0; i < (int)m_runs.size(); ++i)
+			{
+				if (kept(i)) continue;
+				const Run& run = m_runs[i];
+				std::memset(seg.ptr<uchar>(run.y) + run.x0, 0, run.x1 - run.x0);
+			}
+			return;
+		}
+
+		// The holes are filled with the maximum value of the kept runs
+		uchar max_val = 0;
+		for (int i = 0; i < (int)m_runs.size(); ++i)
+			if (kept(i)) max_val = std::max(max_val, m_runs[i].max_val);
+
+		// Extract the background runs, the removed components are background too
+		m_gaps.clear();
+		m_gap_row_start.resize(roi.height + 1);
+		for (int r = 0; r < roi.height; ++r)
+		{
+			m_gap_row_start[r] = (int)m_gaps.size();
+			int x = roi.x;
+			for (int i = m_row_start[r]; i < m_row_start[r + 1]; ++i)
+			{
+				if (!kept(i)) continue;
+				if (m_runs[i].x0 > x) m_gaps.push_back({ roi.y + r, x, m_runs[i].x0, 0 });
+				x = m_runs[i].x1;
+			}
+			if (x < roi.br().x) m_gaps.push_back({ roi.y + r, x, roi.br().x, 0 });
+		}
+		m_gap_row_start[roi.height] = (int)m_gaps.size();
+
+		// Label the background runs (4-connected). The strips of the image
+		// above, below, left and right of the bounding box are additional nodes.
+		const int gap_count = (int)m_gaps.size();
+		const int TOP = gap_count, BOTTOM = gap_count + 1, LEFT = gap_count + 2, RIGHT = gap_count + 3;
+		const bool has_top = roi.y > 0, has_bottom = roi.br().y < seg.rows;
+		const bool has_left = roi.x > 0, has_right = roi.br().x < seg.cols;
+		m_gap_parent.resize(gap_count + 4);
+		std::iota(m_gap_parent.begin(), m_gap_parent.end(), 0);
+		if (has_top && has_left) unite(m_gap_parent, TOP, LEFT);
+		if (has_top && has_right) unite(m_gap_parent, TOP, RIGHT);
+		if (has_bottom && has_left) unite(m_gap_parent, BOTTOM, LEFT);
+		if (has_bottom && has_right) unite(m_gap_parent, BOTTOM, RIGHT);
+		for (int r = 0; r < roi.height; ++r)
+		{
+			int j = r > 0 ? m_gap_row_start[r - 1] : 0;
+			const int prev_end = r > 0 ? m_gap_row_start[r] : 0;
+			for (int i = m_gap_row_start[r]; i < m_gap_row_start[r + 1]; ++i)
+			{
+				const Run& gap = m_gaps[i];
+				if (has_top && r == 0) unite(m_gap_parent, i, TOP);
+				if (has_bottom && r == roi.height - 1) unite(m_gap_parent, i, BOTTOM);
+				if (has_left && gap.x0 == roi.x) unite(m_gap_parent, i, LEFT);
+				if (has_right && gap.x1 == roi.br().x) unite(m_gap_parent, i, RIGHT);
+
+				// Connect to the overlapping runs of the previous row
+				while (j < prev_end && m_gaps[j].x1 <= gap.x0) ++j;
+				for (int k = j; k < prev_end && m_gaps[k].x0 < gap.x1; ++k)
+					unite(m_gap_parent, i, k);
+			}
+		}
+
+		// Find the background component of the top left pixel,
+		// if the top left pixel is in the foreground everything else is a hole
+		int seed = -1;
+		if (has_top) seed = TOP;
+		else if (has_left) seed = LEFT;
+		else if (gap_count > 0 && m_gaps[0].y == 0 && m_gaps[0].x0 == 0) seed = 0;
+		int seed_root = seed < 0 ? -1 : findRoot(m_gap_parent, seed);
+
+		// Write the background runs, all but the seed's component are holes
+		for (int i = 0; i < gap_count; ++i)
+		{
+			const Run& gap = m_gaps[i];
+			uchar val = findRoot(m_gap_parent, i) == seed_root ? 0 : max_val;
+			std::memset(seg.ptr<uchar>(gap.y) + gap.x0, val, gap.x1 - gap.x0);
+		}
+
+		// The strips are background, fill the ones that are holes
+		cv::Rect strips[4] = {
+			cv::Rect(0, 0, seg.cols, roi.y),
+			cv::Rect(0, roi.br().y, seg.cols, seg.rows - roi.br().y),
+			cv::Rect(0, roi.y, roi.x, roi.height),
+			cv::Rect(roi.br().x, roi.y, seg.cols - roi.br().x, roi.height) };
+		for (int s = 0; s < 4; ++s)
+		{
+			if (strips[s].area() == 0 || findRoot(m_gap_parent, gap_count + s) == seed_root)
+				continue;
+			seg(strips[s]).setTo(max_val);
+		}
+	}
+
+	void PostProcessor::smooth(cv::Mat& seg, int smooth_iterations, int smooth_kernel_radius)
+	{
+		if (smooth_iterations <= 0) return;
+		cv::Rect roi = cv::boundingRect(seg);
+		if (roi.area() == 0) return;
+
+		if (m_kernel_radius != smooth_kernel_radius)
+		{
+			int kernel_size = smooth_kernel_radius * 2 + 1;
+			m_kernel = cv::getStructuringElement(
+				cv::MorphShapes::MORPH_ELLIPSE, cv::Size(kernel_size, kernel_size));
+			m_kernel_radius = smooth_kernel_radius;
+		}
+
+		// The opening can't grow the foreground by more than (iterations * radius)
+		// pixels and the closing by as much again. The margin also keeps the
+		// erosions away from the region's border, where the pixels outside the
+		// region would be missing from the minimum.
+		int margin = (2 * smooth_iterations + 1) * smooth_kernel_radius + 1;
+		roi = cv::Rect(roi.x - margin, roi.y - margin,
+			roi.width + 2 * margin, roi.height + 2 * margin) & cv::Rect(0, 0, seg.cols, seg.rows);
+
+		// Process a copy of the region, so the border is handled as if it was
+		// the whole image
+		cv::Mat seg_roi = seg(roi);
+		seg_roi.copyTo(m_smooth_buf);
+		cv::morphologyEx(m_smooth_buf, m_smooth_buf, cv::MORPH_OPEN, m_kernel,
+			cv::Point(-1, -1), smooth_iterations);
+		cv::morphologyEx(m_smooth_buf, m_smooth_buf, cv::MORPH_CLOSE, m_kernel,
+			cv::Point(-1, -1), smooth_iterations);
+		m_smooth_buf.copyTo(seg_roi);
+	}
+
+	void PostProcessor::extractRuns(const cv::Mat& seg, const cv::Rect& roi)
+	{
+		m_runs.clear();
+		m_row_start.resize(roi.height + 1);
+		for (int r = 0; r < roi.height; ++r)
+		{
+			m_row_start[r] = (int)m_runs.size();
+			const uchar* row = seg.ptr<uchar>(roi.y + r);
+			for (int x = roi.x, end = roi.br().x; x < end;)
+			{
+				if (row[x] == 0)
+				{
+					++x;
+					continue;
+				}
+				Run run = { roi.y + r, x, 0, 0 };
+				for (; x < end && row[x] != 0; ++x)
+					run.max_val = std::max(run.max_val, row[x]);
+				run.x1 = x;
+				m_runs.push_back(run);
+			}
+		}
+		m_row_start[roi.height] = (int)m_runs.size();
+	}
+
+	int PostProcessor::findLargestComponent()
+	{
+		// Label the runs (8-connected)
+		const int run_count = (int)m_runs.size();
+		const int rows = (int)m_row_start.size() - 1;
+		m_parent.resize(run_count);
+		std::iota(m_parent.begin(), m_parent.end(), 0);
+		for (int r = 1; r < rows; ++r)
+		{
+			int j = m_row_start[r - 1];
+			const int prev_end = m_row_start[r];
+			for (int i = m_row_start[r]; i < m_row_start[r + 1]; ++i)
+			{
+				const Run& run = m_runs[i];
+				while (j < prev_end && m_runs[j].x1 < run.x0) ++j;
+				for (int k = j; k < prev_end && m_runs[k].x0 <= run.x1; ++k)
+					unite(m_parent, i, k);
+			}
+		}
+
+		// Accumulate the area of each component, and the first 2 x 2 block
+		// that contains it, which determines the label order of cv::connectedComponents
+		m_area.assign(run_count, 0);
+		m_first_block.assign(run_count, INT64_MAX);
+		int components = 0;
+		for (int i = 0; i < run_count; ++i)
+		{
+			const Run& run = m_runs[i];
+			int root = findRoot(m_parent, i);
+			if (root == i) ++components;
+			m_area[root] += run.x1 - run.x0;
+			m_first_block[root] = std::min(m_first_block[root],
+				((int64)(run.y >> 1) << 32) | (run.x0 >> 1));
+		}
+		if (components <= 1) return -1;
+
+		// Find the component with the maximum area, the first one on ties
+		int max_root = -1;
+		for (int i = 0; i < run_count; ++i)
+		{
+			if (m_parent[i] != i) continue;
+			if (max_root < 0 || m_area[i] > m_area[max_root] ||
+				(m_area[i] == m_area[max_root] && m_first_block[i] < m_first_block[max_root]))
+				max_root = i;
+		}
+
+		return max_root;
+	}
+
+	int PostProcessor::findRoot(std::vector<int>& parent, int i)
+	{
+		int root = i;
+		while (parent[root] != root) root = parent[root];
+		while (parent[i] != root)
+		{
+			int next = parent[i];
+			parent[i] = root;
+			i = next;
+		}
+		return root;
+	}
+
+	void PostProcessor::unite(std::vector<int>& parent, int i, int j)
+	{
+		i = findRoot(parent, i);
+		j = findRoot(parent, j);
+		if (i < j) parent[j] = i;
+		else if (j < i) parent[i] = j;
+	}
+
+}   // namespace face_seg
@@ -0,0 +1,109 @@
+#include "face_seg/server_protocol.h"
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace face_seg
+{
+	SharedMemory::~SharedMemory()
+	{
+		close();
+	}
+
+	void SharedMemory::create(const std::string& name, size_t size)
+	{
+		close();
+		int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if (fd < 0)
+			throw std::runtime_error("Failed to create shared memory \"" + name + "\": " + strerror(errno));
+		if (ftruncate(fd, (off_t)size) != 0)
+		{
+			::close(fd);
+			shm_unlink(name.c_str());
+			throw std::runtime_error("Failed to resize shared memory \"" + name + "\": " + strerror(errno));
+		}
+		m_name = name;
+		m_owner = true;
+		map(fd, size);
+	}
+
+	void SharedMemory::open(const std::string& name, size_t size)
+	{
+		close();
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if (fd < 0)
+			throw std::runtime_error("Failed to open shared memory \"" + name + "\": " + strerror(errno));
+
+		// Don't trust the requested size, the mapping must not exceed the object
+		struct stat st;
+		if (fstat(fd, &st) != 0 || (size_t)st.st_size < size)
+		{
+			::close(fd);
+			throw std::runtime_error("Shared memory \"" + name + "\" is smaller than requested!");
+		}
+		m_name = name;
+		map(fd, size);
+	}
+
+	void SharedMemory::map(int fd, size_t size)
+	{
+		void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (data == MAP_FAILED)
+		{
+			if (m_owner) shm_unlink(m_name.c_str());
+			m_owner = false;
+			throw std::runtime_error("Failed to map shared memory \"" + m_name + "\": " + strerror(errno));
+		}
+		m_data = (unsigned char*)data;
+		m_size = size;
+	}
+
+	void SharedMemory::close()
+	{
+		if (m_data != nullptr) munmap(m_data, m_size);
+		if (m_owner) shm_unlink(m_name.c_str());
+		m_data = nullptr;
+		m_size = 0;
+		m_name.clear();
+		m_owner = false;
+	}
+
+	bool sendAll(int fd, const void* data, size_t size)
+	{
+		const char* p = (const char*)data;
+		while (size > 0)
+		{
+			ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			p += n;
+			size -= (size_t)n;
+		}
+		return true;
+	}
+
+	bool recvAll(int fd, void* data, size_t size)
+	{
+		char* p = (char*)data;
+		while (size > 0)
+		{
+			ssize_t n = recv(fd, p, size, 0);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			p += n;
+			size -= (size_t)n;
+		}
+		return true;
+	}
+
+}   // namespace face_seg
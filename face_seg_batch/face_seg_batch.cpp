@@ -1,12 +1,17 @@
 // std
 #include <iostream>
+#include <fstream>
 #include <exception>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <set>
 
 // Boost
 #include <boost/program_options.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/format.hpp>
-#include <boost/regex.hpp>
 #include <boost/timer/timer.hpp>
 
 // OpenCV
@@ -16,7 +21,12 @@
 
 // face_seg
 #include <face_seg/face_seg.h>
+#include <face_seg/face_seg_pool.h>
 #include <face_seg/utilities.h>
+#include <face_seg/bounded_queue.h>
+#include <face_seg/mask_archive.h>
+#include <face_seg/image_source.h>
+#include "result_cache.h"
 
 #if WITH_FIND_FACE_LANDMARKS
 // sfl
@@ -32,75 +42,114 @@ using std::runtime_error;
 using namespace boost::program_options;
 using namespace boost::filesystem;
 
-const std::string IMAGE_FILTER =
-"(.*\\.(bmp|dib|jpeg|jpg|jpe|jp2|png|pbm|pgm|ppm|sr|ras))";
+/** Get the path of an image relative to the input directory, without the
+root and without "." and ".." elements, so it stays inside the output directory.
+*/
+path relativeImagePath(const string& img_path, const string& input_dir)
+{
+    path rel(img_path);
+    if (!input_dir.empty() && img_path.compare(0, input_dir.size(), input_dir) == 0)
+        rel = img_path.substr(input_dir.size());
+    path out;
+    for (const path& elem : rel.relative_path())
+        if (elem != "." && elem != ".." && elem != "/") out /= elem;
+    return out;
+}
 
-void getImagesFromDir(const std::string& dir_path, std::vector<std::string>& img_paths)
+void logError(std::ofstream& log, const string& img_path,
+    const string& msg, bool write_to_file = true)
 {
-    boost::regex filter(IMAGE_FILTER);
-    boost::smatch what;
-    directory_iterator end_itr; // Default ctor yields past-the-end
-    for (directory_iterator it(dir_path); it != end_itr; ++it)
+    std::cerr << "Error: " << msg << std::endl;
+    if (write_to_file)
     {
-        // Skip if not a file
-        if (!boost::filesystem::is_regular_file(it->status())) continue;
-
-        // Get extension
-        std::string ext = it->path().extension().string();
-        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-
-        // Skip if no match
-        if (!boost::regex_match(ext, what, filter)) continue;
-
-        img_paths.push_back(it->path().string());
+        log << img_path << ",Error: " << msg << std::endl;
     }
 }
 
-void readImageListFromFile(const std::string& csv_file, std::vector<string>& img_paths)
+/** Image passed between the pipeline stages.
+*/
+struct PipelineItem
 {
-    std::ifstream file(csv_file);
     string img_path;
-    while (file.good())
+    string output_path;
+    cv::Mat img;
+    cv::Mat seg;
+    std::vector<cv::Rect> rois;   ///< Face regions, when segmenting all the faces
+    uint64_t key = 0;             ///< Result cache key
+    std::vector<uchar> encoded;   ///< Encoded segmentation, when found in the cache
+    const face_seg::ImageShard* shard = nullptr;  ///< Shard holding the source image, if any
+    size_t shard_index = 0;       ///< Index of the source image in its shard
+    cv::Size original_size;       ///< Full resolution size of the source image
+    cv::Size decoded_size;        ///< Size the source image was decoded at
+    std::vector<uchar> source_data;  ///< Encoded source image, to decode it again at a higher resolution
+};
+
+/** Accumulated processing time of a pipeline stage.
+*/
+struct StageStats
+{
+    std::atomic<unsigned long long> wall_ns{ 0 };
+    std::atomic<size_t> items{ 0 };
+
+    void add(const boost::timer::cpu_timer& timer, size_t n = 1)
     {
-        std::getline(file, img_path, '\n');
-        if (img_path.empty()) return;
-        img_paths.push_back(img_path);
+        wall_ns += (unsigned long long)timer.elapsed().wall;
+        items += n;
     }
+};
+
+void printStageStats(const string& name, const StageStats& stats, unsigned int threads)
+{
+    double total = stats.wall_ns*1.0e-9;
+    double per_item = stats.items > 0 ? total / stats.items : 0.0;
+    std::cout << boost::format("%-14s %8d images %10.3fs total %10.3fms per image (%d threads)") %
+        name % stats.items % total % (per_item*1.0e3) % threads << std::endl;
 }
 
-void logError(std::ofstream& log, const string& img_path,
-    const string& msg, bool write_to_file = true)
+template<typename T>
+void printQueueStats(const string& name, const face_seg::BoundedQueue<T>& queue)
 {
-    std::cerr << "Error: " << msg << std::endl;
-    if (write_to_file)
-    {
-        log << img_path << ",Error: " << msg << std::endl;
-    }
+    std::cout << boost::format("%-14s average depth %.2f, max depth %d / %d") %
+        name % queue.averageDepth() % queue.maxDepth() % queue.capacity() << std::endl;
 }
 
 int main(int argc, char* argv[])
 {
 	// Parse command line arguments
     string inputPath;
-	string outputPath, modelPath, deployPath, landmarks_path;
-    string logPath, cfgPath;
-    unsigned int verbose, gpu_device_id;
-	bool scale, postprocess, with_gpu;
+	string outputPath, modelPath, deployPath, landmarks_path, faces, engine;
+    string logPath, cachePath, cfgPath;
+    unsigned int verbose, gpu_device_id, batch_size, cache_size;
+    unsigned int decoders, encoders, queue_size, instances, tile, tile_overlap;
+	bool scale, postprocess, with_gpu, reduced_decode, full_size_mask;
 	try {
 		options_description desc("Allowed options");
 		desc.add_options()
 			("help,h", "display the help message")
             ("verbose,v", value<unsigned int>(&verbose)->default_value(0), "output debug information")
-            ("input,i", value<string>(&inputPath)->required(), "path to input directory or image list")
-            ("output,o", value<string>(&outputPath)->required(), "output directory")
+            ("input,i", value<string>(&inputPath)->required(), "path to input directory, image shard (.tar) or list of images and shards")
+            ("output,o", value<string>(&outputPath)->required(), "output directory or mask archive (.fsma)")
             ("model,m", value<string>(&modelPath)->required(), "path to network weights model file (.caffemodel)")
             ("deploy,d", value<string>(&deployPath)->required(), "path to deploy prototxt file")
 			("scale,s", value<bool>(&scale)->default_value(true), "toggle scale image to network size")
 			("postprocess,p", value<bool>(&postprocess)->default_value(false), "toggle segmentation postprocessing")
 			("gpu", value<bool>(&with_gpu)->default_value(true), "toggle GPU / CPU")
 			("gpu_id", value<unsigned int>(&gpu_device_id)->default_value(0), "GPU's device id")
+			("engine", value<string>(&engine)->default_value(face_seg::inferenceEngines().front()), "inference engine: caffe or opencv (OpenCV's DNN module)")
 			("landmarks,l", value<string>(&landmarks_path)->default_value(""), "path to landmarks model for face cropping")
+			("faces", value<string>(&faces)->default_value("main"), "faces to segment with landmarks: main (cropped mask), all (merged mask) or labeled (mask of face numbers)")
+			("reduced_decode", value<bool>(&reduced_decode)->default_value(false), "toggle decoding JPEG images at the lowest resolution the network needs")
+			("full_size_mask", value<bool>(&full_size_mask)->default_value(false), "toggle upsampling masks of reduced images to the full resolution")
+			("tile", value<unsigned int>(&tile)->default_value(0), "segment larger images in native resolution in overlapping tiles of this size (requires scale 0), 0 to disable")
+			("tile_overlap", value<unsigned int>(&tile_overlap)->default_value(64), "overlap between neighboring tiles in pixels")
+			("batch_size,b", value<unsigned int>(&batch_size)->default_value(1), "number of images per forward pass")
+			("instances", value<unsigned int>(&instances)->default_value(1), "number of network instances sharing the same weights")
+			("decoders", value<unsigned int>(&decoders)->default_value(2), "number of image decoding threads")
+			("encoders", value<unsigned int>(&encoders)->default_value(2), "number of segmentation encoding threads")
+			("queue_size", value<unsigned int>(&queue_size)->default_value(16), "maximum number of images waiting between stages")
             ("log", value<string>(&logPath)->default_value("face_seg_batch_log.csv"), "log file path")
+			("cache", value<string>(&cachePath)->default_value(""), "result cache directory, results are reused by image content")
+			("cache_size", value<unsigned int>(&cache_size)->default_value(1024), "maximum result cache size in MB")
             ("cfg", value<string>(&cfgPath)->default_value("face_seg_batch.cfg"), "configuration file (.cfg)")
 			;
 		variables_map vm;
@@ -120,13 +169,21 @@ int main(int argc, char* argv[])
         notify(vm);
 
         if (!(is_regular_file(inputPath) || is_directory(inputPath)))
-            throw error("input must be a path to input directory or image pairs list!");
-        if (!is_directory(outputPath))
-            throw error("output must be a path to a directory!");
+            throw error("input must be a path to input directory, image shard or image list!");
+        if (!is_directory(outputPath) && path(outputPath).extension() != ".fsma")
+            throw error("output must be a path to a directory or a mask archive (.fsma)!");
         if (!is_regular_file(modelPath)) throw error("model must be a path to a file!");
         if (!is_regular_file(deployPath)) throw error("deploy must be a path to a file!");
 		if (!landmarks_path.empty() && !is_regular_file(landmarks_path))
 			throw error("landmarks must be a path to a file!");
+		if (faces != "main" && faces != "all" && faces != "labeled")
+			throw error("faces must be main, all or labeled!");
+		if (tile > 0 && scale) throw error("tile requires scale to be disabled!");
+		if (tile > 0 && tile_overlap >= tile) throw error("tile_overlap must be smaller than tile!");
+		if (batch_size == 0) throw error("batch_size must be greater than 0!");
+		if (instances == 0) throw error("instances must be greater than 0!");
+		if (decoders == 0) throw error("decoders must be greater than 0!");
+		if (encoders == 0) throw error("encoders must be greater than 0!");
 	}
 	catch (const error& e) {
         cerr << "Error while parsing command-line arguments: " << e.what() << endl;
@@ -142,7 +199,11 @@ int main(int argc, char* argv[])
             log.open(logPath);
 
 		// Initialize face segmentation
-		face_seg::FaceSeg fs(deployPath, modelPath, with_gpu, gpu_device_id, scale, postprocess);
+		auto fs = std::make_shared<face_seg::FaceSeg>(deployPath, modelPath,
+			with_gpu, gpu_device_id, scale, postprocess, engine);
+		if (tile > 0) fs->setTiling(cv::Size(tile, tile), (int)tile_overlap);
+		std::unique_ptr<face_seg::FaceSegPool> fs_pool;
+		if (instances > 1) fs_pool.reset(new face_seg::FaceSegPool(fs, instances));
 
 #if WITH_FIND_FACE_LANDMARKS
 		// Initialize sequence face landmarks
@@ -151,97 +212,448 @@ int main(int argc, char* argv[])
 			_sfl = sfl::SequenceFaceLandmarks::create(landmarks_path);
 #endif	// WITH_FIND_FACE_LANDMARKS
 
+		// Initialize the mask archive, if writing to one instead of PNG files
+		std::unique_ptr<face_seg::MaskArchiveWriter> archive;
+		if (!is_directory(outputPath))
+			archive.reset(new face_seg::MaskArchiveWriter(outputPath));
+		path outputDir = archive != nullptr ? path(outputPath).parent_path() : path(outputPath);
+
+		// Initialize result cache. The key of each result is the hash of the
+		// decoded image, seeded by everything else the result depends on
+		std::unique_ptr<ResultCache> cache;
+		uint64_t config_key = 0;
+		if (!cachePath.empty())
+		{
+			cache.reset(new ResultCache(cachePath, (size_t)cache_size << 20));
+			config_key = ResultCache::hashFile(modelPath);
+			config_key = ResultCache::hashFile(deployPath, config_key);
+			if (!landmarks_path.empty()) config_key = ResultCache::hashFile(landmarks_path, config_key);
+			string options = (boost::format("engine=%s scale=%d postprocess=%d landmarks=%d faces=%s reduced=%d full_size=%d") %
+				engine % scale % postprocess % !landmarks_path.empty() % faces % reduced_decode % full_size_mask).str();
+			if (tile > 0) options += (boost::format(" tile=%d overlap=%d") % tile % tile_overlap).str();
+			config_key = ResultCache::hash(options.data(), options.size(), config_key);
+		}
+
 		// Initialize timer
 		boost::timer::cpu_timer timer;
 		float seg_delta_time = 0.0f, lms_delta_time = 0.0f;
 
-        // Parse images
-        std::vector<string> img_paths;
+        // Parse images. Shards, given directly or in the list, are mapped and
+        // expanded to the images inside them
+        std::vector<string> input_paths;
         if (is_directory(inputPath))
-            getImagesFromDir(inputPath, img_paths);
-        else readImageListFromFile(inputPath, img_paths);
-        
-        // For each image
-        string prev_src_path, prev_tgt_path;
-        cv::Mat source_img, target_img, rendered_img;
-        for (const string& img_path : img_paths)
+            face_seg::listImageFiles(inputPath, input_paths);
+        else if (face_seg::ImageShard::isImageShard(inputPath))
+            input_paths.push_back(inputPath);
+        else face_seg::readImageList(inputPath, input_paths);
+
+        // Expand the shards to the images inside them
+        struct InputImage
+        {
+            string img_path;
+            const face_seg::ImageShard* shard;
+            size_t shard_index;
+        };
+        std::vector<std::unique_ptr<face_seg::ImageShard>> shards;
+        std::vector<InputImage> input_images;
+        for (const string& input_path : input_paths)
         {
-            // Check if output image already exists
-            path outputName = (path(img_path).stem() += ".png");
-            string currOutputPath = (path(outputPath) /= outputName).string();
-            if (is_regular_file(currOutputPath))
+            if (!face_seg::ImageShard::isImageShard(input_path))
+            {
+                input_images.push_back({ input_path, nullptr, 0 });
+                continue;
+            }
+            shards.emplace_back(new face_seg::ImageShard(input_path));
+            const face_seg::ImageShard& shard = *shards.back();
+            for (size_t i = 0; i < shard.size(); ++i)
+                input_images.push_back({ input_path + "/" + shard.name(i), &shard, i });
+        }
+
+        // PNG outputs are named by the image's name. Images whose names are
+        // shared by other images are written to their path relative to the
+        // input directory instead, keeping their extension (e.g. "a/b.jpg.png")
+        std::map<string, size_t> stem_counts;
+        if (archive == nullptr)
+            for (const InputImage& input : input_images)
+                ++stem_counts[path(input.img_path).stem().string()];
+        string input_dir = is_directory(inputPath) ? inputPath : string();
+        size_t renamed = 0;
+
+        // Skip images that already have an output, unless the result cache
+        // decides by content
+        std::vector<PipelineItem> jobs;
+        std::set<string> output_paths;
+        for (const InputImage& input : input_images)
+        {
+            // Check if output image already exists, archives are keyed by the image path
+            path outputName = (path(input.img_path).stem() += ".png");
+            if (archive == nullptr && stem_counts[path(input.img_path).stem().string()] > 1)
+            {
+                outputName = (relativeImagePath(input.img_path, input_dir) += ".png");
+                ++renamed;
+            }
+            string currOutputPath = (path(outputDir) /= outputName).string();
+            if (!output_paths.insert(archive != nullptr ? input.img_path : currOutputPath).second)
+            {
+                std::cout << "Skipping duplicate: " << input.img_path << std::endl;
+                continue;
+            }
+            bool exists = archive != nullptr ? archive->contains(input.img_path) : is_regular_file(currOutputPath);
+            if (cache == nullptr && exists)
             {
                 std::cout << "Skipping: " << outputName << std::endl;
                 continue;
             }
-            std::cout << "Face segmenting: " << outputName << std::endl;
+            if (archive == nullptr && outputName.has_parent_path())
+                create_directories(path(currOutputPath).parent_path());
+            PipelineItem job;
+            job.img_path = input.img_path;
+            job.output_path = currOutputPath;
+            job.shard = input.shard;
+            job.shard_index = input.shard_index;
+            jobs.push_back(std::move(job));
+        }
+        if (renamed > 0)
+            std::cout << renamed << " images share their names with other images, " <<
+                "their outputs are named by their relative paths." << std::endl;
+
+        // Initialize pipeline: decoders -> segmentation -> encoders
+        face_seg::BoundedQueue<PipelineItem> decode_queue(queue_size), encode_queue(queue_size);
+        StageStats decode_stats, lms_stats, seg_stats, encode_stats;
+        std::mutex out_mutex;
+        std::vector<std::thread> workers;
+        auto stopWorkers = [&]()
+        {
+            decode_queue.close();
+            encode_queue.close();
+            for (std::thread& worker : workers)
+                if (worker.joinable()) worker.join();
+        };
+
+        // Decoder threads. Reduced images keep their encoded data when cropped
+        // by landmarks, in case the face needs a higher resolution
+        cv::Size min_decode_size = reduced_decode ? fs->inputSize() : cv::Size();
+        bool keep_source_data = reduced_decode && !landmarks_path.empty();
+        std::atomic<size_t> next_job(0);
+        std::atomic<unsigned int> active_decoders(decoders);
+        for (unsigned int t = 0; t < decoders; ++t)
+        {
+            workers.emplace_back([&]()
+            {
+                boost::timer::cpu_timer stage_timer;
+                for (size_t i = next_job++; i < jobs.size(); i = next_job++)
+                {
+                    PipelineItem& item = jobs[i];
+
+                    // Read source image, shard images are decoded from the mapping
+                    stage_timer.start();
+                    try
+                    {
+                        if (item.shard != nullptr && reduced_decode)
+                            item.img = face_seg::decodeImageReduced(item.shard->data(item.shard_index),
+                                item.shard->dataSize(item.shard_index), min_decode_size, &item.original_size);
+                        else if (item.shard != nullptr)
+                            item.img = item.shard->decode(item.shard_index);
+                        else if (reduced_decode)
+                            item.img = face_seg::readImageReduced(item.img_path, min_decode_size,
+                                &item.original_size, keep_source_data ? &item.source_data : nullptr);
+                        else item.img = cv::imread(item.img_path);
+                    }
+                    catch (const cv::Exception&) {}
+                    item.decoded_size = item.img.size();
+                    if (!reduced_decode) item.original_size = item.decoded_size;
+
+                    // Look up the result, hits skip the segmentation
+                    bool cached = false;
+                    if (cache != nullptr && !item.img.empty())
+                    {
+                        item.key = ResultCache::hashImage(item.img, config_key);
+                        cached = cache->lookup(item.key, item.encoded);
+                    }
+                    stage_timer.stop();
+                    decode_stats.add(stage_timer);
+
+                    if (!(cached ? encode_queue : decode_queue).push(std::move(item))) break;
+                }
+                if (--active_decoders == 0) decode_queue.close();
+            });
+        }
 
-			// Read source image
-            cv::Mat source_img = cv::imread(img_path);
+        // Encoder threads
+        for (unsigned int t = 0; t < encoders; ++t)
+        {
+            workers.emplace_back([&]()
+            {
+                boost::timer::cpu_timer stage_timer;
+                PipelineItem item;
+                while (encode_queue.pop(item))
+                {
+                    // Write output to file
+                    stage_timer.start();
+                    bool written = false;
+                    try
+                    {
+                        // Encode, unless the result was found in the cache. The
+                        // archive run-length encodes the masks itself
+                        bool cached = !item.encoded.empty();
+                        if (!cached && full_size_mask && item.decoded_size != item.original_size)
+                        {
+                            // Upsample the mask of a reduced image to the original image's coordinates
+                            cv::Size seg_size(
+                                cvRound(item.seg.cols * (double)item.original_size.width / item.decoded_size.width),
+                                cvRound(item.seg.rows * (double)item.original_size.height / item.decoded_size.height));
+                            cv::resize(item.seg, item.seg, seg_size, 0, 0, cv::INTER_NEAREST);
+                        }
+                        if (!cached && (archive == nullptr || cache != nullptr) &&
+                            cv::imencode(".png", item.seg, item.encoded) && cache != nullptr)
+                            cache->insert(item.key, item.encoded);
+                        else if (cached && (archive != nullptr || verbose > 0))
+                            item.seg = cv::imdecode(item.encoded, cv::IMREAD_GRAYSCALE);
+                        if (archive != nullptr)
+                        {
+                            if (!item.seg.empty()) archive->append(item.img_path, item.seg);
+                            written = !item.seg.empty();
+                        }
+                        else if (!item.encoded.empty())
+                        {
+                            std::ofstream file(item.output_path, std::ios::binary);
+                            file.write((const char*)item.encoded.data(), item.encoded.size());
+                            written = file.good();
+                        }
+
+                        // Debug, cached results of face crops can't be rendered
+                        // without the landmarks
+                        if (verbose > 0 && item.seg.size() == item.img.size())
+                        {
+                            // Write rendered image
+                            cv::Mat debug_render_img = item.img.clone();
+                            face_seg::renderSegmentationBlend(debug_render_img, item.seg > 0);
+                            string debug_render_path = (path(item.output_path).parent_path() /=
+                                (path(item.output_path).stem() += "_debug.jpg")).string();
+                            cv::imwrite(debug_render_path, debug_render_img);
+                        }
+                    }
+                    catch (const std::exception&) {}
+                    stage_timer.stop();
+                    encode_stats.add(stage_timer);
+
+                    std::lock_guard<std::mutex> lock(out_mutex);
+                    if (!written)
+                    {
+                        logError(log, item.img_path, "Failed to write segmentation!", verbose);
+                        continue;
+                    }
+                    std::cout << "Writing " << path(item.output_path).filename() <<
+                        (archive != nullptr ? " to mask archive." : " to output directory.") << std::endl;
+                }
+            });
+        }
+
+        try
+        {
+            // Pending images for the next forward pass
+            std::vector<PipelineItem> batch;
+            auto processPending = [&]()
+            {
+                if (batch.empty()) return;
+
+                // Images with face regions are a batch of their own
+                std::vector<cv::Mat> batch_imgs;
+                std::vector<size_t> batch_indices, region_indices;
+                for (size_t i = 0; i < batch.size(); ++i)
+                {
+                    if (!batch[i].rois.empty()) region_indices.push_back(i);
+                    else
+                    {
+                        batch_imgs.push_back(batch[i].img);
+                        batch_indices.push_back(i);
+                    }
+                }
+                bool labeled = faces == "labeled";
+
+                // Start measuring time
+                timer.start();
+
+                // Do face segmentation
+                std::vector<cv::Mat> segs(batch.size());
+                if (fs_pool != nullptr)
+                {
+                    // Split the images between the instances
+                    std::vector<std::future<std::vector<cv::Mat>>> futures;
+                    for (size_t i = 0; i < batch_imgs.size(); i += batch_size)
+                    {
+                        futures.push_back(fs_pool->submitBatch(std::vector<cv::Mat>(
+                            batch_imgs.begin() + i,
+                            batch_imgs.begin() + std::min(i + batch_size, batch_imgs.size()))));
+                    }
+                    std::vector<std::future<cv::Mat>> region_futures;
+                    for (size_t i : region_indices)
+                        region_futures.push_back(fs_pool->submitRegions(batch[i].img, batch[i].rois, labeled));
+                    size_t n = 0;
+                    for (auto& f : futures)
+                    {
+                        for (cv::Mat& seg : f.get())
+                            segs[batch_indices[n++]] = seg;
+                    }
+                    for (size_t i = 0; i < region_indices.size(); ++i)
+                        segs[region_indices[i]] = region_futures[i].get();
+                }
+                else
+                {
+                    for (size_t i : region_indices)
+                        fs->processRegions(batch[i].img, batch[i].rois, segs[i], labeled);
+                    if (batch_imgs.size() == 1) segs[batch_indices[0]] = fs->process(batch_imgs[0]);
+                    else if (batch_imgs.size() > 1)
+                    {
+                        std::vector<cv::Mat> batch_segs = fs->processBatch(batch_imgs);
+                        for (size_t i = 0; i < batch_segs.size(); ++i)
+                            segs[batch_indices[i]] = batch_segs[i];
+                    }
+                }
+
+                // Stop measuring time
+                timer.stop();
+                seg_stats.add(timer, batch.size());
+
+                // Pass the segmentations to the encoders
+                for (size_t i = 0; i < batch.size(); ++i)
+                {
+                    if (segs[i].empty())
+                    {
+                        std::lock_guard<std::mutex> lock(out_mutex);
+                        logError(log, batch[i].img_path, "Face segmentation failed!", verbose);
+                        continue;
+                    }
+                    batch[i].seg = segs[i];
+                    encode_queue.push(std::move(batch[i]));
+                }
+
+                // Print current timing (per image)
+                float delta_time = float(timer.elapsed().wall*1.0e-9) / batch.size();
+                seg_delta_time += (delta_time - seg_delta_time)*0.1f;
+                std::lock_guard<std::mutex> lock(out_mutex);
+                std::cout << "Segmentation timing = " << seg_delta_time << "s (" <<
+                    (1.0f / seg_delta_time) << " fps)" << std::endl;
+                if (verbose > 0)
+                {
+                    std::cout << "Queue depths: decoded = " << decode_queue.size() <<
+                        ", segmented = " << encode_queue.size() << std::endl;
+                }
+
+                batch.clear();
+            };
+
+            // For each decoded image
+            PipelineItem item;
+            while (decode_queue.pop(item))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(out_mutex);
+                    std::cout << "Face segmenting: " << path(item.output_path).filename() << std::endl;
+                    if (item.img.empty())
+                    {
+                        logError(log, item.img_path, "Failed to read image!", verbose);
+                        continue;
+                    }
+                }
 
 #if WITH_FIND_FACE_LANDMARKS
-			// Crop source image
-			if (_sfl != nullptr)
-			{
-				// Start measuring time
-				timer.start();
-
-				_sfl->clear();
-				const sfl::Frame& lmsFrame = _sfl->addFrame(source_img);
-				if (lmsFrame.faces.empty())
-				{
-					logError(log, img_path, "Failed to find a face in the image!", verbose);
-					continue;
-				}
-				const sfl::Face* face = lmsFrame.getFace(sfl::getMainFaceID(_sfl->getSequence()));
-				cv::Rect bbox = sfl::getFaceBBoxFromLandmarks(face->landmarks, source_img.size(), true);
-				source_img = source_img(bbox).clone();
-
-				// Stop measuring time
-				timer.stop();
-
-				// Print current timing statistics
-				lms_delta_time += (timer.elapsed().wall*1.0e-9 - lms_delta_time)*0.1f;
-				std::cout << "Landmarks timing = " << lms_delta_time << "s (" << 
-					(1.0f / lms_delta_time) << " fps)" << std::endl;
-			}
+                // Crop source image
+                if (_sfl != nullptr)
+                {
+                    // Start measuring time
+                    timer.start();
+
+                    _sfl->clear();
+                    const sfl::Frame& lmsFrame = _sfl->addFrame(item.img);
+                    if (lmsFrame.faces.empty())
+                    {
+                        std::lock_guard<std::mutex> lock(out_mutex);
+                        logError(log, item.img_path, "Failed to find a face in the image!", verbose);
+                        continue;
+                    }
+                    if (faces == "main")
+                    {
+                        const sfl::Face* face = lmsFrame.getFace(sfl::getMainFaceID(_sfl->getSequence()));
+                        item.rois.push_back(sfl::getFaceBBoxFromLandmarks(face->landmarks, item.img.size(), true));
+                    }
+                    else
+                    {
+                        for (const auto& face : lmsFrame.faces)
+                            item.rois.push_back(sfl::getFaceBBoxFromLandmarks(face->landmarks, item.img.size(), true));
+                    }
+
+                    // Faces smaller than the network's input in the reduced image
+                    // are cropped from an image decoded at a higher resolution
+                    if (reduced_decode && item.decoded_size != item.original_size)
+                    {
+                        const uchar* data = item.shard != nullptr ?
+                            item.shard->data(item.shard_index) : item.source_data.data();
+                        size_t size = item.shard != nullptr ?
+                            item.shard->dataSize(item.shard_index) : item.source_data.size();
+                        if (face_seg::decodeImageForRegions(data, size, fs->inputSize(), item.img, item.rois))
+                            item.decoded_size = item.img.size();
+                    }
+                    std::vector<uchar>().swap(item.source_data);
+                    if (faces == "main")
+                    {
+                        item.img = item.img(item.rois[0]);
+                        item.rois.clear();
+                    }
+
+                    // Stop measuring time
+                    timer.stop();
+                    lms_stats.add(timer);
+
+                    // Print current timing statistics
+                    lms_delta_time += (timer.elapsed().wall*1.0e-9 - lms_delta_time)*0.1f;
+                    std::lock_guard<std::mutex> lock(out_mutex);
+                    std::cout << "Landmarks timing = " << lms_delta_time << "s (" << 
+                        (1.0f / lms_delta_time) << " fps)" << std::endl;
+                }
 #endif	// WITH_FIND_FACE_LANDMARKS
 
-			// Start measuring time
-			timer.start();
-
-			// Do face segmentation
-			cv::Mat seg = fs.process(source_img);
-			if (seg.empty()) 
-			{
-				logError(log, img_path, "Face segmentation failed!", verbose);
-				continue;
-			}
-
-			// Stop measuring time
-			timer.stop();
-
-            // Write output to file
-            std::cout << "Writing " << outputName << " to output directory." << std::endl;
-            cv::imwrite(currOutputPath, seg);
-
-			// Print current timing
-			seg_delta_time += (timer.elapsed().wall*1.0e-9 - seg_delta_time)*0.1f;
-			std::cout << "Segmentation timing = " << seg_delta_time << "s (" <<
-				(1.0f / seg_delta_time) << " fps)" << std::endl;
-
-            // Debug
-            if (verbose > 0)
-            {
-                // Write rendered image
-				cv::Mat debug_render_img = source_img.clone();
-				face_seg::renderSegmentationBlend(debug_render_img, seg);
-                string debug_render_path = (path(outputPath) /=
-                    (path(currOutputPath).stem() += "_debug.jpg")).string();
-                cv::imwrite(debug_render_path, debug_render_img);
+                // Add to the pending batch
+                batch.push_back(std::move(item));
+                if (batch.size() >= batch_size * instances) processPending();
             }
+
+            // Process remaining images
+            processPending();
         }
-	}
+        catch (...)
+        {
+            stopWorkers();
+            throw;
+        }
+        stopWorkers();
+
+        // Print pipeline statistics
+        std::cout << "Pipeline statistics:" << std::endl;
+        printStageStats("decode", decode_stats, decoders);
+        if (lms_stats.items > 0) printStageStats("landmarks", lms_stats, 1);
+        printStageStats("segmentation", seg_stats, instances);
+        printStageStats("encode", encode_stats, encoders);
+        printQueueStats("decode queue", decode_queue);
+        printQueueStats("encode queue", encode_queue);
+        if (archive != nullptr)
+        {
+            archive->close();
+            std::cout << "Mask archive: " << archive->size() << " masks" << std::endl;
+        }
+        if (cache != nullptr)
+        {
+            cache->save();
+            std::cout << boost::format("Result cache: %d hits, %d misses, %d evictions, %d entries (%.1f MB)") %
+                cache->hits() % cache->misses() % cache->evictions() % cache->entries() %
+                (cache->bytes() / 1048576.0) << std::endl;
+        }
+        if (!scale && fs_pool == nullptr)
+        {
+            std::cout << "Reshape cache: " << fs->reshapeCacheHits() << " hits, " <<
+                fs->reshapeCacheMisses() << " misses" << std::endl;
+        }
+    }
 	catch (std::exception& e)
 	{
 		cerr << e.what() << endl;
@@ -0,0 +1,222 @@
+#include "result_cache.h"
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <boost/filesystem.hpp>
+
+using namespace boost::filesystem;
+
+static const char* INDEX_FILE = "index.txt";
+
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uchar* p)
+{
+	uint64_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	return rotl(acc, 31) * PRIME1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v)
+{
+	acc ^= round64(0, v);
+	return acc * PRIME1 + PRIME4;
+}
+
+ResultCache::ResultCache(const std::string& dir, size_t max_bytes) :
+	m_dir(dir), m_max_bytes(max_bytes)
+{
+	create_directories(dir);
+
+	// Read the index, least recently used first, skipping missing results
+	std::ifstream index((path(dir) / INDEX_FILE).string());
+	unsigned long long key, size;
+	while (index >> std::hex >> key >> std::dec >> size)
+	{
+		if (m_index.count(key) > 0 || !is_regular_file(entryPath(key))) continue;
+		m_lru.push_front({ key, (size_t)size });
+		m_index[key] = m_lru.begin();
+		m_bytes += (size_t)size;
+	}
+	evict();
+}
+
+ResultCache::~ResultCache()
+{
+	try { save(); }
+	catch (...) {}
+}
+
+bool ResultCache::lookup(uint64_t key, std::vector<uchar>& data)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	auto it = m_index.find(key);
+	if (it == m_index.end())
+	{
+		++m_misses;
+		return false;
+	}
+	m_lru.splice(m_lru.begin(), m_lru, it->second);
+	lock.unlock();
+
+	// Read the result outside the lock, a concurrent eviction shows up as a miss
+	std::ifstream file(entryPath(key), std::ios::binary);
+	data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	lock.lock();
+	if (data.empty()) ++m_misses;
+	else ++m_hits;
+	return !data.empty();
+}
+
+void ResultCache::insert(uint64_t key, const std::vector<uchar>& data)
+{
+	if (data.size() > m_max_bytes) return;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_index.count(key) > 0) return;
+	}
+
+	// Write to a temporary file first, so a partial result is never visible
+	std::string file_path = entryPath(key);
+	std::string tmp_path = file_path + ".tmp";
+	{
+		std::ofstream file(tmp_path, std::ios::binary);
+		file.write((const char*)data.data(), data.size());
+		if (!file.good()) return;
+	}
+	boost::system::error_code ec;
+	rename(tmp_path, file_path, ec);
+	if (ec) return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_index.count(key) > 0) return;
+	m_lru.push_front({ key, data.size() });
+	m_index[key] = m_lru.begin();
+	m_bytes += data.size();
+	evict();
+}
+
+void ResultCache::evict()
+{
+	while (m_bytes > m_max_bytes && !m_lru.empty())
+	{
+		const Entry& entry = m_lru.back();
+		boost::system::error_code ec;
+		remove(entryPath(entry.key), ec);
+		m_bytes -= entry.size;
+		m_index.erase(entry.key);
+		m_lru.pop_back();
+		++m_evictions;
+	}
+}
+
+void ResultCache::save()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::string index_path = (path(m_dir) / INDEX_FILE).string();
+	std::string tmp_path = index_path + ".tmp";
+	{
+		std::ofstream index(tmp_path);
+		for (auto it = m_lru.rbegin(); it != m_lru.rend(); ++it)
+			index << std::hex << (unsigned long long)it->key << std::dec << " " << it->size << "\n";
+		if (!index.good()) return;
+	}
+	rename(tmp_path, index_path);
+}
+
+size_t ResultCache::entries() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_lru.size();
+}
+
+size_t ResultCache::bytes() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_bytes;
+}
+
+std::string ResultCache::entryPath(uint64_t key) const
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.png", (unsigned long long)key);
+	return (path(m_dir) / name).string();
+}
+
+uint64_t ResultCache::hash(const void* data, size_t size, uint64_t seed)
+{
+	const uchar* p = (const uchar*)data;
+	const uchar* end = p + size;
+	uint64_t h;
+
+	// Four independent lanes over 32 byte stripes
+	if (size >= 32)
+	{
+		uint64_t v1 = seed + PRIME1 + PRIME2, v2 = seed + PRIME2, v3 = seed, v4 = seed - PRIME1;
+		for (; p + 32 <= end; p += 32)
+		{
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+		}
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge64(h, v1);
+		h = merge64(h, v2);
+		h = merge64(h, v3);
+		h = merge64(h, v4);
+	}
+	else h = seed + PRIME5;
+	h += size;
+
+	// Tail
+	for (; p + 8 <= end; p += 8)
+		h = rotl(h ^ round64(0, read64(p)), 27) * PRIME1 + PRIME4;
+	for (; p < end; ++p)
+		h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+	// Avalanche
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t ResultCache::hashFile(const std::string& file_path, uint64_t seed)
+{
+	std::ifstream file(file_path, std::ios::binary);
+	if (!file.is_open()) return 0;
+	std::vector<char> buf(1 << 20);
+	uint64_t h = seed;
+	while (file.read(buf.data(), buf.size()) || file.gcount() > 0)
+		h = hash(buf.data(), (size_t)file.gcount(), h);
+	return h;
+}
+
+uint64_t ResultCache::hashImage(const cv::Mat& img, uint64_t seed)
+{
+	int header[3] = { img.rows, img.cols, img.type() };
+	uint64_t h = hash(header, sizeof(header), seed);
+	size_t row_size = img.cols * img.elemSize();
+	if (img.isContinuous()) return hash(img.data, row_size * img.rows, h);
+	for (int r = 0; r < img.rows; ++r)
+		h = hash(img.ptr(r), row_size, h);
+	return h;
+}
@@ -0,0 +1,94 @@
+/** @file
+@brief On-disk cache of segmentation results, addressed by content.
+*/
+
+#ifndef FACE_SEG_BATCH_RESULT_CACHE_H
+#define FACE_SEG_BATCH_RESULT_CACHE_H
+
+// std
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+/**	Cache of encoded segmentation masks in a directory.
+	Each result is stored in its own file named by its key, which should hash
+	everything the result depends on: the decoded image, the model and the
+	options. An index file keeps the entries in least recently used order,
+	and the least recently used entries are evicted when the total size
+	exceeds the limit. All the methods are thread safe.
+*/
+class ResultCache
+{
+public:
+	/**	Open a cache directory, creating it if it doesn't exist.
+		@param dir Cache directory.
+		@param max_bytes Maximum total size of the cached results.
+	*/
+	ResultCache(const std::string& dir, size_t max_bytes);
+
+	/**	Save the index.
+	*/
+	~ResultCache();
+
+	/**	Get a cached result.
+		@param key Result key.
+		@param data Output encoded result.
+		@return true if the result was found.
+	*/
+	bool lookup(uint64_t key, std::vector<uchar>& data);
+
+	/**	Add a result, evicting the least recently used results if needed.
+		@param key Result key.
+		@param data Encoded result.
+	*/
+	void insert(uint64_t key, const std::vector<uchar>& data);
+
+	/**	Write the index file.
+	*/
+	void save();
+
+	size_t hits() const { return m_hits; }
+	size_t misses() const { return m_misses; }
+	size_t evictions() const { return m_evictions; }
+	size_t entries() const;
+	size_t bytes() const;
+
+	/**	64-bit hash of a buffer (a variant of xxHash64).
+	*/
+	static uint64_t hash(const void* data, size_t size, uint64_t seed = 0);
+
+	/**	Hash of a file's content, 0 if the file can't be read.
+	*/
+	static uint64_t hashFile(const std::string& file_path, uint64_t seed = 0);
+
+	/**	Hash of an image's pixels, size and type.
+	*/
+	static uint64_t hashImage(const cv::Mat& img, uint64_t seed = 0);
+
+private:
+	struct Entry
+	{
+		uint64_t key;
+		size_t size;
+	};
+
+	std::string entryPath(uint64_t key) const;
+	void evict();
+
+private:
+	std::string m_dir;
+	size_t m_max_bytes;
+	std::list<Entry> m_lru;		// Most recently used first
+	std::unordered_map<uint64_t, std::list<Entry>::iterator> m_index;
+	size_t m_bytes = 0;
+	size_t m_hits = 0, m_misses = 0, m_evictions = 0;
+	mutable std::mutex m_mutex;
+};
+
+#endif // FACE_SEG_BATCH_RESULT_CACHE_H
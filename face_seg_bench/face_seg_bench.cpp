@@ -0,0 +1,654 @@
+// std
+#include <iostream>
+#include <fstream>
+#include <exception>
+#include <chrono>
+#include <map>
+#include <numeric>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/algorithm/string.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui.hpp>
+
+// face_seg
+#include <face_seg/face_seg.h>
+#include <face_seg/utilities.h>
+#include <face_seg/postprocess.h>
+#include <face_seg/image_source.h>
+
+#if WITH_FIND_FACE_LANDMARKS
+// sfl
+#include <sfl/sequence_face_landmarks.h>
+#include <sfl/utilities.h>
+#endif	// WITH_FIND_FACE_LANDMARKS
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+typedef std::chrono::steady_clock Clock;
+
+// The benchmarked stages, in processing order
+const std::vector<string> STAGES = { "decode", "landmarks", "preprocess", "forward",
+	"argmax", "postprocess", "upsample", "encode", "total" };
+
+/** Read a whole file to memory, so decoding is measured without the disk.
+*/
+std::vector<uchar> readFile(const string& file_path)
+{
+	std::ifstream file(file_path, std::ios::binary);
+	if (!file.is_open()) throw runtime_error("Failed to read \"" + file_path + "\"!");
+	return std::vector<uchar>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+/** Create a synthetic face image: a skin colored ellipse over a textured background.
+*/
+cv::Mat createSyntheticImage(const cv::Size& size, int index)
+{
+	cv::Mat img(size, CV_8UC3);
+	cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+	cv::GaussianBlur(img, img, cv::Size(0, 0), 3.0);
+	cv::Point center(size.width / 2 + (index % 5 - 2) * size.width / 40, size.height / 2);
+	cv::ellipse(img, center, cv::Size(size.width * 3 / 10, size.height * 4 / 10), 0, 0, 360,
+		cv::Scalar(120, 150, 200), -1);
+	cv::ellipse(img, center - cv::Point(size.width / 8, size.height / 10),
+		cv::Size(size.width / 20, size.height / 40), 0, 0, 360, cv::Scalar(40, 40, 40), -1);
+	cv::ellipse(img, center + cv::Point(size.width / 8, -size.height / 10),
+		cv::Size(size.width / 20, size.height / 40), 0, 0, 360, cv::Scalar(40, 40, 40), -1);
+	return img;
+}
+
+/** Create a synthetic segmentation: a face with a hole and a few specks.
+*/
+cv::Mat createSyntheticMask(const cv::Size& size)
+{
+	cv::Mat seg = cv::Mat::zeros(size, CV_8U);
+	cv::Point center(size.width / 2, size.height / 2);
+	cv::ellipse(seg, center, cv::Size(size.width * 3 / 10, size.height * 4 / 10), 0, 0, 360,
+		cv::Scalar(255), -1);
+	cv::circle(seg, center, std::max(size.width / 20, 1), cv::Scalar(0), -1);
+	for (int i = 1; i <= 4; ++i)
+		cv::circle(seg, cv::Point(i * size.width / 5, size.height / 12),
+			std::max(size.width / 100, 1), cv::Scalar(255), -1);
+	return seg;
+}
+
+/** Create a random mask for the postprocessing parity test. The masks cycle
+	through blurred noise (many components and holes), copies of a single
+	random shape (ties between the largest components), specks of different
+	values, foreground touching the image borders, and a face with a hole.
+*/
+cv::Mat createRandomMask(cv::RNG& rng, int index)
+{
+	cv::Size size(rng.uniform(1, 128), rng.uniform(1, 128));
+	cv::Mat seg = cv::Mat::zeros(size, CV_8U);
+	switch (index % 5)
+	{
+	case 0:
+	{
+		cv::Mat noise(size, CV_32F);
+		cv::randu(noise, cv::Scalar(0), cv::Scalar(1));
+		cv::GaussianBlur(noise, noise, cv::Size(0, 0), rng.uniform(0.5, 3.0));
+		double min_val, max_val;
+		cv::minMaxLoc(noise, &min_val, &max_val);
+		seg.setTo(cv::Scalar(rng.uniform(1, 256)), noise > min_val + rng.uniform(0.2, 0.9) * (max_val - min_val));
+		break;
+	}
+	case 1:
+	{
+		int s = rng.uniform(1, 6);
+		cv::Mat shape(s, s, CV_8U);
+		cv::randu(shape, cv::Scalar(0), cv::Scalar(2));
+		shape.at<uchar>(0, 0) = 1;
+		shape *= 255;
+		for (int y = 0; y + s < size.height; y += s + rng.uniform(1, 4))
+			for (int x = 0; x + s < size.width; x += s + rng.uniform(1, 4))
+			{
+				cv::Mat dst = seg(cv::Rect(x, y, s, s));
+				if (rng.uniform(0.0, 1.0) < 0.6) shape.copyTo(dst);
+			}
+		break;
+	}
+	case 2:
+	{
+		cv::Mat values(size, CV_8U), specks(size, CV_32F);
+		cv::randu(values, cv::Scalar(1), cv::Scalar(256));
+		cv::randu(specks, cv::Scalar(0), cv::Scalar(1));
+		values.copyTo(seg, specks < rng.uniform(0.01, 0.6));
+		break;
+	}
+	case 3:
+	{
+		cv::randu(seg, cv::Scalar(0), cv::Scalar(2));
+		seg *= 255;
+		seg.row(0).setTo(cv::Scalar(255));
+		seg.col(0).setTo(cv::Scalar(255));
+		break;
+	}
+	default:
+		seg = createSyntheticMask(size);
+	}
+	return seg;
+}
+
+/** The OpenCV based postprocessing that PostProcessor replaces, the reference
+	of the postprocessing parity test.
+*/
+namespace reference
+{
+	void removeSmallerComponents(cv::Mat& seg)
+	{
+		cv::Mat labels;
+		cv::Mat stats, centroids;
+		cv::connectedComponentsWithStats(seg, labels, stats, centroids);
+		if (stats.rows <= 2) return;
+
+		// Find the label of the connected component with maximum area
+		cv::Mat areas = stats.colRange(4, 5).clone();
+		int* areas_data = (int*)areas.data;
+		int max_label = (int)std::distance(areas_data,
+			std::max_element(areas_data + 1, areas_data + stats.rows));
+
+		// Clear smaller components
+		seg.setTo(cv::Scalar(0), labels != max_label);
+	}
+
+	void smoothFlaws(cv::Mat& seg, int smooth_iterations, int smooth_kernel_radius)
+	{
+		int kernel_size = smooth_kernel_radius * 2 + 1;
+		cv::Mat kernel = cv::getStructuringElement(
+			cv::MorphShapes::MORPH_ELLIPSE, cv::Size(kernel_size, kernel_size));
+		cv::morphologyEx(seg, seg, cv::MORPH_OPEN, kernel, cv::Point(-1, -1), smooth_iterations);
+		cv::morphologyEx(seg, seg, cv::MORPH_CLOSE, kernel, cv::Point(-1, -1), smooth_iterations);
+	}
+
+	void fillHoles(cv::Mat& seg)
+	{
+		double min_val, max_val;
+		cv::minMaxLoc(seg, &min_val, &max_val);
+		cv::Mat holes = seg.clone();
+		cv::floodFill(holes, cv::Point2i(0, 0), cv::Scalar(max_val));
+		seg.setTo(cv::Scalar(max_val), holes == 0);
+	}
+
+	void postprocessSegmentation(cv::Mat& seg)
+	{
+		removeSmallerComponents(seg);
+		fillHoles(seg);
+		smoothFlaws(seg, 1, 2);
+		removeSmallerComponents(seg);
+		fillHoles(seg);
+	}
+}
+
+/** Compare PostProcessor with the reference postprocessing on a mask.
+	@return The number of postprocessing functions whose results differ.
+*/
+int comparePostprocessing(face_seg::PostProcessor& pp, const cv::Mat& seg)
+{
+	const std::vector<std::pair<std::function<void(cv::Mat&)>, std::function<void(cv::Mat&)>>> functions = {
+		{ [&](cv::Mat& m) { pp.filterComponents(m, true, false); }, reference::removeSmallerComponents },
+		{ [&](cv::Mat& m) { pp.filterComponents(m, false, true); }, reference::fillHoles },
+		{ [&](cv::Mat& m) { pp.smooth(m, 1, 2); }, [](cv::Mat& m) { reference::smoothFlaws(m, 1, 2); } },
+		{ [&](cv::Mat& m) { pp.process(m); }, reference::postprocessSegmentation },
+	};
+
+	int mismatches = 0;
+	cv::Mat result, expected;
+	for (auto& f : functions)
+	{
+		seg.copyTo(result);
+		seg.copyTo(expected);
+		f.first(result);
+		f.second(expected);
+		if (cv::countNonZero(result != expected) > 0) ++mismatches;
+	}
+	return mismatches;
+}
+
+/** Collection of timing samples, in seconds.
+*/
+class Samples
+{
+public:
+	void add(double t) { m_values.push_back(t); m_sorted = false; }
+
+	size_t size() const { return m_values.size(); }
+
+	double sum() const { return std::accumulate(m_values.begin(), m_values.end(), 0.0); }
+
+	double mean() const { return m_values.empty() ? 0.0 : sum() / m_values.size(); }
+
+	/** Get the p'th percentile (nearest rank).
+	*/
+	double percentile(double p)
+	{
+		if (m_values.empty()) return 0.0;
+		if (!m_sorted) std::sort(m_values.begin(), m_values.end());
+		m_sorted = true;
+		size_t rank = (size_t)std::ceil(p / 100.0 * m_values.size());
+		return m_values[std::min(std::max(rank, (size_t)1), m_values.size()) - 1];
+	}
+
+private:
+	std::vector<double> m_values;
+	bool m_sorted = false;
+};
+
+double elapsed(const Clock::time_point& start)
+{
+	return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void printStats(const string& name, Samples& samples, double pixels = 0.0)
+{
+	cout << boost::format("%-32s %7.3fms p50 %7.3fms p95 %7.3fms p99 %9.1f/s") %
+		name % (samples.percentile(50) * 1.0e3) % (samples.percentile(95) * 1.0e3) %
+		(samples.percentile(99) * 1.0e3) % (samples.mean() > 0 ? 1.0 / samples.mean() : 0.0);
+	if (pixels > 0 && samples.mean() > 0)
+		cout << boost::format(" %8.1f Mpix/s") % (pixels * 1.0e-6 / samples.mean());
+	cout << endl;
+}
+
+/** Quote and escape a string for JSON.
+*/
+string jsonString(const string& str)
+{
+	string quoted = "\"";
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\') quoted += string("\\") + c;
+		else if ((unsigned char)c < 0x20) quoted += (boost::format("\\u%04x") % (int)c).str();
+		else quoted += c;
+	}
+	return quoted + "\"";
+}
+
+void writeStatsJson(std::ostream& out, Samples& samples)
+{
+	out << boost::format("{\"samples\": %d, \"mean_ms\": %.4f, \"p50_ms\": %.4f, "
+		"\"p95_ms\": %.4f, \"p99_ms\": %.4f, \"throughput\": %.3f}") %
+		samples.size() % (samples.mean() * 1.0e3) % (samples.percentile(50) * 1.0e3) %
+		(samples.percentile(95) * 1.0e3) % (samples.percentile(99) * 1.0e3) %
+		(samples.mean() > 0 ? 1.0 / samples.mean() : 0.0);
+}
+
+/** Microbenchmark result of a single function at a single resolution.
+*/
+struct MicroResult
+{
+	string function;
+	cv::Size size;
+	Samples samples;
+};
+
+/** Benchmark the utility functions at several resolutions.
+*/
+std::vector<MicroResult> runMicrobenchmarks(const std::vector<int>& sizes, int reps)
+{
+	typedef std::function<void(cv::Mat& img, cv::Mat& seg)> Function;
+	const std::vector<std::pair<string, Function>> functions = {
+		{ "renderSegmentationBlend", [](cv::Mat& img, cv::Mat& seg) { face_seg::renderSegmentationBlend(img, seg); } },
+		{ "removeSmallerComponents", [](cv::Mat&, cv::Mat& seg) { face_seg::removeSmallerComponents(seg); } },
+		{ "fillHoles", [](cv::Mat&, cv::Mat& seg) { face_seg::fillHoles(seg); } },
+		{ "smoothFlaws", [](cv::Mat&, cv::Mat& seg) { face_seg::smoothFlaws(seg); } },
+		{ "postprocessSegmentation", [](cv::Mat&, cv::Mat& seg) { face_seg::postprocessSegmentation(seg); } },
+	};
+
+	std::vector<MicroResult> results;
+	for (int s : sizes)
+	{
+		cv::Size size(s, s);
+		cv::Mat src_img = createSyntheticImage(size, 0), src_seg = createSyntheticMask(size);
+		for (auto& f : functions)
+		{
+			results.push_back({ f.first, size, Samples() });
+			cv::Mat img, seg;
+			for (int i = 0; i < reps + 1; ++i)
+			{
+				src_img.copyTo(img);
+				src_seg.copyTo(seg);
+				Clock::time_point start = Clock::now();
+				f.second(img, seg);
+				if (i > 0) results.back().samples.add(elapsed(start));	// Skip the warm up
+			}
+		}
+	}
+
+	return results;
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string inputPath, outputPath, modelPath, deployPath, landmarks_path, engine, parity_engine, cfgPath;
+	string synthetic_size_str, micro_sizes_str, metricsPath;
+	unsigned int gpu_device_id, synthetic_count, iterations, warmup, micro_reps, postprocess_parity;
+	float parity_tolerance;
+	bool scale, postprocess, with_gpu, micro, micro_only;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("input,i", value<string>(&inputPath)->default_value(""), "image directory or list file, synthetic images are used if empty")
+			("output,o", value<string>(&outputPath)->default_value(""), "path to output results file (.json)")
+			("model,m", value<string>(&modelPath), "path to network weights model file  (.caffemodel)")
+			("deploy,d", value<string>(&deployPath), "path to network definition file for deployment (.prototxt)")
+			("scale,s", value<bool>(&scale)->default_value(true), "toggle scale image to network size")
+			("postprocess,p", value<bool>(&postprocess)->default_value(false), "toggle segmentation postprocessing")
+			("gpu", value<bool>(&with_gpu)->default_value(true), "toggle GPU / CPU")
+			("gpu_id", value<unsigned int>(&gpu_device_id)->default_value(0), "GPU's device id")
+			("engine", value<string>(&engine)->default_value(face_seg::inferenceEngines().front()), "inference engine: caffe or opencv (OpenCV's DNN module)")
+			("landmarks,l", value<string>(&landmarks_path)->default_value(""), "path to landmarks model for face cropping")
+			("parity", value<string>(&parity_engine)->default_value(""), "compare the masks of each image with another inference engine")
+			("parity_tolerance", value<float>(&parity_tolerance)->default_value(0.5f), "maximum percentage of differing mask pixels per image in the parity test")
+			("postprocess_parity", value<unsigned int>(&postprocess_parity)->default_value(0), "compare the postprocessing with the OpenCV based reference on this many random masks and on the masks of the input images, 0 to disable")
+			("metrics", value<string>(&metricsPath)->default_value(""), "path to output per layer and per stage histograms, as JSON (.json) or Prometheus text format (other extensions)")
+			("synthetic_size", value<string>(&synthetic_size_str)->default_value("300x300"), "synthetic image size (WxH)")
+			("synthetic_count", value<unsigned int>(&synthetic_count)->default_value(16), "number of synthetic images")
+			("iterations,n", value<unsigned int>(&iterations)->default_value(5), "number of passes over the images")
+			("warmup", value<unsigned int>(&warmup)->default_value(3), "number of initial images excluded from the results")
+			("micro", value<bool>(&micro)->default_value(true), "toggle microbenchmarks of the utility functions")
+			("micro_only", value<bool>(&micro_only)->default_value(false), "run only the microbenchmarks, no model is required")
+			("micro_sizes", value<string>(&micro_sizes_str)->default_value("256,512,1024,2048"), "microbenchmark resolutions")
+			("micro_reps", value<unsigned int>(&micro_reps)->default_value(20), "microbenchmark repetitions per function and resolution")
+			("cfg", value<string>(&cfgPath)->default_value("face_seg_bench.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("input", -1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: face_seg_bench [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (!micro_only)
+		{
+			if (!inputPath.empty() && !is_directory(inputPath) && !is_regular_file(inputPath))
+				throw error("input must be a path to a directory or a list file!");
+			if (!is_regular_file(modelPath)) throw error("model must be a path to a file!");
+			if (!is_regular_file(deployPath)) throw error("deploy must be a path to a file!");
+			if (!landmarks_path.empty() && !is_regular_file(landmarks_path))
+				throw error("landmarks must be a path to a file!");
+		}
+		if (iterations == 0) throw error("iterations must be greater than 0!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		std::map<string, Samples> stages;
+		size_t image_count = 0;
+		double wall_time = 0.0;
+		bool parity_failed = false;
+		face_seg::PostProcessor pp;
+		size_t postprocess_masks = 0, postprocess_mismatches = 0;
+
+		if (!micro_only)
+		{
+			// Initialize face segmentation
+			face_seg::FaceSeg fs(deployPath, modelPath, with_gpu, gpu_device_id, scale, postprocess, engine);
+			std::shared_ptr<face_seg::Instrumentation> instrumentation;
+			if (!metricsPath.empty())
+			{
+				instrumentation = std::make_shared<face_seg::Instrumentation>();
+				fs.setInstrumentation(instrumentation);
+			}
+
+#if WITH_FIND_FACE_LANDMARKS
+			// Initialize sequence face landmarks
+			std::shared_ptr<sfl::SequenceFaceLandmarks> _sfl;
+			if (!landmarks_path.empty())
+				_sfl = sfl::SequenceFaceLandmarks::create(landmarks_path);
+#endif	// WITH_FIND_FACE_LANDMARKS
+
+			// Reference for the parity test, on the CPU so that it only depends on the engine
+			std::unique_ptr<face_seg::FaceSeg> parity_fs;
+			if (!parity_engine.empty())
+				parity_fs.reset(new face_seg::FaceSeg(deployPath, modelPath, false, 0, scale, postprocess, parity_engine));
+
+			// Load the encoded images to memory
+			std::vector<std::vector<uchar>> encoded_imgs;
+			if (inputPath.empty())
+			{
+				int w = 0, h = 0;
+				if (sscanf(synthetic_size_str.c_str(), "%dx%d", &w, &h) != 2 || w <= 0 || h <= 0)
+					throw runtime_error("Invalid synthetic image size \"" + synthetic_size_str + "\"!");
+				for (unsigned int i = 0; i < synthetic_count; ++i)
+				{
+					encoded_imgs.emplace_back();
+					cv::imencode(".jpg", createSyntheticImage(cv::Size(w, h), i), encoded_imgs.back());
+				}
+			}
+			else
+			{
+				std::vector<string> img_paths;
+				if (is_directory(inputPath))
+				{
+					face_seg::listImageFiles(inputPath, img_paths);
+					std::sort(img_paths.begin(), img_paths.end());
+				}
+				else face_seg::readImageList(inputPath, img_paths);
+				for (const string& img_path : img_paths)
+					encoded_imgs.push_back(readFile(img_path));
+			}
+			if (encoded_imgs.empty()) throw runtime_error("No input images!");
+
+			// Decode an image and crop its face
+			auto prepareImage = [&](size_t index, std::map<string, double>& times)
+			{
+				Clock::time_point t = Clock::now();
+				cv::Mat img = cv::imdecode(encoded_imgs[index], cv::IMREAD_COLOR);
+				if (img.empty()) throw runtime_error("Failed to decode image!");
+				times["decode"] = elapsed(t);
+
+#if WITH_FIND_FACE_LANDMARKS
+				// Crop the face
+				t = Clock::now();
+				if (_sfl != nullptr)
+				{
+					_sfl->clear();
+					const sfl::Frame& lmsFrame = _sfl->addFrame(img);
+					if (!lmsFrame.faces.empty())
+					{
+						const sfl::Face* face = lmsFrame.getFace(sfl::getMainFaceID(_sfl->getSequence()));
+						img = img(sfl::getFaceBBoxFromLandmarks(face->landmarks, img.size(), true));
+					}
+					times["landmarks"] = elapsed(t);
+				}
+#endif	// WITH_FIND_FACE_LANDMARKS
+
+				return img;
+			};
+
+			// For each image
+			std::vector<uchar> encoded_seg;
+			cv::Mat seg;
+			size_t total_count = encoded_imgs.size() * iterations;
+			Clock::time_point wall_start = Clock::now();
+			for (size_t i = 0; i < total_count; ++i)
+			{
+				if (i == warmup)
+				{
+					wall_start = Clock::now();
+					if (instrumentation != nullptr) instrumentation->reset();
+				}
+				std::map<string, double> times;
+				Clock::time_point start = Clock::now(), t = start;
+
+				// Decode and crop
+				cv::Mat img = prepareImage(i % encoded_imgs.size(), times);
+
+				// Do face segmentation, reusing the output mask
+				fs.process(img, seg);
+				const face_seg::StageTimings& timings = fs.lastTimings();
+				times["preprocess"] = timings.preprocess;
+				times["forward"] = timings.forward;
+				times["argmax"] = timings.argmax;
+				times["postprocess"] = timings.postprocess;
+				times["upsample"] = timings.upsample;
+
+				// Encode
+				t = Clock::now();
+				cv::imencode(".png", seg, encoded_seg);
+				times["encode"] = elapsed(t);
+				times["total"] = elapsed(start);
+
+				if (i < warmup) continue;
+				for (auto& time : times) stages[time.first].add(time.second);
+				++image_count;
+			}
+			wall_time = elapsed(wall_start);
+
+			// Print results
+			cout << boost::format("%d images, %.3fs, %.2f images/s") % image_count %
+				wall_time % (wall_time > 0 ? image_count / wall_time : 0.0) << endl;
+			for (const string& stage : STAGES)
+				if (stages.count(stage)) printStats(stage, stages[stage]);
+
+			// Write the per layer histograms
+			if (instrumentation != nullptr)
+			{
+				for (const string& layer : instrumentation->layerNames())
+				{
+					face_seg::Histogram h = instrumentation->layer(layer);
+					cout << boost::format("  %-30s %7.3fms p50 %7.3fms p99") % layer %
+						(h.percentile(50) * 1.0e3) % (h.percentile(99) * 1.0e3) << endl;
+				}
+				if (path(metricsPath).extension() == ".json") instrumentation->writeJson(metricsPath);
+				else instrumentation->writePrometheus(metricsPath);
+			}
+
+			// Parity tests, after the timed run: the fraction of mask pixels of
+			// each image that differ between the engines, and the postprocessing
+			// of each mask compared with the reference
+			if (parity_fs != nullptr || postprocess_parity > 0)
+			{
+				fs.setInstrumentation(nullptr);
+				Samples parity_diffs;
+				cv::Mat parity_seg;
+				std::map<string, double> times;
+				for (size_t i = 0; i < encoded_imgs.size(); ++i)
+				{
+					cv::Mat img = prepareImage(i, times);
+					fs.process(img, seg);
+					if (postprocess_parity > 0)
+					{
+						postprocess_mismatches += comparePostprocessing(pp, seg);
+						++postprocess_masks;
+					}
+					if (parity_fs == nullptr) continue;
+					parity_fs->process(img, parity_seg);
+					parity_diffs.add((double)cv::countNonZero(seg != parity_seg) / seg.total());
+				}
+				if (parity_fs != nullptr)
+				{
+					double max_diff = parity_diffs.percentile(100) * 100.0;
+					cout << boost::format("parity %s vs %s: %.4f%% mean, %.4f%% max differing pixels (tolerance %.4f%%)") %
+						engine % parity_engine % (parity_diffs.mean() * 100.0) % max_diff % parity_tolerance << endl;
+					parity_failed = max_diff > parity_tolerance;
+				}
+			}
+		}
+
+		// Postprocessing parity test on random masks
+		if (postprocess_parity > 0)
+		{
+			cv::RNG rng(0x5EED);
+			for (unsigned int i = 0; i < postprocess_parity; ++i)
+				postprocess_mismatches += comparePostprocessing(pp, createRandomMask(rng, (int)i));
+			postprocess_masks += postprocess_parity;
+			cout << boost::format("postprocess parity: %d masks, %d mismatching results") %
+				postprocess_masks % postprocess_mismatches << endl;
+			if (postprocess_mismatches > 0) parity_failed = true;
+		}
+
+		// Microbenchmarks
+		std::vector<MicroResult> micro_results;
+		if (micro || micro_only)
+		{
+			std::vector<string> size_strs;
+			std::vector<int> sizes;
+			boost::split(size_strs, micro_sizes_str, boost::is_any_of(","));
+			for (const string& s : size_strs)
+				if (!s.empty()) sizes.push_back(std::stoi(s));
+			micro_results = runMicrobenchmarks(sizes, std::max(micro_reps, 1u));
+			for (auto& r : micro_results)
+				printStats((boost::format("%s %dx%d") % r.function % r.size.width % r.size.height).str(),
+					r.samples, (double)r.size.area());
+		}
+
+		// Write results
+		if (!outputPath.empty())
+		{
+			std::ofstream out(outputPath);
+			if (!out.is_open()) throw runtime_error("Failed to write \"" + outputPath + "\"!");
+			out << std::boolalpha;
+			out << "{\n  \"config\": {\"input\": " <<
+				jsonString(inputPath.empty() ? "synthetic" : path(inputPath).generic_string()) <<
+				", \"scale\": " << scale << ", \"postprocess\": " << postprocess <<
+				", \"gpu\": " << with_gpu << ", \"landmarks\": " << !landmarks_path.empty() <<
+				", \"engine\": " << jsonString(engine) << "},\n";
+			out << "  \"images\": " << image_count << ",\n";
+			out << "  \"wall_s\": " << wall_time << ",\n";
+			out << "  \"throughput\": " << (wall_time > 0 ? image_count / wall_time : 0.0) << ",\n";
+			out << "  \"stages\": {";
+			bool first = true;
+			for (const string& stage : STAGES)
+			{
+				if (!stages.count(stage)) continue;
+				out << (first ? "\n" : ",\n") << "    \"" << stage << "\": ";
+				writeStatsJson(out, stages[stage]);
+				first = false;
+			}
+			out << "\n  },\n  \"micro\": [";
+			for (size_t i = 0; i < micro_results.size(); ++i)
+			{
+				MicroResult& r = micro_results[i];
+				out << (i == 0 ? "\n" : ",\n") << "    {\"function\": " << jsonString(r.function) <<
+					", \"width\": " << r.size.width << ", \"height\": " << r.size.height << ", \"stats\": ";
+				writeStatsJson(out, r.samples);
+				out << "}";
+			}
+			out << "\n  ]\n}\n";
+		}
+		if (parity_failed)
+		{
+			cerr << "Parity test failed!" << endl;
+			return 1;
+		}
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
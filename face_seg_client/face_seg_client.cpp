@@ -0,0 +1,127 @@
+// std
+#include <iostream>
+#include <fstream>
+#include <exception>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui.hpp>
+
+// face_seg
+#include <face_seg/client.h>
+#include <face_seg/utilities.h>
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string inputPath, outputPath, socketPath, landmarks_path, faces, cfgPath;
+	unsigned int verbose;
+	bool crop;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("verbose,v", value<unsigned int>(&verbose)->default_value(0), "output debug information")
+			("input,i", value<string>(&inputPath)->required(), "image path")
+			("output,o", value<string>(&outputPath)->required(), "output segmentation path")
+			("socket", value<string>(&socketPath)->default_value(face_seg::DEFAULT_SERVER_SOCKET), "path to the server's Unix domain socket")
+			("landmarks,l", value<string>(&landmarks_path)->default_value(""), "crop the face using the server's landmarks model, the path itself is ignored")
+			("crop,c", value<bool>(&crop)->default_value(false), "crop the face using the server's landmarks model")
+			("faces", value<string>(&faces)->default_value("main"), "faces to segment with landmarks, only main (cropped mask) is supported")
+			("cfg", value<string>(&cfgPath)->default_value("face_seg_client.cfg"), "configuration file (.cfg)")
+			;
+
+		// Options of face_seg_image that are set by the server
+		options_description server_desc("Ignored options, set by the server");
+		server_desc.add_options()
+			("model,m", value<string>(), "path to network weights model file  (.caffemodel)")
+			("deploy,d", value<string>(), "path to network definition file for deployment (.prototxt)")
+			("scale,s", value<bool>(), "toggle scale image to network size")
+			("postprocess,p", value<bool>(), "toggle segmentation postprocessing")
+			("gpu", value<bool>(), "toggle GPU / CPU")
+			("gpu_id", value<unsigned int>(), "GPU's device id")
+			("engine", value<string>(), "inference engine")
+			;
+		desc.add(server_desc);
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("input", -1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: face_seg_client [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (!is_regular_file(inputPath)) throw error("input must be a path to an image!");
+		if (faces != "main") throw error("faces must be main, the server only segments the main face!");
+		crop = crop || !landmarks_path.empty();
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		// Connect to the server
+		face_seg::FaceSegClient client(socketPath);
+
+		// Read source image
+		cv::Mat source_img = cv::imread(inputPath);
+		if (source_img.empty()) throw runtime_error("Failed to read \"" + inputPath + "\"!");
+
+		// Do face segmentation
+		cv::Rect roi;
+		cv::Mat seg = client.process(source_img, crop, &roi);
+		if (seg.empty()) throw std::runtime_error("Face segmentation failed!");
+		source_img = source_img(roi);
+
+		// Write output to file
+		string filePath = outputPath;
+		if (is_directory(outputPath))
+		{
+			path outputName = (path(inputPath).stem() += ".png");
+			filePath = (path(outputPath) /= outputName).string();
+		}
+		cv::imwrite(filePath, seg);
+
+		// Debug
+		if (verbose > 0)
+		{
+			// Write rendered image
+			cv::Mat debug_render_img = source_img.clone();
+			face_seg::renderSegmentationBlend(debug_render_img, seg);
+			string debug_render_path = (path(filePath).parent_path() /=
+				(path(filePath).stem() += "_debug.jpg")).string();
+			cv::imwrite(debug_render_path, debug_render_img);
+		}
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,333 @@
+// std
+#include <iostream>
+#include <fstream>
+#include <exception>
+#include <chrono>
+#include <set>
+#include <algorithm>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+// OpenCV
+#include <opencv2/imgcodecs.hpp>
+
+// Caffe
+#include <caffe/caffe.hpp>
+
+// face_seg
+#include <face_seg/face_seg.h>
+#include <face_seg/kernels.h>
+#include <face_seg/model_cache.h>
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+typedef std::chrono::steady_clock Clock;
+
+/**	Weights blob.
+*/
+struct Weights
+{
+	std::vector<int> shape;
+	std::vector<float> data;
+};
+
+/**	Keep only some of the indices of an axis of a blob.
+*/
+static Weights slice(const Weights& w, int axis, const std::vector<int>& keep)
+{
+	size_t outer = 1, inner = 1;
+	for (int i = 0; i < axis; ++i) outer *= w.shape[i];
+	for (int i = axis + 1; i < (int)w.shape.size(); ++i) inner *= w.shape[i];
+
+	Weights out;
+	out.shape = w.shape;
+	out.shape[axis] = (int)keep.size();
+	out.data.reserve(outer * keep.size() * inner);
+	for (size_t o = 0; o < outer; ++o)
+		for (int k : keep)
+		{
+			const float* src = w.data.data() + (o * w.shape[axis] + k) * inner;
+			out.data.insert(out.data.end(), src, src + inner);
+		}
+	return out;
+}
+
+/**	Get the mean subtracted from each input channel, as computed by the
+	preprocessing of FaceSeg.
+*/
+static std::vector<float> inputMean(int channels)
+{
+	cv::Mat black = cv::Mat::zeros(1, 1, CV_8UC3);
+	std::vector<float> mean(channels);
+	face_seg::toPlanarFloat(black, mean.data(), channels, face_seg::FaceSeg::meanColor());
+	for (float& m : mean) m = -m;
+	return mean;
+}
+
+/**	Fold the mean subtraction into the bias of a convolution:
+	W * (x - mean) + b = W * x + (b - W * mean).
+*/
+static void foldMean(std::vector<Weights>& blobs, const std::vector<float>& mean)
+{
+	Weights& w = blobs[0];
+	Weights& b = blobs[1];
+	int out_channels = w.shape[0], in_channels = w.shape[1];
+	size_t kernel_size = w.data.size() / (out_channels * in_channels);
+	for (int o = 0; o < out_channels; ++o)
+		for (int i = 0; i < in_channels; ++i)
+		{
+			const float* kernel = w.data.data() + (o * in_channels + i) * kernel_size;
+			for (size_t k = 0; k < kernel_size; ++k)
+				b.data[o] -= kernel[k] * mean[i];
+		}
+}
+
+static bool hasPadding(const caffe::ConvolutionParameter& param)
+{
+	for (int i = 0; i < param.pad_size(); ++i)
+		if (param.pad(i) > 0) return true;
+	return param.pad_h() > 0 || param.pad_w() > 0;
+}
+
+/**	Rewrite a network with 21 classes into a network with 2 classes, the
+	background and the face, and optionally fold the mean subtraction into
+	the first convolution.
+*/
+static void compact(const string& deploy_file, const string& model_file,
+	const string& out_deploy_file, const string& out_model_file, bool fold_mean)
+{
+	caffe::NetParameter deploy;
+	caffe::ReadNetParamsFromTextFileOrDie(deploy_file, &deploy);
+	caffe::NetParameter net_param = deploy;
+	net_param.mutable_state()->set_phase(caffe::TEST);
+	caffe::Net<float> net(net_param);
+	net.CopyTrainedLayersFrom(model_file);
+	if (net.num_inputs() != 1 || net.num_outputs() != 1)
+		throw runtime_error("Network should have exactly one input and one output!");
+
+	// Keep the background and the channel FaceSeg reads the face from
+	const int num_classes = 21;
+	const std::vector<int> keep = { 0, 15 };
+	if (net.output_blobs()[0]->channels() != num_classes)
+		throw runtime_error("Only networks with 21 output channels can be compacted!");
+	const string& input_name = net.blob_names()[net.input_blob_indices()[0]];
+	const string& output_name = net.blob_names()[net.output_blob_indices()[0]];
+
+	// Follow the score channels through the network: layers with num_classes
+	// outputs start them, layers that keep the channels pass them on
+	static const std::set<string> CHANNELWISE_LAYERS = {
+		"Crop", "Dropout", "Eltwise", "Power", "ReLU", "Sigmoid", "Softmax", "Split", "TanH" };
+	std::set<string> sliced;
+	bool folded = false;
+	caffe::NetParameter weights_param;
+	for (int l = 0; l < deploy.layer_size(); ++l)
+	{
+		caffe::LayerParameter& layer = *deploy.mutable_layer(l);
+		const string& type = layer.type();
+
+		// The second input of Crop is only used for its shape
+		int bottoms = type == "Crop" ? std::min(layer.bottom_size(), 1) : layer.bottom_size();
+		int sliced_bottoms = 0;
+		for (int i = 0; i < bottoms; ++i) sliced_bottoms += (int)sliced.count(layer.bottom(i));
+		bool in_sliced = sliced_bottoms > 0;
+		if (in_sliced && sliced_bottoms != bottoms)
+			throw runtime_error("Layer \"" + layer.name() + "\" mixes score channels with other channels!");
+
+		// Copy the weights
+		std::vector<Weights> blobs;
+		if (net.has_layer(layer.name()))
+			for (const auto& blob : net.layer_by_name(layer.name())->blobs())
+				blobs.push_back({ blob->shape(), std::vector<float>(blob->cpu_data(),
+					blob->cpu_data() + blob->count()) });
+
+		bool out_sliced = in_sliced;
+		if (type == "Convolution" || type == "Deconvolution")
+		{
+			// Convolution weights are output x input channels, deconvolution
+			// weights are input x output channels
+			caffe::ConvolutionParameter& conv = *layer.mutable_convolution_param();
+			int group = conv.group();
+			int out_axis = type == "Convolution" ? 0 : 1;
+			out_sliced = (int)conv.num_output() == num_classes;
+			if (in_sliced && !out_sliced)
+				throw runtime_error("Layer \"" + layer.name() + "\" combines the score channels!");
+			if (out_sliced && group != 1 && !(in_sliced && group == num_classes))
+				throw runtime_error("Layer \"" + layer.name() + "\" has unsupported groups!");
+
+			if (out_sliced)
+			{
+				if (group == num_classes)
+				{
+					// One filter per channel
+					blobs[0] = slice(blobs[0], 0, keep);
+					conv.set_group((unsigned)keep.size());
+				}
+				else
+				{
+					blobs[0] = slice(blobs[0], out_axis, keep);
+					if (in_sliced) blobs[0] = slice(blobs[0], 1 - out_axis, keep);
+				}
+				if (blobs.size() > 1) blobs[1] = slice(blobs[1], 0, keep);
+				conv.set_num_output((unsigned)keep.size());
+			}
+
+			// Fold the mean into the first convolution
+			bool first = layer.bottom_size() == 1 && layer.bottom(0) == input_name;
+			if (fold_mean && first && type == "Convolution" && group == 1)
+			{
+				if (!conv.bias_term())
+				{
+					conv.set_bias_term(true);
+					blobs.push_back({ { blobs[0].shape[0] }, std::vector<float>(blobs[0].shape[0], 0.0f) });
+				}
+				foldMean(blobs, inputMean(blobs[0].shape[1]));
+				folded = true;
+				if (hasPadding(conv))
+					cerr << "Warning: \"" << layer.name() << "\" pads its input with zeros, " <<
+						"which no longer stand for the mean color, the scores near the borders may change." << endl;
+			}
+		}
+		else if (in_sliced && CHANNELWISE_LAYERS.count(type) == 0)
+			throw runtime_error("Layer \"" + layer.name() + "\" of type \"" + type + "\" can't be compacted!");
+
+		if (out_sliced)
+			for (int i = 0; i < layer.top_size(); ++i) sliced.insert(layer.top(i));
+		if (in_sliced || out_sliced)
+			cout << "compacting " << layer.name() << endl;
+
+		// Add the weights
+		if (blobs.empty()) continue;
+		caffe::LayerParameter* weights_layer = weights_param.add_layer();
+		weights_layer->CopyFrom(layer);
+		for (const Weights& w : blobs)
+		{
+			caffe::BlobProto* blob = weights_layer->add_blobs();
+			for (int d : w.shape) blob->mutable_shape()->add_dim(d);
+			for (float v : w.data) blob->add_data(v);
+		}
+	}
+	if (sliced.count(output_name) == 0)
+		throw runtime_error("The output of the network couldn't be compacted!");
+	if (fold_mean && !folded)
+		throw runtime_error("The input of the network isn't followed by a convolution, the mean can't be folded!");
+
+	// Tag the network, so FaceSeg won't subtract the mean
+	if (folded) deploy.set_name(deploy.name() + face_seg::FaceSeg::meanFoldedSuffix());
+	weights_param.set_name(deploy.name());
+	caffe::WriteProtoToTextFile(deploy, out_deploy_file);
+	caffe::WriteProtoToBinaryFile(weights_param, out_model_file);
+}
+
+/**	Segment an image and get the forward time in seconds.
+*/
+static double segment(face_seg::FaceSeg& fs, const cv::Mat& img, cv::Mat& seg, int iterations)
+{
+	fs.process(img, seg);	// Warm up
+	double forward = 0.0;
+	for (int i = 0; i < iterations; ++i)
+	{
+		fs.process(img, seg);
+		forward += fs.lastTimings().forward;
+	}
+	return forward / iterations;
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string outputPath, outputDeployPath, modelPath, deployPath, imagePath, cfgPath;
+	bool fold_mean, with_gpu;
+	unsigned int iterations;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("output,o", value<string>(&outputPath)->required(), "output network weights model file (.caffemodel)")
+			("output_deploy", value<string>(&outputDeployPath)->default_value(""), "output network definition file, next to the output model if empty")
+			("model,m", value<string>(&modelPath)->required(), "path to network weights model file  (.caffemodel)")
+			("deploy,d", value<string>(&deployPath)->required(), "path to network definition file for deployment (.prototxt)")
+			("fold_mean", value<bool>(&fold_mean)->default_value(false), "fold the mean subtraction into the first convolution (not exact if it pads its input)")
+			("image,i", value<string>(&imagePath)->default_value(""), "image for comparing the masks and forward times of both models")
+			("iterations", value<unsigned int>(&iterations)->default_value(10), "number of forward passes for comparing the forward times")
+			("gpu", value<bool>(&with_gpu)->default_value(false), "toggle GPU / CPU for the comparison")
+			("cfg", value<string>(&cfgPath)->default_value("face_seg_compact.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("output", -1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: face_seg_compact [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (!is_regular_file(modelPath)) throw error("model must be a path to a file!");
+		if (!is_regular_file(deployPath)) throw error("deploy must be a path to a file!");
+		if (face_seg::ModelCache::isModelCache(modelPath))
+			throw error("model is a compiled model cache, compact the original model instead!");
+		if (!imagePath.empty() && !is_regular_file(imagePath)) throw error("image must be a path to a file!");
+		if (iterations == 0) throw error("iterations must be positive!");
+		if (outputDeployPath.empty())
+		{
+			path output(outputPath);
+			outputDeployPath = (output.parent_path() /
+				(output.stem().string() + "_deploy.prototxt")).string();
+		}
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		// Compact
+		compact(deployPath, modelPath, outputDeployPath, outputPath, fold_mean);
+		cout << "Wrote \"" << outputDeployPath << "\" and \"" << outputPath << "\"" << endl;
+
+		// Compare the masks and the forward times
+		if (!imagePath.empty())
+		{
+			cv::Mat img = cv::imread(imagePath);
+			if (img.data == nullptr) throw runtime_error("Failed to read image \"" + imagePath + "\"!");
+			cv::Mat seg, compact_seg;
+			double forward, compact_forward;
+			{
+				face_seg::FaceSeg fs(deployPath, modelPath, with_gpu);
+				forward = segment(fs, img, seg, iterations);
+			}
+			{
+				face_seg::FaceSeg fs(outputDeployPath, outputPath, with_gpu);
+				compact_forward = segment(fs, img, compact_seg, iterations);
+			}
+			cv::Mat diff;
+			cv::compare(seg, compact_seg, diff, cv::CMP_NE);
+			cout << "Forward time: " << forward * 1000.0 << " ms for the model, " <<
+				compact_forward * 1000.0 << " ms for the compacted model" << endl;
+			cout << "Masks differ in " << 100.0 * cv::countNonZero(diff) / diff.total() <<
+				"% of the pixels" << endl;
+		}
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
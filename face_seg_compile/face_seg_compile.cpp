@@ -0,0 +1,103 @@
+// std
+#include <iostream>
+#include <fstream>
+#include <exception>
+#include <chrono>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+// face_seg
+#include <face_seg/face_seg.h>
+#include <face_seg/model_cache.h>
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+typedef std::chrono::steady_clock Clock;
+
+static double secondsSince(const Clock::time_point& t)
+{
+	return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string outputPath, modelPath, deployPath, cfgPath;
+	bool verify;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("output,o", value<string>(&outputPath)->required(), "output compiled model cache path")
+			("model,m", value<string>(&modelPath)->required(), "path to network weights model file  (.caffemodel)")
+			("deploy,d", value<string>(&deployPath)->required(), "path to network definition file for deployment (.prototxt)")
+			("verify", value<bool>(&verify)->default_value(true), "load the compiled model cache and compare the loading times")
+			("cfg", value<string>(&cfgPath)->default_value("face_seg_compile.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("output", -1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: face_seg_compile [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (!is_regular_file(modelPath)) throw error("model must be a path to a file!");
+		if (!is_regular_file(deployPath)) throw error("deploy must be a path to a file!");
+		if (face_seg::ModelCache::isModelCache(modelPath))
+			throw error("model is already a compiled model cache!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		// Compile
+		Clock::time_point t = Clock::now();
+		face_seg::ModelCache::compile(deployPath, modelPath, outputPath);
+		cout << "Compiled \"" << outputPath << "\" (" << file_size(outputPath) << " bytes) in " <<
+			secondsSince(t) << " s" << endl;
+
+		// Compare the loading times
+		if (verify)
+		{
+			t = Clock::now();
+			{
+				face_seg::FaceSeg fs(deployPath, modelPath, false);
+			}
+			double model_time = secondsSince(t);
+			t = Clock::now();
+			{
+				face_seg::FaceSeg fs(deployPath, outputPath, false);
+			}
+			double cache_time = secondsSince(t);
+			cout << "Loading time: " << model_time << " s from the model, " <<
+				cache_time << " s from the compiled model cache" << endl;
+		}
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
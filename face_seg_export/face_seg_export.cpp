@@ -0,0 +1,161 @@
+// std
+#include <iostream>
+#include <fstream>
+#include <exception>
+#include <map>
+#include <set>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+
+// face_seg
+#include <face_seg/mask_archive.h>
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+
+/**	Get the common parent directory of the keys.
+*/
+path commonDirectory(const face_seg::MaskArchiveReader& archive)
+{
+	path common;
+	for (size_t i = 0; i < archive.size(); ++i)
+	{
+		path dir = path(archive.key(i)).parent_path();
+		if (i == 0)
+		{
+			common = dir;
+			continue;
+		}
+		path prefix;
+		for (auto c = common.begin(), d = dir.begin(); c != common.end() && d != dir.end() && *c == *d; ++c, ++d)
+			prefix /= *c;
+		common = prefix;
+	}
+	return common;
+}
+
+/**	Get the path of a key relative to a directory, without the root and
+	without "." and ".." elements, so it stays inside the output directory.
+*/
+path relativeKeyPath(const string& key, const path& dir)
+{
+	path rel(key);
+	auto k = rel.begin();
+	for (auto d = dir.begin(); d != dir.end() && k != rel.end() && *k == *d; ++d) ++k;
+	path out;
+	for (; k != rel.end(); ++k)
+		if (*k != "." && *k != ".." && !k->has_root_path()) out /= *k;
+	return out;
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string inputPath, outputPath, key, cfgPath;
+	bool list;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("input,i", value<string>(&inputPath)->required(), "path to mask archive (.fsma)")
+			("output,o", value<string>(&outputPath)->default_value("."), "output directory")
+			("key,k", value<string>(&key)->default_value(""), "export only the mask of this key")
+			("list", value<bool>(&list)->default_value(false), "list the keys instead of exporting")
+			("cfg", value<string>(&cfgPath)->default_value("face_seg_export.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("input", -1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: face_seg_export [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (!is_regular_file(inputPath)) throw error("input must be a path to a mask archive!");
+		if (!list && !is_directory(outputPath)) throw error("output must be a path to a directory!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		face_seg::MaskArchiveReader archive(inputPath);
+
+		// Write a mask as <key stem>.png, like face_seg_batch does. Keys whose
+		// stems are shared by other keys are written to their path relative to
+		// the keys' common directory instead (e.g. "a/b.jpg.png")
+		std::map<string, size_t> stem_counts;
+		path keys_dir;
+		if (key.empty())
+		{
+			std::set<string> keys;
+			for (size_t i = 0; i < archive.size(); ++i)
+				if (keys.insert(archive.key(i)).second)
+					++stem_counts[path(archive.key(i)).stem().string()];
+			keys_dir = commonDirectory(archive);
+		}
+		cv::Mat mask;
+		auto exportMask = [&](const string& k)
+		{
+			path outputName = (path(k).stem() += ".png");
+			if (stem_counts[path(k).stem().string()] > 1)
+				outputName = (relativeKeyPath(k, keys_dir) += ".png");
+			string filePath = (path(outputPath) /= outputName).string();
+			if (outputName.has_parent_path()) create_directories(path(filePath).parent_path());
+			if (!cv::imwrite(filePath, mask))
+				throw runtime_error("Failed to write \"" + filePath + "\"!");
+			cout << "Writing " << outputName << " to output directory." << endl;
+		};
+
+		if (!key.empty())
+		{
+			if (!archive.read(key, mask)) throw runtime_error("\"" + key + "\" is not in the archive!");
+			if (list) cout << key << " " << mask.cols << "x" << mask.rows << endl;
+			else exportMask(key);
+			return 0;
+		}
+
+		// Keys appended more than once are written in append order, so the
+		// last mask of each key is the one that remains
+		for (size_t i = 0; i < archive.size(); ++i)
+		{
+			string k = archive.key(i);
+			if (list)
+			{
+				cout << k << endl;
+				continue;
+			}
+			archive.read(i, mask);
+			exportMask(k);
+		}
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -14,6 +14,7 @@
 // face_seg
 #include <face_seg/face_seg.h>
 #include <face_seg/utilities.h>
+#include <face_seg/image_source.h>
 
 #if WITH_FIND_FACE_LANDMARKS
 // sfl
@@ -33,9 +34,9 @@ using namespace boost::filesystem;
 int main(int argc, char* argv[])
 {
 	// Parse command line arguments
-	string inputPath, outputPath, modelPath, deployPath, landmarks_path, cfgPath;
-    unsigned int verbose, gpu_device_id;
-	bool scale, postprocess, with_gpu;
+	string inputPath, outputPath, modelPath, deployPath, landmarks_path, faces, engine, cfgPath;
+    unsigned int verbose, gpu_device_id, tile, tile_overlap;
+	bool scale, postprocess, with_gpu, reduced_decode, full_size_mask;
 	try {
 		options_description desc("Allowed options");
 		desc.add_options()
@@ -49,7 +50,13 @@ int main(int argc, char* argv[])
 			("postprocess,p", value<bool>(&postprocess)->default_value(false), "toggle segmentation postprocessing")
 			("gpu", value<bool>(&with_gpu)->default_value(true), "toggle GPU / CPU")
 			("gpu_id", value<unsigned int>(&gpu_device_id)->default_value(0), "GPU's device id")
+			("engine", value<string>(&engine)->default_value(face_seg::inferenceEngines().front()), "inference engine: caffe or opencv (OpenCV's DNN module)")
 			("landmarks,l", value<string>(&landmarks_path)->default_value(""), "path to landmarks model for face cropping")
+			("faces", value<string>(&faces)->default_value("main"), "faces to segment with landmarks: main (cropped mask), all (merged mask) or labeled (mask of face numbers)")
+			("reduced_decode", value<bool>(&reduced_decode)->default_value(false), "toggle decoding JPEG images at the lowest resolution the network needs")
+			("full_size_mask", value<bool>(&full_size_mask)->default_value(false), "toggle upsampling masks of reduced images to the full resolution")
+			("tile", value<unsigned int>(&tile)->default_value(0), "segment larger images in native resolution in overlapping tiles of this size (requires scale 0), 0 to disable")
+			("tile_overlap", value<unsigned int>(&tile_overlap)->default_value(64), "overlap between neighboring tiles in pixels")
             ("cfg", value<string>(&cfgPath)->default_value("face_seg_image.cfg"), "configuration file (.cfg)")
 			;
 		variables_map vm;
@@ -73,6 +80,10 @@ int main(int argc, char* argv[])
         if (!is_regular_file(deployPath)) throw error("deploy must be a path to a file!");
 		if (!landmarks_path.empty() && !is_regular_file(landmarks_path))
 			throw error("landmarks must be a path to a file!");
+		if (faces != "main" && faces != "all" && faces != "labeled")
+			throw error("faces must be main, all or labeled!");
+		if (tile > 0 && scale) throw error("tile requires scale to be disabled!");
+		if (tile > 0 && tile_overlap >= tile) throw error("tile_overlap must be smaller than tile!");
 	}
 	catch (const error& e) {
         cerr << "Error while parsing command-line arguments: " << e.what() << endl;
@@ -83,7 +94,8 @@ int main(int argc, char* argv[])
 	try
 	{
         // Initialize face segmentation
-		face_seg::FaceSeg fs(deployPath, modelPath, with_gpu, gpu_device_id, scale, postprocess);
+		face_seg::FaceSeg fs(deployPath, modelPath, with_gpu, gpu_device_id, scale, postprocess, engine);
+		if (tile > 0) fs.setTiling(cv::Size(tile, tile), (int)tile_overlap);
 
 #if WITH_FIND_FACE_LANDMARKS
 		// Initialize sequence face landmarks
@@ -92,27 +104,67 @@ int main(int argc, char* argv[])
 			_sfl = sfl::SequenceFaceLandmarks::create(landmarks_path);
 #endif	// WITH_FIND_FACE_LANDMARKS
         
-        // Read source image
-        cv::Mat source_img = cv::imread(inputPath);
+        // Read source image, reduced to the network's input size if requested
+        cv::Mat source_img;
+        cv::Size original_size;
+        std::vector<uchar> source_data;
+        if (reduced_decode)
+            source_img = face_seg::readImageReduced(inputPath, fs.inputSize(), &original_size, &source_data);
+        else source_img = cv::imread(inputPath);
+        if (source_img.empty()) throw std::runtime_error("Failed to read image!");
+        cv::Size decoded_size = source_img.size();
 
 #if WITH_FIND_FACE_LANDMARKS
-		// Crop source image
+		// Crop source image, or find all the faces
+		std::vector<cv::Rect> face_bboxes;
 		if (_sfl != nullptr)
 		{
 			_sfl->clear();
 			const sfl::Frame& lmsFrame = _sfl->addFrame(source_img);
 			if (lmsFrame.faces.empty())
 				throw std::runtime_error("Failed to find a face in the image!");
-			const sfl::Face* face = lmsFrame.getFace(sfl::getMainFaceID(_sfl->getSequence()));
-			cv::Rect bbox = sfl::getFaceBBoxFromLandmarks(face->landmarks, source_img.size(), true);
-			source_img = source_img(bbox).clone();
+			if (faces == "main")
+			{
+				const sfl::Face* face = lmsFrame.getFace(sfl::getMainFaceID(_sfl->getSequence()));
+				face_bboxes.push_back(sfl::getFaceBBoxFromLandmarks(face->landmarks, source_img.size(), true));
+			}
+			else
+			{
+				for (const auto& face : lmsFrame.faces)
+					face_bboxes.push_back(sfl::getFaceBBoxFromLandmarks(face->landmarks, source_img.size(), true));
+			}
+
+			// Faces smaller than the network's input in the reduced image are
+			// cropped from an image decoded at a higher resolution
+			if (reduced_decode && face_seg::decodeImageForRegions(source_data.data(), source_data.size(),
+				fs.inputSize(), source_img, face_bboxes))
+				decoded_size = source_img.size();
+			if (faces == "main")
+			{
+				source_img = source_img(face_bboxes[0]);
+				face_bboxes.clear();
+			}
 		}
 #endif	// WITH_FIND_FACE_LANDMARKS
 
-        // Do face segmentation
-		cv::Mat seg = fs.process(source_img);
+        // Do face segmentation, all the faces in a single forward pass
+		cv::Mat seg;
+#if WITH_FIND_FACE_LANDMARKS
+		if (!face_bboxes.empty())
+			fs.processRegions(source_img, face_bboxes, seg, faces == "labeled");
+		else
+#endif	// WITH_FIND_FACE_LANDMARKS
+			seg = fs.process(source_img);
 		if (seg.empty()) throw std::runtime_error("Face segmentation failed!");
 
+		// Upsample the mask of a reduced image to the original image's coordinates
+		if (reduced_decode && full_size_mask && decoded_size != original_size)
+		{
+			cv::Size seg_size(cvRound(seg.cols * (double)original_size.width / decoded_size.width),
+				cvRound(seg.rows * (double)original_size.height / decoded_size.height));
+			cv::resize(seg, seg, seg_size, 0, 0, cv::INTER_NEAREST);
+		}
+
         // Write output to file
         string filePath = outputPath;
         if (is_directory(outputPath))
@@ -126,8 +178,9 @@ int main(int argc, char* argv[])
         if (verbose > 0)
         {
             // Write rendered image
-			cv::Mat debug_render_img = source_img.clone();
-			face_seg::renderSegmentationBlend(debug_render_img, seg);
+			cv::Mat debug_render_img;
+			cv::resize(source_img, debug_render_img, seg.size(), 0, 0, cv::INTER_LINEAR);
+			face_seg::renderSegmentationBlend(debug_render_img, seg > 0);
             string debug_render_path = (path(filePath).parent_path() /=
                 (path(filePath).stem() += "_debug.jpg")).string();
             cv::imwrite(debug_render_path, debug_render_img);
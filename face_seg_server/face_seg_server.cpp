@@ -0,0 +1,344 @@
+// std
+#include <iostream>
+#include <fstream>
+#include <exception>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+
+// POSIX
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+
+// face_seg
+#include <face_seg/face_seg.h>
+#include <face_seg/face_seg_batcher.h>
+#include <face_seg/server_protocol.h>
+
+#if WITH_FIND_FACE_LANDMARKS
+// sfl
+#include <sfl/sequence_face_landmarks.h>
+#include <sfl/utilities.h>
+#endif	// WITH_FIND_FACE_LANDMARKS
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+
+static volatile std::sig_atomic_t g_stop = 0;
+
+static void onSignal(int)
+{
+	g_stop = 1;
+}
+
+/**	The resident models, shared by all the connections.
+*/
+class Models
+{
+public:
+	Models(std::shared_ptr<face_seg::FaceSeg> fs, int instances, int max_batch_size,
+		double max_wait, const string& landmarks_path)
+	{
+		// Concurrent requests are segmented in micro-batches by the batcher's
+		// own instances
+		if (max_batch_size > 1)
+			m_batcher = std::make_shared<face_seg::FaceSegBatcher>(fs, instances, max_batch_size, max_wait);
+
+		// All the instances share the trained weights of the first. On the GPU
+		// each instance runs a warm up pass, so the shared weights are synced
+		// to the device before they are accessed concurrently.
+		else for (int i = 0; i < instances; ++i)
+		{
+			m_free.push_back(i == 0 ? fs : fs->clone());
+			if (fs->withGpu()) m_free.back()->process(cv::Mat::zeros(fs->inputSize(), CV_8UC3));
+		}
+
+#if WITH_FIND_FACE_LANDMARKS
+		if (!landmarks_path.empty())
+			m_sfl = sfl::SequenceFaceLandmarks::create(landmarks_path);
+#else
+		(void)landmarks_path;
+#endif	// WITH_FIND_FACE_LANDMARKS
+	}
+
+	/**	Get the batcher, nullptr if requests are not batched.
+	*/
+	face_seg::FaceSegBatcher* batcher() const { return m_batcher.get(); }
+
+	/**	Take a free instance, waiting until one is available.
+	*/
+	std::shared_ptr<face_seg::FaceSeg> acquire()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_cond.wait(lock, [this]() { return !m_free.empty(); });
+		std::shared_ptr<face_seg::FaceSeg> fs = m_free.back();
+		m_free.pop_back();
+		return fs;
+	}
+
+	void release(std::shared_ptr<face_seg::FaceSeg> fs)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_free.push_back(fs);
+		}
+		m_cond.notify_one();
+	}
+
+	/**	Find the face's bounding box for cropping.
+	*/
+	cv::Rect faceBBox(const cv::Mat& img)
+	{
+#if WITH_FIND_FACE_LANDMARKS
+		if (m_sfl != nullptr)
+		{
+			std::lock_guard<std::mutex> lock(m_sfl_mutex);
+			m_sfl->clear();
+			const sfl::Frame& lmsFrame = m_sfl->addFrame(img);
+			if (lmsFrame.faces.empty())
+				throw std::runtime_error("Failed to find a face in the image!");
+			const sfl::Face* face = lmsFrame.getFace(sfl::getMainFaceID(m_sfl->getSequence()));
+			return sfl::getFaceBBoxFromLandmarks(face->landmarks, img.size(), true);
+		}
+#else
+		(void)img;
+#endif	// WITH_FIND_FACE_LANDMARKS
+		throw std::runtime_error("The server was started without a landmarks model!");
+	}
+
+private:
+	std::shared_ptr<face_seg::FaceSegBatcher> m_batcher;
+	std::vector<std::shared_ptr<face_seg::FaceSeg>> m_free;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+#if WITH_FIND_FACE_LANDMARKS
+	std::shared_ptr<sfl::SequenceFaceLandmarks> m_sfl;
+	std::mutex m_sfl_mutex;
+#endif	// WITH_FIND_FACE_LANDMARKS
+};
+
+/**	Segment the image in the shared memory and write the mask next to it.
+*/
+static void handleRequest(Models& models, const face_seg::ServerRequest& request,
+	face_seg::SharedMemory& shm, face_seg::ServerResponse& response)
+{
+	// Validate the request
+	if (request.magic != face_seg::SERVER_PROTOCOL_MAGIC ||
+		request.version != face_seg::SERVER_PROTOCOL_VERSION)
+		throw runtime_error("Unsupported protocol version!");
+	if (request.type != CV_8UC1 && request.type != CV_8UC3 && request.type != CV_8UC4)
+		throw runtime_error("Unsupported image type!");
+	// The sizes come from the client, so they are compared without products
+	// or sums that could wrap around
+	if (request.rows <= 0 || request.cols <= 0 ||
+		request.img_step < (uint64_t)request.cols * CV_ELEM_SIZE(request.type) ||
+		request.img_step > request.mask_offset / (uint64_t)request.rows ||
+		request.mask_offset > request.shm_size ||
+		(uint64_t)request.rows * (uint64_t)request.cols > request.shm_size - request.mask_offset)
+		throw runtime_error("Invalid image layout!");
+
+	// Map the client's shared memory, it's kept mapped until the client replaces it
+	string shm_name(request.shm_name, strnlen(request.shm_name, sizeof(request.shm_name)));
+	if (shm.name() != shm_name || shm.size() != request.shm_size)
+		shm.open(shm_name, (size_t)request.shm_size);
+	cv::Mat img(request.rows, request.cols, request.type, shm.data(), (size_t)request.img_step);
+
+	// Crop the face
+	cv::Rect bbox(0, 0, img.cols, img.rows);
+	if (request.flags & face_seg::SERVER_CROP_FACE)
+		bbox = models.faceBBox(img) & bbox;
+
+	// Segment directly into the shared memory
+	cv::Mat mask(bbox.size(), CV_8U, shm.data() + request.mask_offset);
+	if (models.batcher() != nullptr)
+	{
+		// The image is read from the shared memory until the future is ready
+		models.batcher()->submit(img(bbox)).get().copyTo(mask);
+		response.x = bbox.x;
+		response.y = bbox.y;
+		response.width = bbox.width;
+		response.height = bbox.height;
+		return;
+	}
+	std::shared_ptr<face_seg::FaceSeg> fs = models.acquire();
+	try
+	{
+		fs->initThread();
+		cv::Mat out_mask = mask;
+		fs->process(img(bbox), out_mask);
+		if (out_mask.data != mask.data) out_mask.copyTo(mask);
+	}
+	catch (...)
+	{
+		models.release(fs);
+		throw;
+	}
+	models.release(fs);
+
+	response.x = bbox.x;
+	response.y = bbox.y;
+	response.width = bbox.width;
+	response.height = bbox.height;
+}
+
+/**	Serve a single client until it disconnects.
+*/
+static void serveConnection(std::shared_ptr<Models> models, int fd)
+{
+	face_seg::SharedMemory shm;
+	face_seg::ServerRequest request;
+	while (face_seg::recvAll(fd, &request, sizeof(request)))
+	{
+		face_seg::ServerResponse response;
+		try
+		{
+			handleRequest(*models, request, shm, response);
+		}
+		catch (std::exception& e)
+		{
+			response = face_seg::ServerResponse();
+			response.status = 1;
+			std::strncpy(response.message, e.what(), sizeof(response.message) - 1);
+		}
+		if (!face_seg::sendAll(fd, &response, sizeof(response))) break;
+	}
+	close(fd);
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string socketPath, modelPath, deployPath, landmarks_path, engine, cfgPath;
+	unsigned int gpu_device_id, instances, max_batch;
+	float max_wait;
+	bool scale, postprocess, with_gpu;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("socket,s", value<string>(&socketPath)->default_value(face_seg::DEFAULT_SERVER_SOCKET), "path to the Unix domain socket")
+			("model,m", value<string>(&modelPath)->required(), "path to network weights model file  (.caffemodel)")
+			("deploy,d", value<string>(&deployPath)->required(), "path to network definition file for deployment (.prototxt)")
+			("instances,n", value<unsigned int>(&instances)->default_value(1), "number of concurrently running instances")
+			("max_batch", value<unsigned int>(&max_batch)->default_value(1), "maximum number of concurrent requests segmented in a single forward pass")
+			("max_wait", value<float>(&max_wait)->default_value(0.0f), "maximum time in ms a request waits for others to join its batch")
+			("scale", value<bool>(&scale)->default_value(true), "toggle scale image to network size")
+			("postprocess,p", value<bool>(&postprocess)->default_value(false), "toggle segmentation postprocessing")
+			("gpu", value<bool>(&with_gpu)->default_value(true), "toggle GPU / CPU")
+			("gpu_id", value<unsigned int>(&gpu_device_id)->default_value(0), "GPU's device id")
+			("engine", value<string>(&engine)->default_value(face_seg::inferenceEngines().front()), "inference engine: caffe or opencv (OpenCV's DNN module)")
+			("landmarks,l", value<string>(&landmarks_path)->default_value(""), "path to landmarks model for face cropping")
+			("cfg", value<string>(&cfgPath)->default_value("face_seg_server.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: face_seg_server [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (!is_regular_file(modelPath)) throw error("model must be a path to a file!");
+		if (!is_regular_file(deployPath)) throw error("deploy must be a path to a file!");
+		if (!landmarks_path.empty() && !is_regular_file(landmarks_path))
+			throw error("landmarks must be a path to a file!");
+		if (instances == 0) throw error("instances must be positive!");
+		if (max_batch == 0) throw error("max_batch must be positive!");
+		if (max_wait < 0.0f) throw error("max_wait must not be negative!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		// Load the models once
+		auto fs = std::make_shared<face_seg::FaceSeg>(deployPath, modelPath,
+			with_gpu, gpu_device_id, scale, postprocess, engine);
+		auto models = std::make_shared<Models>(fs, (int)instances, (int)max_batch,
+			max_wait / 1000.0, landmarks_path);
+
+		// Listen on the socket
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (socketPath.size() >= sizeof(addr.sun_path))
+			throw runtime_error("Socket path is too long!");
+		std::strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+		int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (server_fd < 0) throw runtime_error(string("Failed to create socket: ") + strerror(errno));
+		unlink(socketPath.c_str());
+		if (bind(server_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(server_fd, 64) != 0)
+			throw runtime_error("Failed to listen on \"" + socketPath + "\": " + strerror(errno));
+
+		// Stop on SIGINT and SIGTERM, accept() is interrupted because the
+		// handlers are installed without SA_RESTART
+		struct sigaction action = {};
+		action.sa_handler = onSignal;
+		sigaction(SIGINT, &action, nullptr);
+		sigaction(SIGTERM, &action, nullptr);
+		signal(SIGPIPE, SIG_IGN);
+		cout << "Listening on \"" << socketPath << "\" with " << instances << " instance(s)" << endl;
+
+		// Serve each client on its own thread
+		while (!g_stop)
+		{
+			int fd = accept(server_fd, nullptr, nullptr);
+			if (fd < 0)
+			{
+				if (errno == EINTR) continue;
+				throw runtime_error(string("Failed to accept a connection: ") + strerror(errno));
+			}
+			std::thread(serveConnection, models, fd).detach();
+		}
+
+		close(server_fd);
+		unlink(socketPath.c_str());
+
+		// Report the batching statistics
+		if (models->batcher() != nullptr)
+		{
+			face_seg::Histogram batch_sizes = models->batcher()->batchSizes();
+			face_seg::Histogram queue_depths = models->batcher()->queueDepths();
+			face_seg::Histogram queue_times = models->batcher()->queueTimes();
+			cout << "Batches: " << batch_sizes.count() << ", mean size " << batch_sizes.mean() <<
+				", max size " << batch_sizes.max() << endl;
+			cout << "Queue depth: mean " << queue_depths.mean() << ", max " << queue_depths.max() << endl;
+			cout << "Queue time: mean " << queue_times.mean() * 1000.0 << " ms, p99 " <<
+				queue_times.percentile(99) * 1000.0 << " ms" << endl;
+		}
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,310 @@
+// std
+#include <iostream>
+#include <fstream>
+#include <exception>
+
+// Boost
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/format.hpp>
+#include <boost/timer/timer.hpp>
+
+// OpenCV
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui.hpp>
+#include <opencv2/videoio.hpp>
+
+// face_seg
+#include <face_seg/face_seg.h>
+#include <face_seg/utilities.h>
+
+#if WITH_FIND_FACE_LANDMARKS
+// sfl
+#include <sfl/sequence_face_landmarks.h>
+#include <sfl/utilities.h>
+#endif	// WITH_FIND_FACE_LANDMARKS
+
+
+using std::cout;
+using std::endl;
+using std::cerr;
+using std::string;
+using std::runtime_error;
+using namespace boost::program_options;
+using namespace boost::filesystem;
+
+/** Writes the segmentation masks either to a video file or to an image
+	sequence (when the output path contains a printf style pattern).
+	Lossless videos are encoded with FFV1 (e.g. in .avi or .mkv), so the
+	decoded masks remain binary, others with MJPG.
+*/
+class MaskWriter
+{
+public:
+	MaskWriter(const string& output_path, double fps, bool lossless) :
+		m_output_path(output_path), m_fps(fps > 0 ? fps : 25.0),
+		m_sequence(output_path.find('%') != string::npos), m_lossless(lossless)
+	{
+	}
+
+	void write(const cv::Mat& img)
+	{
+		if (m_sequence)
+		{
+			string img_path = (boost::format(m_output_path) % m_frame_count++).str();
+			if (!cv::imwrite(img_path, img))
+				throw runtime_error("Failed to write \"" + img_path + "\"!");
+			return;
+		}
+
+		if (!m_writer.isOpened())
+		{
+			int fourcc = m_lossless ? cv::VideoWriter::fourcc('F', 'F', 'V', '1') :
+				cv::VideoWriter::fourcc('M', 'J', 'P', 'G');
+			m_writer.open(m_output_path, fourcc, m_fps, img.size(), img.channels() == 3);
+			if (!m_writer.isOpened())
+				throw runtime_error("Failed to open \"" + m_output_path + "\" for writing" +
+					(m_lossless ? " with FFV1, use an .avi or .mkv file or an image sequence!" : "!"));
+		}
+		m_writer.write(img);
+	}
+
+private:
+	string m_output_path;
+	double m_fps;
+	bool m_sequence;
+	bool m_lossless;
+	int m_frame_count = 0;
+	cv::VideoWriter m_writer;
+};
+
+/** Create a small grayscale thumbnail of a frame, for comparing frames.
+*/
+cv::Mat createThumbnail(const cv::Mat& frame)
+{
+	cv::Mat gray, thumb;
+	if (frame.channels() == 3) cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+	else gray = frame;
+	cv::resize(gray, thumb, cv::Size(64, 64), 0, 0, cv::INTER_AREA);
+	return thumb;
+}
+
+/** Measure the change between two frames as the mean absolute difference
+	of their small grayscale thumbnails, in the range [0, 1].
+*/
+float frameChange(const cv::Mat& thumb1, const cv::Mat& thumb2)
+{
+	cv::Mat diff;
+	cv::absdiff(thumb1, thumb2, diff);
+	return (float)(cv::mean(diff)[0] / 255.0);
+}
+
+/** Measure the change between two face regions as the largest displacement
+	of their edges, relative to the size of the first region.
+*/
+float roiChange(const cv::Rect& roi1, const cv::Rect& roi2)
+{
+	int d = std::max(std::max(std::abs(roi1.x - roi2.x), std::abs(roi1.y - roi2.y)),
+		std::max(std::abs(roi1.br().x - roi2.br().x), std::abs(roi1.br().y - roi2.br().y)));
+	return (float)d / std::max(std::max(roi1.width, roi1.height), 1);
+}
+
+int main(int argc, char* argv[])
+{
+	// Parse command line arguments
+	string inputPath, outputPath, modelPath, deployPath, landmarks_path, engine, cfgPath;
+	unsigned int verbose, gpu_device_id, keyframe_interval;
+	bool scale, postprocess, with_gpu, temporal;
+	float change_threshold;
+	try {
+		options_description desc("Allowed options");
+		desc.add_options()
+			("help,h", "display the help message")
+			("verbose,v", value<unsigned int>(&verbose)->default_value(0), "output debug information")
+			("input,i", value<string>(&inputPath)->required(), "path to video file or image sequence pattern (e.g. frame_%04d.jpg)")
+			("output,o", value<string>(&outputPath)->required(), "path to output mask video file (lossless FFV1, .avi or .mkv) or image sequence pattern (e.g. mask_%04d.png)")
+			("model,m", value<string>(&modelPath)->required(), "path to network weights model file  (.caffemodel)")
+			("deploy,d", value<string>(&deployPath)->required(), "path to network definition file for deployment (.prototxt)")
+			("scale,s", value<bool>(&scale)->default_value(true), "toggle scale image to network size")
+			("postprocess,p", value<bool>(&postprocess)->default_value(false), "toggle segmentation postprocessing")
+			("gpu", value<bool>(&with_gpu)->default_value(true), "toggle GPU / CPU")
+			("gpu_id", value<unsigned int>(&gpu_device_id)->default_value(0), "GPU's device id")
+			("engine", value<string>(&engine)->default_value(face_seg::inferenceEngines().front()), "inference engine: caffe or opencv (OpenCV's DNN module)")
+			("landmarks,l", value<string>(&landmarks_path)->default_value(""), "path to landmarks model for face cropping")
+			("temporal,t", value<bool>(&temporal)->default_value(false), "toggle running the network only on keyframes and propagating the segmentation in between")
+			("keyframe_interval,k", value<unsigned int>(&keyframe_interval)->default_value(10), "maximum number of frames between keyframes in temporal mode")
+			("change_threshold", value<float>(&change_threshold)->default_value(0.05f), "frame (or face region) change that triggers a new keyframe in temporal mode [0, 1]")
+			("cfg", value<string>(&cfgPath)->default_value("face_seg_video.cfg"), "configuration file (.cfg)")
+			;
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).
+			positional(positional_options_description().add("input", -1)).run(), vm);
+
+		if (vm.count("help")) {
+			cout << "Usage: face_seg_video [options]" << endl;
+			cout << desc << endl;
+			exit(0);
+		}
+
+		// Read config file
+		std::ifstream ifs(vm["cfg"].as<string>());
+		store(parse_config_file(ifs, desc), vm);
+
+		notify(vm);
+
+		if (inputPath.find('%') == string::npos && !is_regular_file(inputPath))
+			throw error("input must be a path to a video file or an image sequence pattern!");
+		if (!is_regular_file(modelPath)) throw error("model must be a path to a file!");
+		if (!is_regular_file(deployPath)) throw error("deploy must be a path to a file!");
+		if (!landmarks_path.empty() && !is_regular_file(landmarks_path))
+			throw error("landmarks must be a path to a file!");
+		if (keyframe_interval == 0) throw error("keyframe_interval must be greater than 0!");
+	}
+	catch (const error& e) {
+		cerr << "Error while parsing command-line arguments: " << e.what() << endl;
+		cerr << "Use --help to display a list of options." << endl;
+		exit(1);
+	}
+
+	try
+	{
+		// Initialize face segmentation
+		face_seg::FaceSeg fs(deployPath, modelPath, with_gpu, gpu_device_id, scale, postprocess, engine);
+
+#if WITH_FIND_FACE_LANDMARKS
+		// Initialize sequence face landmarks
+		std::shared_ptr<sfl::SequenceFaceLandmarks> _sfl;
+		if (!landmarks_path.empty())
+			_sfl = sfl::SequenceFaceLandmarks::create(landmarks_path);
+#endif	// WITH_FIND_FACE_LANDMARKS
+
+		// Open input video
+		cv::VideoCapture cap(inputPath);
+		if (!cap.isOpened())
+			throw runtime_error("Failed to open \"" + inputPath + "\"!");
+		MaskWriter mask_writer(outputPath, cap.get(cv::CAP_PROP_FPS), true);
+		std::unique_ptr<MaskWriter> debug_writer;
+		if (verbose > 0)
+		{
+			path debug_path = path(outputPath).parent_path() /=
+				(path(outputPath).stem() += "_debug" + path(outputPath).extension().string());
+			debug_writer.reset(new MaskWriter(debug_path.string(), cap.get(cv::CAP_PROP_FPS), false));
+		}
+
+		// Initialize timer
+		boost::timer::cpu_timer timer;
+		float frame_delta_time = 0.0f;
+
+		// Keyframe state
+		cv::Mat key_seg, key_thumb;
+		cv::Rect key_roi;
+		unsigned int frames_since_key = 0;
+		size_t frame_count = 0, keyframe_count = 0;
+
+		// For each frame
+		cv::Mat frame, seg;
+		while (cap.read(frame))
+		{
+			// Start measuring time
+			timer.start();
+
+			// Face region, the entire frame unless landmarks are used
+			cv::Rect roi(0, 0, frame.cols, frame.rows);
+			bool found_face = true;
+
+#if WITH_FIND_FACE_LANDMARKS
+			if (_sfl != nullptr)
+			{
+				_sfl->clear();
+				const sfl::Frame& lmsFrame = _sfl->addFrame(frame);
+				found_face = !lmsFrame.faces.empty();
+				if (found_face)
+				{
+					const sfl::Face* face = lmsFrame.getFace(sfl::getMainFaceID(_sfl->getSequence()));
+					roi = sfl::getFaceBBoxFromLandmarks(face->landmarks, frame.size(), true);
+				}
+			}
+#endif	// WITH_FIND_FACE_LANDMARKS
+
+			// Decide whether this frame is a keyframe
+			bool keyframe = true;
+			cv::Mat thumb;
+			if (temporal && !key_seg.empty() && found_face && frames_since_key < keyframe_interval)
+			{
+				float change;
+				if (roi.size() == frame.size())
+				{
+					thumb = createThumbnail(frame);
+					change = frameChange(key_thumb, thumb);
+				}
+				else change = roiChange(key_roi, roi);
+				keyframe = change > change_threshold;
+			}
+
+			if (!found_face)
+			{
+				// No face, empty segmentation
+				seg = cv::Mat::zeros(frame.size(), CV_8U);
+				key_seg.release();
+			}
+			else if (keyframe)
+			{
+				// Do face segmentation on the face region of the frame
+				seg = fs.process(frame, roi);
+
+				key_seg = seg;
+				key_roi = roi;
+				key_thumb = thumb.empty() && temporal ? createThumbnail(frame) : thumb;
+				frames_since_key = 0;
+				++keyframe_count;
+			}
+			else
+			{
+				// Propagate the keyframe segmentation by the face region motion
+				if (roi != key_roi)
+				{
+					float sx = (float)roi.width / key_roi.width;
+					float sy = (float)roi.height / key_roi.height;
+					cv::Matx23f M(sx, 0, roi.x - key_roi.x * sx, 0, sy, roi.y - key_roi.y * sy);
+					cv::warpAffine(key_seg, seg, M, frame.size(), cv::INTER_NEAREST);
+				}
+				else seg = key_seg;
+				++frames_since_key;
+			}
+			++frame_count;
+
+			// Stop measuring time
+			timer.stop();
+
+			// Write output
+			mask_writer.write(seg);
+
+			// Print current timing
+			frame_delta_time += (timer.elapsed().wall*1.0e-9 - frame_delta_time)*0.1f;
+			if (verbose > 0)
+			{
+				std::cout << "Frame " << frame_count << (keyframe ? " (keyframe)" : "") <<
+					": timing = " << frame_delta_time << "s (" << (1.0f / frame_delta_time) <<
+					" fps)" << std::endl;
+
+				// Write rendered frame
+				cv::Mat debug_render_img = frame.clone();
+				face_seg::renderSegmentationBlend(debug_render_img, seg);
+				debug_writer->write(debug_render_img);
+			}
+		}
+
+		// Print statistics
+		std::cout << "Segmented " << frame_count << " frames, " << keyframe_count <<
+			" keyframes. Average timing = " << frame_delta_time << "s (" <<
+			(1.0f / frame_delta_time) << " fps)" << std::endl;
+	}
+	catch (std::exception& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
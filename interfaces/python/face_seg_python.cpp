@@ -0,0 +1,322 @@
+// std
+#include <mutex>
+#include <functional>
+#include <stdexcept>
+
+// pybind11
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+// face_seg
+#include <face_seg/face_seg.h>
+#include <face_seg/face_seg_pool.h>
+#include <face_seg/utilities.h>
+
+namespace py = pybind11;
+
+/**	Check whether a NumPy array can be wrapped as a Mat: 8-bit, H x W or
+	H x W x C with 1, 3 or 4 channels, and each row contiguous.
+*/
+static bool isMatCompatible(const py::array& array)
+{
+	if (!py::array_t<uint8_t>::check_(array)) return false;
+	if (array.ndim() == 2)
+		return array.strides(1) == 1 && array.strides(0) >= array.shape(1);
+	if (array.ndim() != 3) return false;
+	py::ssize_t channels = array.shape(2);
+	return (channels == 1 || channels == 3 || channels == 4) &&
+		array.strides(2) == 1 && array.strides(1) == channels &&
+		array.strides(0) >= array.shape(1) * channels;
+}
+
+/**	Wrap a NumPy array as a Mat without copying.
+	Arrays that can't be wrapped are converted to a contiguous 8-bit copy,
+	which replaces the array, unless the Mat is written to.
+	@param array H x W or H x W x C array.
+	@param writable The Mat is written to, so it must share the array's data.
+*/
+static cv::Mat toMat(py::array& array, bool writable = false)
+{
+	if (!isMatCompatible(array))
+	{
+		if (writable)
+			throw std::invalid_argument("Array must be 8-bit with contiguous rows to be modified in place!");
+		array = py::array_t<uint8_t, py::array::c_style | py::array::forcecast>::ensure(array);
+		if (!array || !isMatCompatible(array))
+			throw std::invalid_argument("Array must be H x W or H x W x C with 1, 3 or 4 channels!");
+	}
+	if (writable && !array.writeable())
+		throw std::invalid_argument("Array must be writable!");
+
+	int channels = array.ndim() == 3 ? (int)array.shape(2) : 1;
+	return cv::Mat((int)array.shape(0), (int)array.shape(1), CV_8UC(channels),
+		const_cast<void*>(array.data()), (size_t)array.strides(0));
+}
+
+/**	Wrap a Mat as a NumPy array without copying, the array keeps a reference
+	to the Mat's data.
+*/
+static py::array toArray(const cv::Mat& mat)
+{
+	cv::Mat* owner = new cv::Mat(mat);
+	py::capsule base(owner, [](void* p) { delete static_cast<cv::Mat*>(p); });
+	std::vector<py::ssize_t> shape = { mat.rows, mat.cols };
+	std::vector<py::ssize_t> strides = { (py::ssize_t)mat.step[0], (py::ssize_t)mat.elemSize() };
+	if (mat.channels() > 1)
+	{
+		shape.push_back(mat.channels());
+		strides.push_back((py::ssize_t)mat.elemSize1());
+	}
+	return py::array(py::dtype::of<uint8_t>(), shape, strides, mat.data, base);
+}
+
+/**	Wrap a list of images, or the first axis of an N x H x W x C array.
+*/
+static std::vector<cv::Mat> toMats(py::object imgs, std::vector<py::array>& arrays)
+{
+	if (py::isinstance<py::array>(imgs) && imgs.cast<py::array>().ndim() == 4)
+	{
+		py::array batch = imgs.cast<py::array>();
+		for (py::ssize_t i = 0; i < batch.shape(0); ++i)
+			arrays.push_back(batch[py::int_(i)].cast<py::array>());
+	}
+	else
+		for (py::handle img : imgs)
+		{
+			arrays.push_back(py::array::ensure(img));
+			if (!arrays.back()) throw std::invalid_argument("Images must be arrays!");
+		}
+
+	std::vector<cv::Mat> mats;
+	for (py::array& array : arrays)
+		mats.push_back(toMat(array));
+	return mats;
+}
+
+static py::list toList(const std::vector<cv::Mat>& mats)
+{
+	py::list list;
+	for (const cv::Mat& mat : mats)
+		list.append(toArray(mat));
+	return list;
+}
+
+/**	FaceSeg that can be called from any Python thread.
+	The calls are serialized per instance and run without the GIL, use
+	clone to segment in parallel from several threads.
+*/
+class PyFaceSeg
+{
+public:
+	PyFaceSeg(const std::string& deploy_file, const std::string& model_file,
+		bool with_gpu, int gpu_device_id, bool scale, bool postprocess_seg,
+		const std::string& engine) :
+		m_fs(std::make_shared<face_seg::FaceSeg>(deploy_file, model_file, with_gpu,
+			gpu_device_id, scale, postprocess_seg, engine))
+	{
+	}
+
+	explicit PyFaceSeg(std::shared_ptr<face_seg::FaceSeg> fs) : m_fs(fs) {}
+
+	py::array process(py::array img)
+	{
+		cv::Mat mat = toMat(img), seg;
+		{
+			py::gil_scoped_release release;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			initThread();
+			seg = m_fs->process(mat);
+		}
+		return toArray(seg);
+	}
+
+	py::list processBatch(py::object imgs)
+	{
+		std::vector<py::array> arrays;
+		std::vector<cv::Mat> mats = toMats(imgs, arrays), segs;
+		{
+			py::gil_scoped_release release;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			initThread();
+			segs = m_fs->processBatch(mats);
+		}
+		return toList(segs);
+	}
+
+	py::array processRegions(py::array frame, const std::vector<std::vector<int>>& rois, bool labeled)
+	{
+		std::vector<cv::Rect> rects;
+		for (const std::vector<int>& roi : rois)
+		{
+			if (roi.size() != 4) throw std::invalid_argument("Regions must be (x, y, width, height)!");
+			rects.emplace_back(roi[0], roi[1], roi[2], roi[3]);
+		}
+		cv::Mat mat = toMat(frame), seg;
+		{
+			py::gil_scoped_release release;
+			std::lock_guard<std::mutex> lock(m_mutex);
+			initThread();
+			m_fs->processRegions(mat, rects, seg, labeled);
+		}
+		return toArray(seg);
+	}
+
+	std::unique_ptr<PyFaceSeg> clone() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return std::unique_ptr<PyFaceSeg>(new PyFaceSeg(m_fs->clone()));
+	}
+
+	void setReshapeCache(int step, int capacity)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_fs->setReshapeCache(step, capacity);
+	}
+
+	void setTiling(const std::pair<int, int>& tile_size, int overlap, int batch_size)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_fs->setTiling(cv::Size(tile_size.first, tile_size.second), overlap, batch_size);
+	}
+
+	py::dict lastTimings() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const face_seg::StageTimings& timings = m_fs->lastTimings();
+		py::dict dict;
+		dict["preprocess"] = timings.preprocess;
+		dict["forward"] = timings.forward;
+		dict["argmax"] = timings.argmax;
+		dict["postprocess"] = timings.postprocess;
+		dict["upsample"] = timings.upsample;
+		return dict;
+	}
+
+	std::pair<int, int> inputSize() const
+	{
+		return std::make_pair(m_fs->inputSize().width, m_fs->inputSize().height);
+	}
+
+	bool withGpu() const { return m_fs->withGpu(); }
+
+	std::shared_ptr<face_seg::FaceSeg> faceSeg() const { return m_fs; }
+
+private:
+	/**	Setup the engine the first time this instance is used by the calling
+		thread, or when the thread last used another instance.
+	*/
+	void initThread()
+	{
+		static thread_local const face_seg::FaceSeg* last = nullptr;
+		if (last == m_fs.get()) return;
+		m_fs->initThread();
+		last = m_fs.get();
+	}
+
+private:
+	std::shared_ptr<face_seg::FaceSeg> m_fs;
+	mutable std::mutex m_mutex;
+};
+
+PYBIND11_MODULE(face_segmentation, m)
+{
+	m.doc() = "Deep face segmentation. Images are 8-bit BGR (or grayscale) NumPy arrays, "
+		"that are read and returned without copying.";
+
+	py::class_<PyFaceSeg>(m, "FaceSeg")
+		.def(py::init<const std::string&, const std::string&, bool, int, bool, bool, const std::string&>(),
+			py::arg("deploy_file"), py::arg("model_file"), py::arg("with_gpu") = true,
+			py::arg("gpu_device_id") = 0, py::arg("scale") = true, py::arg("postprocess_seg") = false,
+			py::arg("engine") = "",
+			"Load the network, see face_seg::FaceSeg.")
+		.def("process", &PyFaceSeg::process, py::arg("img"),
+			"Segment an image, returns the 8-bit mask (255 for face pixels).")
+		.def("process_batch", &PyFaceSeg::processBatch, py::arg("imgs"),
+			"Segment a list of images, or an N x H x W x C array, in a single forward pass. "
+			"Returns a list of masks.")
+		.def("process_regions", &PyFaceSeg::processRegions, py::arg("frame"), py::arg("rois"),
+			py::arg("labeled") = false,
+			"Segment several (x, y, width, height) regions of a frame in a single forward pass, "
+			"returns the mask of the whole frame.")
+		.def("clone", &PyFaceSeg::clone,
+			"Create an instance sharing the trained weights, for segmenting from another thread.")
+		.def("set_reshape_cache", &PyFaceSeg::setReshapeCache, py::arg("step"), py::arg("capacity"))
+		.def("set_tiling", &PyFaceSeg::setTiling, py::arg("tile_size"), py::arg("overlap") = 64,
+			py::arg("batch_size") = 4,
+			"Segment large images in overlapping tiles of (width, height) when scale is disabled.")
+		.def_property_readonly("last_timings", &PyFaceSeg::lastTimings,
+			"The time in seconds spent in each stage by the last call.")
+		.def_property_readonly("input_size", &PyFaceSeg::inputSize)
+		.def_property_readonly("with_gpu", &PyFaceSeg::withGpu);
+
+	py::class_<face_seg::FaceSegPool>(m, "FaceSegPool")
+		.def(py::init([](const PyFaceSeg& fs, int instances)
+			{
+				return new face_seg::FaceSegPool(fs.faceSeg(), instances);
+			}), py::arg("fs"), py::arg("instances"),
+			"Create instances sharing the trained weights of fs, each on its own thread. "
+			"fs must not be used while the pool exists.")
+		.def("process", [](face_seg::FaceSegPool& pool, py::object imgs)
+			{
+				std::vector<py::array> arrays;
+				std::vector<cv::Mat> mats = toMats(imgs, arrays), segs;
+				{
+					py::gil_scoped_release release;
+					segs = pool.process(mats);
+				}
+				return toList(segs);
+			}, py::arg("imgs"),
+			"Segment a list of images in parallel, returns a list of masks.")
+		.def_property_readonly("size", &face_seg::FaceSegPool::size);
+
+	m.def("render_segmentation_blend", [](py::array img, py::array seg, float alpha,
+		const std::tuple<double, double, double>& color)
+		{
+			cv::Mat img_mat = toMat(img, true), seg_mat = toMat(seg);
+			py::gil_scoped_release release;
+			face_seg::renderSegmentationBlend(img_mat, seg_mat, alpha,
+				cv::Scalar(std::get<0>(color), std::get<1>(color), std::get<2>(color)));
+		}, py::arg("img"), py::arg("seg"), py::arg("alpha") = 0.5f,
+		py::arg("color") = std::make_tuple(0.0, 0.0, 255.0),
+		"Blend the segmentation with the image in place.");
+
+	/**	Apply a utility function to a mask in place.
+	*/
+	auto inPlace = [](py::array& seg, const std::function<void(cv::Mat&)>& f)
+	{
+		cv::Mat mat = toMat(seg, true), out = mat;
+		{
+			py::gil_scoped_release release;
+			f(out);
+		}
+		if (out.data != mat.data) out.copyTo(mat);
+	};
+	m.def("remove_smaller_components", [inPlace](py::array seg)
+		{
+			inPlace(seg, [](cv::Mat& mat) { face_seg::removeSmallerComponents(mat); });
+		}, py::arg("seg"), "Remove all but the largest connected component of the mask in place.");
+	m.def("smooth_flaws", [inPlace](py::array seg, int smooth_iterations, int smooth_kernel_radius)
+		{
+			inPlace(seg, [&](cv::Mat& mat)
+			{
+				face_seg::smoothFlaws(mat, smooth_iterations, smooth_kernel_radius);
+			});
+		}, py::arg("seg"), py::arg("smooth_iterations") = 1, py::arg("smooth_kernel_radius") = 2,
+		"Smooth the mask in place using morphological open and close.");
+	m.def("fill_holes", [inPlace](py::array seg)
+		{
+			inPlace(seg, [](cv::Mat& mat) { face_seg::fillHoles(mat); });
+		}, py::arg("seg"), "Fill the holes of the mask in place.");
+	m.def("postprocess_segmentation", [inPlace](py::array seg, bool disconnected, bool holes,
+		bool smooth, int smooth_iterations, int smooth_kernel_radius)
+		{
+			inPlace(seg, [&](cv::Mat& mat)
+			{
+				face_seg::postprocessSegmentation(mat, disconnected, holes, smooth,
+					smooth_iterations, smooth_kernel_radius);
+			});
+		}, py::arg("seg"), py::arg("disconnected") = true, py::arg("holes") = true,
+		py::arg("smooth") = true, py::arg("smooth_iterations") = 1, py::arg("smooth_kernel_radius") = 2,
+		"Remove smaller components, fill holes and smooth the mask in place.");
+}